@@ -0,0 +1,733 @@
+﻿#include "../PlayerKernel/Bgm.h"
+#include "../PlayerKernel/BgmCache.h"
+#include "../PlayerKernel/BgmCodec.h"
+#include "../PlayerKernel/BgmDecode.h"
+#include "../PlayerKernel/BgmLoop.h"
+#include "../PlayerKernel/BgmLoudness.h"
+#include "../PlayerKernel/BgmPack.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <SFML/System/FileInputStream.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+using namespace std;
+
+namespace {
+// Allocations and frees made by the callbacks of a music while armed, see `rtcheck`.
+atomic<bool>     allocationsArmed{ false };
+atomic<uint64_t> audioAllocations{ 0 };
+
+void countAllocation() {
+	if (allocationsArmed && bgm::Music::isInAudioCallback()) {
+		++audioAllocations;
+	}
+}
+}
+
+// Only sees the heap of this module: with a shared CRT, the allocations made inside the SFML and codec DLLs are not counted.
+void* operator new(size_t size) {
+	countAllocation();
+	if (void* p = malloc(size != 0 ? size : 1)) {
+		return p;
+	}
+	throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+	if (p != nullptr) {
+		countAllocation();
+	}
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	operator delete(p);
+}
+
+namespace {
+
+int usage() {
+	cout << "Usage:\n"
+		"  BgmTool pack <output> <file or directory>...\n"
+		"  BgmTool list <pack>\n"
+		"  BgmTool bench <pack> <directory> [count]\n"
+		"  BgmTool codec <file>\n"
+		"  BgmTool decode <file> [threads]...\n"
+		"  BgmTool rtcheck <file> [seconds] [read-ahead blocks]\n"
+		"  BgmTool events <file> [seconds]\n"
+		"  BgmTool snapshot <file> [calls]\n"
+		"  BgmTool pipe <seconds> < <file>\n"
+		"  BgmTool loudness [--save] <file or directory>...\n"
+		"  BgmTool loopfind <file>...\n"
+		"  BgmTool seamcheck <file or directory>...\n"
+		"  BgmTool tag [--time] <offset> <length> <file>...\n"
+		"  BgmTool tag [--time] --list <list>\n"
+		"  BgmTool verify <file or directory>...\n"
+		"  BgmTool crcbench <MiB>\n";
+	return 1;
+}
+
+bool isMusic(const filesystem::path& path) {
+	const auto ext = path.extension();
+	return ext == ".ogg" || ext == ".flac";
+}
+
+// The files given, and the musics found in the directories given.
+vector<filesystem::path> collectMusics(int first, int argc, char* argv[]) {
+	vector<filesystem::path> files;
+	for (int i = first; i < argc; ++i) {
+		const filesystem::path input = argv[i];
+		if (filesystem::is_directory(input)) {
+			for (const auto& item : filesystem::recursive_directory_iterator(input)) {
+				if (item.is_regular_file() && isMusic(item.path())) {
+					files.push_back(item.path());
+				}
+			}
+		}
+		else {
+			files.push_back(input);
+		}
+	}
+	return files;
+}
+
+int pack(int argc, char* argv[]) {
+	vector<pair<string, filesystem::path>> files;
+	for (int i = 3; i < argc; ++i) {
+		const filesystem::path input = argv[i];
+		if (filesystem::is_directory(input)) {
+			// Entries are named by their path in the directory.
+			for (const auto& item : filesystem::recursive_directory_iterator(input)) {
+				if (item.is_regular_file() && isMusic(item.path())) {
+					files.emplace_back(filesystem::relative(item.path(), input).generic_string(), item.path());
+				}
+			}
+		}
+		else {
+			files.emplace_back(input.filename().generic_string(), input);
+		}
+	}
+
+	if (!bgm::Pack::build(argv[2], files)) {
+		cerr << "Failed to build pack.\n";
+		return 2;
+	}
+	cout << files.size() << " musics packed into " << argv[2] << "\n";
+	return 0;
+}
+
+int list(int argc, char* argv[]) {
+	(void)argc;
+	bgm::Pack pack;
+	if (!pack.open(argv[2])) {
+		return 2;
+	}
+	for (const bgm::Pack::Entry& entry : pack.getEntries()) {
+		cout << entry.getName() << "\t" << entry.size << " bytes\t" << entry.sampleRate << " Hz\t" << entry.channelCount << " ch\t" << entry.pointCount << " seek points\n";
+	}
+	return 0;
+}
+
+// Opens the entries of the pack, then the same musics as loose files in the directory.
+int bench(int argc, char* argv[]) {
+	bgm::Pack pack;
+	if (!pack.open(argv[2]) || pack.getEntries().empty()) {
+		return 2;
+	}
+	const filesystem::path directory = argv[3];
+	const size_t count = argc >= 5 ? stoul(argv[4]) : 1000;
+
+	const auto run = [&](auto open) {
+		bgm::Music music;
+		const auto start = chrono::steady_clock::now();
+		size_t failed = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const bgm::Pack::Entry& entry = pack.getEntries()[i % pack.getEntries().size()];
+			if (!open(music, entry)) {
+				++failed;
+			}
+		}
+		const auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+		return make_pair(elapsed, failed);
+	};
+
+	const auto [packed, packedFailed] = run([&pack](bgm::Music& music, const bgm::Pack::Entry& entry) {
+		return music.openFromPack(pack, entry.getName());
+	});
+	const auto [loose, looseFailed] = run([&directory](bgm::Music& music, const bgm::Pack::Entry& entry) {
+		return music.openFromFile(directory / filesystem::path(string(entry.getName())));
+	});
+
+	cout << count << " opens\n";
+	cout << "pack:  " << packed.count() << " us, " << packed.count() / static_cast<long long>(count) << " us each, " << packedFailed << " failed\n";
+	cout << "loose: " << loose.count() << " us, " << loose.count() / static_cast<long long>(count) << " us each, " << looseFailed << " failed\n";
+	return 0;
+}
+
+// Compares the block codec of cached pcm with the raw samples and with decoding the file.
+int codec(int argc, char* argv[]) {
+	(void)argc;
+	sf::InputSoundFile file;
+	if (!file.openFromFile(argv[2])) {
+		return 2;
+	}
+	vector<int16_t> samples(static_cast<size_t>(file.getSampleCount()));
+	auto start = chrono::steady_clock::now();
+	samples.resize(static_cast<size_t>(file.read(samples.data(), samples.size())));
+	const auto decoded = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+	start = chrono::steady_clock::now();
+	const auto packed = bgm::CompressedPcm::encode(samples.data(), samples.size(), file.getChannelCount());
+	const auto encoded = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+	vector<int16_t> block(bgm::CompressedPcm::BlockFrames * file.getChannelCount());
+	bool same = true;
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < packed->getBlockCount(); ++i) {
+		packed->decodeBlock(i, block.data());
+		same = same && equal(block.begin(), block.begin() + packed->getBlockSize(i), samples.begin() + i * block.size());
+	}
+	const auto unpacked = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+	const double seconds = static_cast<double>(samples.size()) / file.getChannelCount() / file.getSampleRate();
+	cout << "raw:     " << samples.size() * sizeof(int16_t) << " bytes, " << seconds << " s\n";
+	cout << "packed:  " << packed->getByteSize() << " bytes, ratio " << static_cast<double>(packed->getByteSize()) / (samples.size() * sizeof(int16_t)) << (same ? ", lossless\n" : ", MISMATCH\n");
+	cout << "file decode:  " << decoded.count() << " us\n";
+	cout << "block encode: " << encoded.count() << " us\n";
+	cout << "block decode: " << unpacked.count() << " us (with the comparison)\n";
+	return same ? 0 : 3;
+}
+
+// Times the parallel decode against the serial one, for each thread count.
+int decode(int argc, char* argv[]) {
+	const filesystem::path path = argv[2];
+	const bgm::StreamOpener open = [path]() -> shared_ptr<sf::InputStream> {
+		auto stream = make_shared<sf::FileInputStream>();
+		return stream->open(path) ? stream : nullptr;
+	};
+
+	sf::InputSoundFile file;
+	shared_ptr<sf::InputStream> stream = open();
+	if (stream == nullptr || !file.openFromStream(*stream)) {
+		return 2;
+	}
+	bgm::SeekIndex index;
+	(void)bgm::readLoopPoints(*stream, &index, true); // Only the index is needed, the music may have no loop tags.
+	index.channelCount = file.getChannelCount();
+
+	vector<int16_t> serial(static_cast<size_t>(file.getSampleCount() - file.getSampleCount() % file.getChannelCount()));
+	file.seek(0);
+	auto start = chrono::steady_clock::now();
+	serial.resize(static_cast<size_t>(file.read(serial.data(), serial.size())));
+	const auto base = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+	cout << "serial: " << base.count() << " us\n";
+
+	vector<unsigned int> threads;
+	for (int i = 3; i < argc; ++i) {
+		threads.push_back(static_cast<unsigned int>(stoul(argv[i])));
+	}
+	if (threads.empty()) {
+		threads = { 4, 8, 16 };
+	}
+	for (const unsigned int n : threads) {
+		vector<int16_t> parallel(serial.size());
+		start = chrono::steady_clock::now();
+		const bool ok = bgm::decodeParallel(open, index, parallel.data(), parallel.size(), n);
+		const auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+		if (!ok) {
+			cout << n << " threads: not split\n";
+			continue;
+		}
+		cout << n << " threads: " << elapsed.count() << " us, x" << static_cast<double>(base.count()) / max<long long>(elapsed.count(), 1)
+			 << (parallel == serial ? ", identical\n" : ", MISMATCH\n");
+	}
+	return 0;
+}
+
+// Exposes the loop points, to move them while playing.
+class CheckedMusic : public bgm::Music {
+public:
+	using bgm::Music::setLoopPoints;
+};
+
+// Plays a short loop and fails if the callbacks of the music touch the heap once warmed up.
+int rtcheck(int argc, char* argv[]) {
+	const int seconds = argc >= 4 ? stoi(argv[3]) : 10;
+	bgm::Music::setReadAhead(argc >= 5 ? stoul(argv[4]) : 0);
+
+	CheckedMusic music;
+	if (!music.openFromFile(argv[2])) {
+		return 2;
+	}
+	const sf::Time duration = music.getDuration();
+	if (duration < sf::seconds(4)) {
+		cout << "Music too short, needs 4 s.\n";
+		return 2;
+	}
+	music.setLoopPoints(bgm::Music::TimeSpan{ sf::seconds(1), sf::seconds(2) });
+	music.setLooping(true);
+	music.play();
+
+	// The first chunks and wraps warm up the decoder and the read-ahead blocks
+	this_thread::sleep_for(chrono::seconds(3));
+	allocationsArmed = true;
+	for (int i = 0; i < seconds; ++i) {
+		this_thread::sleep_for(chrono::seconds(1));
+		if (i == seconds / 2) {
+			music.setLoopPoints(bgm::Music::TimeSpan{ sf::seconds(1.5f), sf::seconds(1.5f) });
+		}
+	}
+	allocationsArmed = false;
+	music.stop();
+
+	const bgm::Music::LoopStats loops = music.getLoopStats();
+	const bgm::Music::ReadStats reads = music.getReadStats();
+	cout << "chunks: " << reads.count << ", longest " << reads.maxDuration.asMicroseconds() << " us\n"
+		 << "wraps: " << loops.count << ", longest " << loops.maxDuration.asMicroseconds() << " us\n"
+		 << "allocations on the audio thread: " << audioAllocations << "\n";
+	return audioAllocations == 0 ? 0 : 3;
+}
+
+// Puts markers before and on every second of a short loop, and times each event against the audible position when it is polled.
+int events(int argc, char* argv[]) {
+	const int seconds = argc >= 4 ? stoi(argv[3]) : 10;
+
+	CheckedMusic music;
+	if (!music.openFromFile(argv[2])) {
+		return 2;
+	}
+	if (music.getDuration() < sf::seconds(5)) {
+		cout << "Music too short, needs 5 s.\n";
+		return 2;
+	}
+	const uint64_t second = uint64_t{ music.getSampleRate() } * music.getChannelCount();
+	music.setMarkers({ { second / 2, 0 }, { second * 1, 1 }, { second * 2, 2 }, { second * 3, 3 } });
+	music.setLoopPoints(bgm::Music::TimeSpan{ sf::seconds(1), sf::seconds(3) });
+	music.setLooping(true);
+	music.play();
+
+	// Lead of the event over the audible position, positive when the event comes before it is heard
+	vector<double> leads;
+	const auto end = chrono::steady_clock::now() + chrono::seconds(seconds);
+	while (chrono::steady_clock::now() < end) {
+		while (const optional<bgm::Music::Event> event = music.pollEvent()) {
+			const double heard = music.getPlayingOffset().asSeconds() * static_cast<double>(second);
+			const double lead = (static_cast<double>(event->sampleOffset) - heard) * 1000. / static_cast<double>(second);
+			leads.push_back(lead);
+			cout << (event->type == bgm::Music::Event::Type::Marker ? "marker " + to_string(event->id) :
+				event->type == bgm::Music::Event::Type::LoopWrapped ? string("loop") : string("end"))
+				 << " at " << event->sampleOffset << ", lead " << lead << " ms\n";
+		}
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	music.stop();
+
+	if (!leads.empty()) {
+		const auto [low, high] = minmax_element(leads.cbegin(), leads.cend());
+		cout << leads.size() << " events, lead from " << *low << " to " << *high << " ms, " << music.getDroppedEvents() << " dropped\n";
+	}
+	return 0;
+}
+
+// Times `snapshot` against `getPlayingOffset` while the music plays.
+int snapshot(int argc, char* argv[]) {
+	const int calls = argc >= 4 ? stoi(argv[3]) : 100000;
+
+	bgm::Music music;
+	if (!music.openFromFile(argv[2])) {
+		return 2;
+	}
+	music.play();
+	this_thread::sleep_for(chrono::milliseconds(500));
+
+	const auto time = [calls](auto&& call) {
+		const auto start = chrono::steady_clock::now();
+		for (int i = 0; i < calls; ++i) {
+			call();
+		}
+		return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls;
+	};
+	volatile int64_t sink = 0;
+	const double fast = time([&]() {
+		sink = music.snapshot().position.asMicroseconds();
+	});
+	const double slow = time([&]() {
+		sink = music.getPlayingOffset().asMicroseconds();
+	});
+	const sf::Time heard = music.getPlayingOffset();
+	const bgm::Music::Snapshot state = music.snapshot();
+	music.stop();
+
+	cout << "snapshot: " << fast << " ns/call\n"
+		 << "getPlayingOffset: " << slow << " ns/call\n"
+		 << "snapshot ahead of getPlayingOffset by " << (state.position - heard).asMicroseconds() << " us\n";
+	return 0;
+}
+
+
+// Standard input, which can't seek when it is a pipe.
+class StdinInputStream : public sf::InputStream {
+public:
+	StdinInputStream() {
+#ifdef _WIN32
+		(void)_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	}
+
+	optional<size_t> read(void* data, size_t size) override {
+		++m_reads;
+		const size_t count = fread(data, 1, size, stdin);
+		return count == 0 && ferror(stdin) ? nullopt : optional<size_t>(count);
+	}
+
+	optional<size_t> seek(size_t) override {
+		++m_seeks;
+		return nullopt;
+	}
+
+	optional<size_t> tell() override {
+		return nullopt;
+	}
+
+	optional<size_t> getSize() override {
+		return nullopt;
+	}
+
+	uint64_t m_reads = 0;
+	uint64_t m_seeks = 0;
+};
+
+// Plays a music piped to the standard input, which is read once, and checks that its loop wraps never go back to the pipe.
+int pipe(int argc, char* argv[]) {
+	(void)argc;
+	const int seconds = stoi(argv[2]);
+
+	StdinInputStream input;
+	bgm::Music music;
+	if (!music.openFromForwardStream(input)) {
+		return 2;
+	}
+	const bgm::Music::Residency opened = music.getResidency();
+	music.play();
+	this_thread::sleep_for(chrono::seconds(seconds));
+	const bgm::Music::Residency playing = music.getResidency();
+	music.stop();
+
+	const bgm::Music::LoopStats loops = music.getLoopStats();
+	cout << "private bytes when opened: " << opened.privateBytes << ", while playing: " << playing.privateBytes << "\n"
+		 << "wraps: " << loops.count << ", longest " << loops.maxDuration.asMicroseconds() << " us\n"
+		 << "reads of the pipe: " << input.m_reads << ", seeks: " << input.m_seeks << "\n";
+	return input.m_seeks == 0 ? 0 : 3;
+}
+
+
+// Measures every music once on all cores, and keeps the results next to them with --save.
+int loudness(int argc, char* argv[]) {
+	const bool save = string(argv[2]) == "--save";
+	const vector<filesystem::path> files = collectMusics(save ? 3 : 2, argc, argv);
+
+	const auto start = chrono::steady_clock::now();
+	const vector<optional<bgm::Loudness>> results = bgm::analyzeLoudness(files);
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	double audio = 0.;
+	size_t failed = 0;
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (!results[i].has_value()) {
+			cout << files[i].generic_string() << "\tFAILED\n";
+			++failed;
+			continue;
+		}
+		const bgm::Loudness& result = *results[i];
+		audio += static_cast<double>(result.frameCount) / max(result.sampleRate, 1u);
+		cout << files[i].generic_string() << "\t" << result.integrated << " LUFS\t" << result.truePeak << " dBTP\n";
+		bgm::PcmCache::Key key;
+		if (save && (!bgm::PcmCache::makeKey(files[i], key) || !bgm::saveLoudness(bgm::getLoudnessSidecar(files[i]), key.sourceSize, key.sourceTime, result))) {
+			++failed;
+		}
+	}
+	cout << files.size() << " files in " << elapsed << " s, " << files.size() / max(elapsed, 1e-9) << " files/s, x"
+		 << audio / max(elapsed, 1e-9) << " real time, " << failed << " failed\n";
+	return failed == 0 ? 0 : 3;
+}
+
+
+// Proposes loop points for files without tags, with the time the analysis took.
+int loopfind(int argc, char* argv[]) {
+	size_t failed = 0;
+	for (int i = 2; i < argc; ++i) {
+		sf::InputSoundFile file;
+		if (!file.openFromFile(argv[i]) || file.getChannelCount() == 0) {
+			cout << argv[i] << "\tFAILED\n";
+			++failed;
+			continue;
+		}
+		vector<int16_t> samples(static_cast<size_t>(file.getSampleCount()));
+		samples.resize(static_cast<size_t>(file.read(samples.data(), samples.size())));
+
+		const auto start = chrono::steady_clock::now();
+		const vector<bgm::LoopCandidate> candidates = bgm::findLoopPoints(samples.data(), samples.size(), file.getChannelCount(), file.getSampleRate());
+		const auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+
+		const double rate = static_cast<double>(file.getSampleRate()) * file.getChannelCount();
+		cout << argv[i] << "\t" << samples.size() / rate << " s analyzed in " << elapsed.count() << " ms\n";
+		if (candidates.empty()) {
+			cout << "  nothing repeats\n";
+			++failed;
+		}
+		for (const bgm::LoopCandidate& candidate : candidates) {
+			cout << "  " << candidate.samplePoints.offset << " + " << candidate.samplePoints.length << " samples (" << candidate.samplePoints.offset / rate
+				 << " s to " << (candidate.samplePoints.offset + candidate.samplePoints.length) / rate << " s), confidence " << candidate.confidence << "\n";
+		}
+	}
+	return failed == 0 ? 0 : 3;
+}
+
+
+// Checks the loop seam of every music on all cores, listing the ones likely to click.
+int seamcheck(int argc, char* argv[]) {
+	const vector<filesystem::path> files = collectMusics(2, argc, argv);
+
+	const auto start = chrono::steady_clock::now();
+	const vector<optional<bgm::SeamReport>> reports = bgm::checkLoopSeams(files);
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	size_t failed = 0;
+	size_t suspicious = 0;
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (!reports[i].has_value()) {
+			cout << files[i].generic_string() << "\tFAILED\n";
+			++failed;
+			continue;
+		}
+		const bgm::SeamReport& report = *reports[i];
+		if (report.isSuspicious()) {
+			cout << files[i].generic_string() << "\tjump " << report.jump << " (typical " << report.typicalStep << ")\tspectral distance "
+				 << report.spectralDistance << (report.repeated ? " (repeat)\n" : " (across)\n");
+			++suspicious;
+		}
+	}
+	cout << files.size() << " files in " << elapsed << " s, " << files.size() / max(elapsed, 1e-9) << " files/s, "
+		 << suspicious << " suspicious, " << failed << " failed\n";
+	return failed == 0 && suspicious == 0 ? 0 : 3;
+}
+
+
+
+// Writes the loop points of musics, samples or microseconds, given once for all the files or as
+// `<offset> <length> <file>` lines of a list. Tells how many files had to be rewritten as a whole.
+int tag(int argc, char* argv[]) {
+	const bool time = string(argv[2]) == "--time";
+	const int first = time ? 3 : 2;
+	if (argc < first + 2) {
+		return usage();
+	}
+
+	struct Entry {
+		uint64_t         offset;
+		uint64_t         length;
+		filesystem::path file;
+	};
+	vector<Entry> entries;
+	if (string(argv[first]) == "--list") {
+		ifstream list(argv[first + 1]);
+		if (!list) {
+			cout << "Failed to open " << argv[first + 1] << "\n";
+			return 2;
+		}
+		Entry entry;
+		string file;
+		while (list >> entry.offset >> entry.length && getline(list >> ws, file)) {
+			entry.file = file;
+			entries.push_back(entry);
+		}
+	}
+	else if (argc >= first + 3) {
+		const uint64_t offset = strtoull(argv[first], nullptr, 10);
+		const uint64_t length = strtoull(argv[first + 1], nullptr, 10);
+		for (int i = first + 2; i < argc; ++i) {
+			entries.push_back({ offset, length, argv[i] });
+		}
+	}
+	else {
+		return usage();
+	}
+
+	const auto start = chrono::steady_clock::now();
+	size_t failed = 0;
+	size_t rewrites = 0;
+	for (const Entry& entry : entries) {
+		bool rewritten = false;
+		const bool ok = time
+			? bgm::writeLoopPoints(entry.file, bgm::Span<bgm::Time>{ bgm::microseconds(static_cast<int64_t>(entry.offset)), bgm::microseconds(static_cast<int64_t>(entry.length)) }, &rewritten)
+			: bgm::writeLoopPoints(entry.file, bgm::Span<uint64_t>{ entry.offset, entry.length }, &rewritten);
+		if (!ok) {
+			cout << entry.file.generic_string() << "\tFAILED\n";
+			++failed;
+		}
+		else if (rewritten) {
+			cout << entry.file.generic_string() << "\trewritten\n";
+			++rewrites;
+		}
+	}
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << entries.size() << " files in " << elapsed << " s, " << rewrites << " rewritten, " << failed << " failed\n";
+	return failed == 0 ? 0 : 3;
+}
+
+
+
+// Checks the CRC of every page of the Ogg files on all cores, FLAC files are skipped.
+int verify(int argc, char* argv[]) {
+	vector<filesystem::path> files = collectMusics(2, argc, argv);
+	erase_if(files, [](const filesystem::path& file) { return file.extension() != ".ogg"; });
+
+	vector<char> results(files.size(), 0);
+	vector<uint64_t> badOffsets(files.size(), 0);
+	atomic<size_t> next{ 0 };
+	atomic<uint64_t> bytes{ 0 };
+	const auto work = [&]() {
+		for (size_t i = next++; i < files.size(); i = next++) {
+			sf::FileInputStream stream;
+			if (stream.open(files[i])) {
+				results[i] = bgm::checkOggPages(stream, bgm::PageCheck::Full, &badOffsets[i]) ? 1 : 0;
+				bytes += stream.getSize().value_or(0);
+			}
+		}
+	};
+	const auto start = chrono::steady_clock::now();
+	vector<thread> workers(max(thread::hardware_concurrency(), 1u) - 1);
+	for (thread& worker : workers) {
+		worker = thread(work);
+	}
+	work();
+	for (thread& worker : workers) {
+		worker.join();
+	}
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	size_t failed = 0;
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (results[i] == 0) {
+			cout << files[i].generic_string() << "\tcorrupted at " << badOffsets[i] << "\n";
+			++failed;
+		}
+	}
+	cout << files.size() << " files in " << elapsed << " s, " << bytes / max(elapsed, 1e-9) / 1e9 << " GB/s, " << failed << " corrupted\n";
+	return failed == 0 ? 0 : 3;
+}
+
+
+// Compares the CRC of Ogg pages against the bytewise table lookup it replaced.
+int crcbench(int argc, char* argv[]) {
+	(void)argc;
+	vector<uint8_t> data(static_cast<size_t>(stoul(argv[2])) << 20);
+	uint32_t seed = 1;
+	for (uint8_t& byte : data) {
+		seed = seed * 1664525 + 1013904223;
+		byte = static_cast<uint8_t>(seed >> 24);
+	}
+
+	array<uint32_t, 256> table{};
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t r = i << 24;
+		for (int k = 0; k < 8; ++k) {
+			r = (r & 0x80000000) ? (r << 1) ^ 0x04C11DB7 : (r << 1);
+		}
+		table[i] = r;
+	}
+	const auto bytewise = [&table](const uint8_t* p, size_t size) {
+		uint32_t crc = 0;
+		for (size_t i = 0; i < size; ++i) {
+			crc = (crc << 8) ^ table[((crc >> 24) ^ p[i]) & 0xFF];
+		}
+		return crc;
+	};
+
+	const auto run = [&data](const char* name, auto crc) {
+		const auto start = chrono::steady_clock::now();
+		const uint32_t result = crc(data.data(), data.size());
+		const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << name << data.size() / max(elapsed, 1e-9) / 1e9 << " GB/s\n";
+		return result;
+	};
+	const uint32_t expected = run("bytewise:    ", bytewise);
+	const uint32_t result = run("slice-by-8:  ", [](const uint8_t* p, size_t size) { return bgm::getOggCrc(p, size); });
+	cout << (result == expected ? "same CRC\n" : "DIFFERENT CRC\n");
+	return result == expected ? 0 : 3;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		return usage();
+	}
+	const string command = argv[1];
+	if (command == "pack" && argc >= 4) {
+		return pack(argc, argv);
+	}
+	if (command == "list") {
+		return list(argc, argv);
+	}
+	if (command == "bench" && argc >= 4) {
+		return bench(argc, argv);
+	}
+	if (command == "codec") {
+		return codec(argc, argv);
+	}
+	if (command == "decode") {
+		return decode(argc, argv);
+	}
+	if (command == "rtcheck") {
+		return rtcheck(argc, argv);
+	}
+	if (command == "events") {
+		return events(argc, argv);
+	}
+	if (command == "snapshot") {
+		return snapshot(argc, argv);
+	}
+	if (command == "pipe") {
+		return pipe(argc, argv);
+	}
+	if (command == "loudness") {
+		return loudness(argc, argv);
+	}
+	if (command == "loopfind") {
+		return loopfind(argc, argv);
+	}
+	if (command == "seamcheck") {
+		return seamcheck(argc, argv);
+	}
+	if (command == "tag") {
+		return tag(argc, argv);
+	}
+	if (command == "verify") {
+		return verify(argc, argv);
+	}
+	if (command == "crcbench") {
+		return crcbench(argc, argv);
+	}
+	return usage();
+}
@@ -29,6 +29,13 @@
 
 // OHMSBGM: Add headers.
 #include "Bgm.h"
+#include "BgmCache.h"
+#include "BgmCodec.h"
+#include "BgmDecode.h"
+#include "BgmGovernor.h"
+#include "BgmLoudness.h"
+#include "BgmQueue.h"
+#include "BgmStream.h"
 #include <SFML/System/FileInputStream.hpp>
 #include <SFML/System/MemoryInputStream.hpp>
 
@@ -37,27 +44,1066 @@
 #include <SFML/System/Time.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <limits>
 #include <mutex>
 #include <ostream>
+#include <thread>
+#include <vector>
+
+
+namespace {
+// OHMSBGM: Forward distance in an Ogg stream under which decoding is cheaper than a seek (one bisection step of vorbisfile).
+constexpr std::uint64_t ForwardDecodeBytes = 65536;
+
+std::atomic<bgm::Music::PageIndexing> pageIndexing{ bgm::Music::PageIndexing::Off };
+std::atomic<bgm::PageCheck>            pageCheck{ bgm::PageCheck::Off };
+std::atomic<std::size_t>               readAheadBlocks{ 0 };
+std::atomic<bool>                      pcmCompression{ false };
+std::atomic<unsigned int>              decodeThreads{ 0 }; // One per core.
+std::atomic<float>                     loudnessTarget{ 0.f }; // LUFS, disabled if 0.
+
+thread_local bool                      inAudioCallback = false;
+
+// Marks the streaming thread while it is in a callback of a music, see `Music::isInAudioCallback`, and counts it in `callbacks`.
+struct AudioCallbackScope {
+	explicit AudioCallbackScope(std::atomic<unsigned int>& callbacks) : callbacks(callbacks) {
+		inAudioCallback = true;
+		callbacks.fetch_add(1);
+	}
+	~AudioCallbackScope() {
+		callbacks.fetch_sub(1, std::memory_order_release);
+		inAudioCallback = false;
+	}
+
+	std::atomic<unsigned int>& callbacks;
+};
+
+// One worker for the whole process, parking the restart decoders of the musics at their loop start.
+// The audio thread wakes it without locking, through an atomic wait.
+class RestartParker final {
+public:
+	class Client {
+	public:
+		virtual ~Client() = default;
+
+		// On the worker, once requested
+		virtual void parkRestart() = 0;
+
+	private:
+		friend RestartParker;
+		std::atomic<bool> m_wanted{ false };
+	};
+
+	static RestartParker& getInstance() {
+		static RestartParker instance;
+		return instance;
+	}
+
+	void add(Client& client) {
+		const std::lock_guard lock(m_mutex);
+		m_clients.push_back(&client);
+	}
+
+	// Waits for the client to be done with, if the worker has it
+	void remove(Client& client) {
+		std::unique_lock lock(m_mutex);
+		m_idle.wait(lock, [this, &client]() {
+			return m_busy != &client;
+		});
+		std::erase(m_clients, &client);
+	}
+
+	// From any thread, the audio thread included
+	void request(Client& client) {
+		client.m_wanted.store(true, std::memory_order_relaxed);
+		m_requests.fetch_add(1, std::memory_order_release);
+		m_requests.notify_one();
+	}
+
+private:
+	RestartParker() : m_worker([this]() { run(); }) {}
+
+	~RestartParker() {
+		m_stop = true;
+		m_requests.fetch_add(1, std::memory_order_release);
+		m_requests.notify_one();
+		m_worker.join();
+	}
+
+	void run() {
+		while (!m_stop) {
+			const std::uint32_t seen = m_requests.load(std::memory_order_acquire);
+			std::unique_lock lock(m_mutex);
+			const std::vector<Client*> clients = m_clients;
+			for (Client* client : clients) {
+				// It may have left meanwhile
+				if (std::find(m_clients.cbegin(), m_clients.cend(), client) == m_clients.cend() || !client->m_wanted.exchange(false))
+					continue;
+				m_busy = client;
+				lock.unlock();
+				client->parkRestart();
+				lock.lock();
+				m_busy = nullptr;
+				m_idle.notify_all();
+			}
+			lock.unlock();
+			m_requests.wait(seen, std::memory_order_acquire);
+		}
+	}
+
+	std::mutex                 m_mutex;
+	std::condition_variable    m_idle;
+	std::vector<Client*>       m_clients;
+	Client*                    m_busy = nullptr;
+	std::atomic<std::uint32_t> m_requests{ 0 };
+	std::atomic<bool>          m_stop{ false };
+	std::thread                m_worker; // Last, started once the rest is set
+};
+
+std::mutex                             pcmCacheMutex;
+std::shared_ptr<const bgm::PcmCache>   pcmCache; // Disabled if null.
+
+std::shared_ptr<const bgm::PcmCache> getPcmCache() {
+	const std::lock_guard lock(pcmCacheMutex);
+	return pcmCache;
+}
+
+std::shared_ptr<bgm::InputStream> openFileStream(const std::filesystem::path& filename) {
+	if (const std::size_t blocks = readAheadBlocks; blocks != 0) {
+		std::shared_ptr<bgm::ReadAheadInputStream> stream = std::make_shared<bgm::ReadAheadInputStream>(blocks);
+		return stream->open(filename) ? stream : nullptr;
+	}
+	std::shared_ptr<sf::FileInputStream> stream = std::make_shared<sf::FileInputStream>();
+	return stream->open(filename) ? stream : nullptr;
+}
+
+float getLoudnessGain(const std::filesystem::path& filename) {
+	// Only what was measured beforehand is applied, analyzing on open would decode the whole file
+	const float target = loudnessTarget;
+	bgm::Loudness loudness;
+	bgm::PcmCache::Key key;
+	if (target == 0.f || filename.empty() || !bgm::PcmCache::makeKey(filename, key) ||
+		!bgm::loadLoudness(bgm::getLoudnessSidecar(filename), key.sourceSize, key.sourceTime, loudness))
+		return 1.f;
+	return loudness.getGain(target);
+}
+
+std::any readPointsAndIndex(bgm::InputStream& stream, bgm::SeekIndex& index, const std::filesystem::path& filename) {
+	// The sidecar only keeps the page index of Ogg files, FLAC files carry their own seek points
+	const bgm::Music::PageIndexing indexing = pageIndexing;
+	const std::filesystem::path sidecar = std::filesystem::path(filename).concat(".ohmsidx");
+	bgm::PcmCache::Key key;
+	const bool keyed = (indexing != bgm::Music::PageIndexing::Off) && !filename.empty() && bgm::PcmCache::makeKey(filename, key);
+	const bool loaded = keyed && bgm::loadSeekIndex(sidecar, key.sourceSize, key.sourceTime, index);
+
+	std::any points = bgm::readLoopPoints(stream, loaded ? nullptr : &index, indexing != bgm::Music::PageIndexing::Off && !loaded, pageCheck);
+	if (points.has_value() && !loaded && indexing == bgm::Music::PageIndexing::ScanAndSave && keyed &&
+		index.format == bgm::SeekIndex::Format::Ogg) {
+		(void)bgm::saveSeekIndex(sidecar, key.sourceSize, key.sourceTime, index);
+	}
+	return points;
+}
+}
 
 
 namespace bgm {
 ////////////////////////////////////////////////////////////
-struct Music::Impl {
-	std::shared_ptr<InputStream> stream; // OHMSBGM: Add stream.
-
-	InputSoundFile            file;     //!< The streamed music file
+struct Music::Impl : Governor::Client, RestartParker::Client { // OHMSBGM: Managed by the memory governor.
+	// OHMSBGM: Group the decoder state so that a queued track can take over without reinitializing the stream.
+	struct Track {
+		// Set when the track is opened, only read afterwards
+		std::uint64_t                                    serial = 0;       //!< Names the track in the changes sent to the audio thread
+		std::uint64_t                                    sampleCount = 0;  //!< Samples of all channels in the file
+		unsigned int                                     channelCount = 0;
+		unsigned int                                     sampleRate = 0;
+		std::function<std::shared_ptr<InputStream>()>    reopen;   //!< Opens another stream on the same data, if possible
+		SeekIndex                                        index;    //!< Seek points read along with the loop points
+		std::filesystem::path                            source;   //!< File of the music, for the pcm cache
+		std::size_t                                      sharedBytes = 0; //!< Size of the shared buffer the music is read from
+		float                                            gain = 1.f;      //!< Loudness normalization, from the sidecar of the file
+
+		// Owned by the thread owning the state, see `change`
+		std::shared_ptr<RegionInputStream>               stream;   //!< Source of the decoder
+		std::unique_ptr<InputSoundFile>                  file = std::make_unique<InputSoundFile>(); //!< The streamed music file
+		Span<std::uint64_t>                              loopSpan; //!< Loop Range Specifier
+		std::shared_ptr<const std::vector<std::int16_t>> pcm;      //!< Whole track decoded by the governor
+		std::shared_ptr<const CompressedPcm>             packed;   //!< Whole track decoded by the governor, compressed
+		std::uint64_t                                    clock = 0;        //!< Playing position while the decoder is left behind
+		bool                                             detached = false; //!< Whether the decoder must be sought to `clock` before reading
+		PcmCache::Entry                                  mapped;   //!< Samples up to the loop end, mapped from the pcm cache
+
+		// A second decoder waiting at the loop start, swapped in at the loop end instead of seeking.
+		// Parked there by the `RestartParker`, and given back once used or once the loop start moved.
+		std::shared_ptr<RegionInputStream>               restartStream; //!< Source of the restart decoder
+		std::unique_ptr<InputSoundFile>                  restart;       //!< Restart decoder, at `loopSpan.offset` if set
+
+		// A source that can't seek, see `openFromForwardStream`
+		std::shared_ptr<ForwardInputStream>              forward;  //!< Source of the decoder, instead of `stream`
+		std::vector<std::int16_t>                        loopCopy; //!< Loop region as first decoded, replayed by the wraps
+
+		// What the user's threads sent, known to them before the audio thread takes it
+		Span<std::uint64_t>                              requestedLoop;            //!< Loop points returned by `getLoopPoints`
+		bool                                             cacheRequested = false;   //!< Whether the governor sent `pcm` or `packed`
+		std::size_t                                      requestedPackedBytes = 0; //!< Size of the `packed` sent
+		bool                                             mapRequested = false;     //!< Whether `mapped` was set or sent
+		bool                                             restartSent = false;      //!< Whether a parked decoder was sent and not given back
+		std::shared_ptr<RegionInputStream>               spareStream; //!< Source of `spare`
+		std::unique_ptr<InputSoundFile>                  spare;       //!< Restart decoder given back, to be parked again
+	};
+
+	// A change of a user's thread, applied by the thread owning the state.
+	// It comes back through `released` with what it replaced, so that the audio thread never releases memory.
+	struct Command {
+		enum class Type {
+			Queue,      // Swap `next` with `track`
+			LoopPoints, // Set `loopSpan`, with `buffer` as the loop copy
+			Region,     // Set the pinned region of the decoders
+			Markers,    // Swap `markers`
+			Cache,      // Swap `pcm` and `packed`, with `buffer` as the block if not empty
+			Mapped,     // Set `mapped`
+			Restart,    // Set `restart`, parked at `loopSpan.offset`; given back with it if not taken or once used
+			Retired,    // Only given back: `track` finished and the block decoded from it, or the bytes `forward` kept
+		};
+
+		Command(Type type = Type::Queue, std::uint64_t serial = 0) : type(type), serial(serial) {}
+
+		Type                                             type;
+		std::uint64_t                                    serial; //!< Track the change is for, dropped if it no longer plays
+		std::shared_ptr<Track>                           track;
+		Span<std::uint64_t>                              loopSpan;
+		std::vector<std::int16_t>                        buffer; //!< Allocated by the user's thread
+		RegionInputStream::Region                        region;
+		std::shared_ptr<const std::vector<Marker>>       markers;
+		std::shared_ptr<const std::vector<std::int16_t>> pcm;
+		std::shared_ptr<const CompressedPcm>             packed;
+		PcmCache::Entry                                  mapped;
+		std::shared_ptr<const CompressedPcm>             blockSource;
+		std::shared_ptr<RegionInputStream>               restartStream;
+		std::unique_ptr<InputSoundFile>                  restart;
+		Time                                             parkDuration; //!< Time the parker spent opening and seeking `restart`
+		std::vector<std::byte>                           kept;     //!< Bytes read again by the decoder of a forward-only stream
+		Span<std::uint64_t>                              previous; //!< Loop points left in place, if `rejected`
+		bool                                             rejected = false; //!< Loop points a forward-only decoder is already past
+	};
+
+	// Written by the thread owning the state, read by any thread through `published`
+	struct Published {
+		Status        status = Status::Stopped;
+		std::uint64_t chunkOffset = 0;   //!< Position of the first sample heard from `chunkTime` on
+		std::uint64_t chunkCount = 0;    //!< Samples of the chunk left to hear from `chunkTime` on
+		std::int64_t  chunkTime = 0;     //!< Steady clock, in nanoseconds
+		std::uint64_t samplesPlayed = 0; //!< Samples heard before `chunkTime`
+		std::uint64_t loopCount = 0;     //!< Wraps before the chunk
+		std::uint64_t rate = 0;          //!< Samples of all channels per second
+		std::uint64_t serial = 0;        //!< Track playing
+		bool          ending = false;    //!< Whether the stream stops after the chunk
+		bool          isVirtual = false; //!< Whether decoding is suspended
+		unsigned int  channelCount = 0;  //!< Of the track playing, like the fields below
+		unsigned int  sampleRate = 0;
+		std::uint64_t sampleCount = 0;
+		std::uint64_t loopOffset = 0;
+		std::uint64_t loopLength = 0;
+	};
+
+	// Published with each chunk, and with each change applied
+	struct Stats {
+		TransitionStats transitions; //!< Statistics of the queued track switches
+		LoopStats       loops;       //!< Statistics of the loop wraps
+		SeekStats       seeks;       //!< Statistics of the seeks
+		ReadStats       reads;       //!< Statistics of the chunks fed to the stream
+		Residency       residency;   //!< Memory held as of the last chunk
+	};
+
+	static constexpr std::uint64_t NoSeek = std::numeric_limits<std::uint64_t>::max();
+	static constexpr std::size_t   OverflowCapacity = 64;
+
+	// The state, owned by the audio thread while the music plays, by the user's thread holding `mutex` and a `Takeover` otherwise
+	std::shared_ptr<Track>    track = std::make_shared<Track>(); //!< Track being played
+	std::shared_ptr<Track>    next;     //!< Track queued to follow the current one
 	std::vector<std::int16_t> samples;  //!< Temporary buffer of samples
-	std::recursive_mutex      mutex;    //!< Mutex protecting the data
-	Span<std::uint64_t>       loopSpan; //!< Loop Range Specifier
+	std::vector<std::int16_t> block;    //!< Last block decoded from `blockSource`
+	std::shared_ptr<const CompressedPcm> blockSource; //!< Compressed samples `block` comes from
+	std::size_t               blockIndex = 0;         //!< Index of `block` in `blockSource`
+	std::shared_ptr<const std::vector<Marker>> markers; //!< Sorted by position, replaced as a whole
+	bool                      isVirtual = false;       //!< Whether decoding is suspended
+	Stats                     stats;
+	Published                 state;        //!< Last value of `published`
+	std::vector<Command>      overflow;     //!< Given back while `released` was full, allocated once, see `release`
+	std::uint64_t             streamed = 0; //!< Samples handed to the stream since opened
+
+	// Between the threads
+	SpscQueue<Command, 32>    commands;  //!< Changes of the user's threads, taken by the next chunk
+	SpscQueue<Command, 64>    released;  //!< Applied commands and retired tracks, released by the user's threads
+	Seqlock<Published>        published;
+	Seqlock<Stats>            publishedStats;
+	std::atomic<std::uint64_t> seekTarget{ NoSeek }; //!< Position given to `onSeek`, taken with the changes
+	std::atomic<std::uint64_t> lastOffset{ 0 };      //!< Where the last chunk ended
+	std::atomic<unsigned int> callbacks{ 0 };        //!< Callbacks of the audio thread running
+	std::atomic<unsigned int> takeovers{ 0 };        //!< Held by a user's thread, see `Takeover`
+	SpscQueue<Event, 256>     events;          //!< Pushed by the streaming thread, popped by `pollEvent()`
+	std::atomic<std::uint64_t> droppedEvents{ 0 }; //!< Events that didn't fit in `events`
+	std::atomic<bool>         looping{ false };        //!< Looping requested by the user
+	std::atomic<float>        volume{ 1.f };           //!< Volume set by the user, as a factor
+	std::atomic<float>        gain{ 1.f };             //!< Loudness normalization of the playing track
+	std::atomic<float>        audibility{ 1.f };       //!< Attenuation of the music reported by the user
+	std::atomic<float>        virtualThreshold{ 0.f }; //!< Gain under which the music stops decoding
+	std::atomic<std::uint64_t> activity{ 0 };          //!< Samples played since the governor last asked
+	std::atomic<bool>         closing{ false };        //!< Set when destroyed, to cancel a decode of the governor
+
+	// Owned by the user's threads, under `mutex`
+	mutable std::recursive_mutex mutex; //!< Serializes the user's threads and the governor, never taken by the audio thread
+	std::shared_ptr<Track>    playing = track;   //!< Track playing as of the last chunk published
+	std::vector<std::shared_ptr<Track>> queued;  //!< Tracks sent by `queueTrack`, until they play or come back
+	std::uint64_t             queuedSerial = 0;  //!< Last track queued, 0 once cleared
+	std::uint64_t             lastSerial = 0;
+	bool                      streaming = false; //!< From `play` to `pause` or `stop`, see `isStreaming`
+
+	// Keeps the audio thread off the state while a user's thread holding `mutex` changes it, the music being paused or stopped.
+	// The device may still be finishing the period in which the music stopped: a callback already running is waited for,
+	// a later one leaves the state alone.
+	struct Takeover {
+		explicit Takeover(Impl& impl) : impl(impl) {
+			impl.takeovers.fetch_add(1);
+			while (impl.callbacks.load() != 0)
+				std::this_thread::yield();
+		}
+		~Takeover() {
+			impl.takeovers.fetch_sub(1, std::memory_order_release);
+		}
+		Takeover(const Takeover&) = delete;
+		Takeover& operator=(const Takeover&) = delete;
+
+		Impl& impl;
+	};
+
+	Impl() {
+		overflow.reserve(OverflowCapacity);
+		Governor::getInstance().add(*this);
+		RestartParker::getInstance().add(*this);
+	}
+
+	static std::int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void publish() {
+		state.channelCount = track->channelCount;
+		state.sampleRate = track->sampleRate;
+		state.sampleCount = track->sampleCount;
+		state.loopOffset = track->loopSpan.offset;
+		state.loopLength = track->loopSpan.length;
+		published.store(state);
+	}
+
+	void publishStats() {
+		Residency& res = stats.residency;
+		res = Residency{};
+		if (track->stream != nullptr && track->stream->getRegion().bytes != nullptr)
+			res.residentBytes = track->stream->getRegion().bytes->size();
+		res.sourceReads = getSourceReads();
+		res.sharedBytes = track->sharedBytes;
+		res.privateBytes = res.residentBytes + (samples.capacity() + block.capacity()) * sizeof(std::int16_t);
+		if (track->pcm != nullptr)
+			res.privateBytes += track->pcm->size() * sizeof(std::int16_t);
+		if (track->packed != nullptr)
+			res.privateBytes += track->packed->getByteSize();
+		res.privateBytes += track->loopCopy.capacity() * sizeof(std::int16_t);
+		if (track->forward != nullptr)
+			res.privateBytes += track->forward->getKeptSize();
+		publishedStats.store(stats);
+	}
+
+	// Samples of the published chunk heard at `time`
+	static std::uint64_t getHeard(const Published& p, std::int64_t time) {
+		const std::int64_t elapsed = std::max<std::int64_t>(time - p.chunkTime, 0);
+		const std::uint64_t heard = static_cast<std::uint64_t>(static_cast<double>(elapsed) * 1e-9 * static_cast<double>(p.rate));
+		return std::min(heard, p.chunkCount);
+	}
+
+	void pushEvent(Event::Type type, std::uint64_t sampleOffset, std::uint64_t id = 0) {
+		if (!events.push(Event{ type, id, sampleOffset }))
+			++droppedEvents;
+	}
+
+	// Markers in the samples [from, to) just read
+	void pushMarkers(std::uint64_t from, std::uint64_t to) {
+		if (markers == nullptr)
+			return;
+		auto it = std::lower_bound(markers->cbegin(), markers->cend(), from, [](const Marker& m, std::uint64_t offset) {
+			return m.sampleOffset < offset;
+		});
+		for (; it != markers->cend() && it->sampleOffset < to; ++it)
+			pushEvent(Event::Type::Marker, it->sampleOffset, it->id);
+	}
+
+	~Impl() override {
+		closing = true;
+		Governor::getInstance().remove(*this);
+		RestartParker::getInstance().remove(*this);
+	}
+
+	// The track the user's threads deal with: the one playing as of the last chunk. Held, as `collect` may drop it.
+	std::shared_ptr<Track> getPlaying() const {
+		const std::uint64_t serial = published.load().serial;
+		for (const std::shared_ptr<Track>& t : queued) {
+			if (t->serial == serial)
+				return t;
+		}
+		return playing;
+	}
+
+	// Whether the audio thread takes the changes: from `play` until `pause`, `stop`, or the stream ending by itself.
+	// Once the last chunk is published, nothing takes them until the next `play`; the takeover keeps out a late callback.
+	bool isStreaming() const {
+		return streaming && !published.load().ending;
+	}
+
+	bool hasQueued() const {
+		return queuedSerial > published.load().serial;
+	}
+
+	// Releases what the audio thread gave back, and follows its switches to the queued tracks
+	void collect() {
+		while (std::optional<Command> command = released.pop()) {
+			if (command->type == Command::Type::Queue && command->track != nullptr) // Replaced before it played.
+				std::erase(queued, command->track);
+			if (command->type == Command::Type::Restart && command->restart != nullptr)
+				takeSpare(*command);
+			if (command->type == Command::Type::LoopPoints && command->rejected)
+				rejectLoop(*command);
+		}
+		const std::uint64_t serial = published.load().serial;
+		for (const std::shared_ptr<Track>& t : queued) {
+			if (t->serial == serial)
+				playing = t;
+		}
+		std::erase_if(queued, [serial](const std::shared_ptr<Track>& t) {
+			return t->serial <= serial;
+		});
+	}
+
+	// Applies a change of a user's thread holding `mutex`: sent to the audio thread while the music plays, applied here otherwise
+	bool change(Command command) {
+		collect();
+		if (isStreaming()) {
+			if (commands.push(std::move(command)))
+				return true;
+			err() << "Too many bgm changes waiting for the audio thread, the change is dropped." << std::endl;
+			return false;
+		}
+		{
+			const Takeover takeover(*this);
+			drain();
+			apply(command);
+			release(std::move(command));
+			publish();
+			publishStats();
+		}
+		collect();
+		return true;
+	}
+
+	// Takes the changes of the user's threads, on the thread owning the state; those left wait for room to give them back
+	void drain() {
+		flush();
+		while (canRelease(2)) { // The command, and the restart decoder it may replace.
+			std::optional<Command> command = commands.pop();
+			if (!command)
+				break;
+			apply(*command);
+			release(std::move(*command));
+		}
+		if (const std::uint64_t target = seekTarget.exchange(NoSeek); target != NoSeek)
+			seekTo(target);
+	}
+
+	// Whether `count` more things can be given back without freeing them here; checked before giving back on the audio thread
+	bool canRelease(std::size_t count = 1) const {
+		return overflow.size() + count <= overflow.capacity();
+	}
+
+	// Gives back to the user's threads what a change replaced, to be freed there; kept in `overflow` while `released` is full
+	void release(Command&& command) {
+		if (overflow.empty() && released.push(std::move(command)))
+			return;
+		if (canRelease()) {
+			overflow.push_back(std::move(command)); // Within the capacity reserved, doesn't allocate.
+			requestRestart(); // The parker collects first, making room.
+			return;
+		}
+		// Only on a user's thread applying a change directly: the audio thread checks `canRelease` first
+		err() << "Too many bgm changes waiting to be released, one is released now." << std::endl;
+	}
+
+	// Moves what `overflow` kept to `released`, in order, as far as there is room
+	void flush() {
+		std::size_t pushed = 0;
+		while (pushed < overflow.size() && released.push(std::move(overflow[pushed])))
+			++pushed;
+		overflow.erase(overflow.begin(), overflow.begin() + static_cast<std::ptrdiff_t>(pushed));
+	}
+
+	void apply(Command& command) {
+		if (command.type != Command::Type::Queue && command.type != Command::Type::Markers && command.serial != track->serial)
+			return;
+		switch (command.type) {
+		case Command::Type::Queue:
+			std::swap(next, command.track);
+			break;
+		case Command::Type::LoopPoints:
+			if (track->forward != nullptr) {
+				// A forward-only decoder can't go back: the loop must still be ahead of it, or be a part of the copy already made
+				const Span<std::uint64_t> loop = command.loopSpan;
+				if (loop.offset == track->loopSpan.offset && loop.length <= track->loopCopy.size() && getSampleOffset() <= loop.offset + loop.length) {
+					track->loopSpan = loop;
+					track->loopCopy.resize(static_cast<std::size_t>(loop.length)); // Shrinks, the capacity is kept.
+					break;
+				}
+				if (loop.offset < track->file->getSampleOffset()) {
+					command.previous = track->loopSpan;
+					command.rejected = true;
+					break;
+				}
+			}
+			if (command.loopSpan.offset != track->loopSpan.offset)
+				releaseRestart();
+			track->loopSpan = command.loopSpan;
+			std::swap(track->loopCopy, command.buffer);
+			break;
+		case Command::Type::Region:
+			if (track->stream != nullptr) {
+				RegionInputStream::Region replaced = track->stream->getRegion();
+				track->stream->setRegion(command.region);
+				if (track->restartStream != nullptr)
+					track->restartStream->setRegion(command.region);
+				command.region = std::move(replaced);
+			}
+			break;
+		case Command::Type::Markers:
+			std::swap(markers, command.markers);
+			break;
+		case Command::Type::Cache:
+			// The decoder is sought to the clock on the next chunk if the samples go, at the same sample
+			std::swap(track->pcm, command.pcm);
+			std::swap(track->packed, command.packed);
+			if (!command.buffer.empty())
+				std::swap(block, command.buffer);
+			command.blockSource = std::move(blockSource);
+			break;
+		case Command::Type::Mapped:
+			if (track->mapped.samples == nullptr)
+				std::swap(track->mapped, command.mapped);
+			break;
+		case Command::Type::Restart:
+			// Taken if still parked at the loop start, reading the region of the playing decoder
+			if (track->restart == nullptr && track->stream != nullptr && command.loopSpan.offset == track->loopSpan.offset) {
+				command.region = command.restartStream->getRegion();
+				command.restartStream->setRegion(track->stream->getRegion());
+				std::swap(track->restartStream, command.restartStream);
+				std::swap(track->restart, command.restart);
+				LoopStats& loops = stats.loops;
+				++loops.parks;
+				loops.lastParkDuration = command.parkDuration;
+				loops.maxParkDuration = std::max(loops.maxParkDuration, loops.lastParkDuration);
+			}
+			break;
+		case Command::Type::Retired:
+			break;
+		}
+	}
+
+	// Replaces the tracks with an empty one to open, under `mutex` and a `Takeover`
+	void reset() {
+		drain();
+		collect();
+		next.reset();
+		blockSource.reset();
+		track = std::make_shared<Track>();
+		track->serial = ++lastSerial;
+		playing = track;
+		queued.clear();
+		queuedSerial = 0;
+		state.serial = track->serial;
+		publish();
+	}
 
 	void initialize() {
 		// Compute the music positions
-		loopSpan.offset = 0;
-		loopSpan.length = file.getSampleCount();
+		track->sampleCount = track->file->getSampleCount();
+		track->channelCount = track->file->getChannelCount();
+		track->sampleRate = track->file->getSampleRate();
+		track->loopSpan.offset = 0;
+		track->loopSpan.length = track->sampleCount;
+		track->requestedLoop = track->loopSpan;
+		isVirtual = false;
 
 		// Resize the internal buffer so that it can contain 1 second of audio samples
-		samples.resize(file.getSampleRate() * file.getChannelCount());
+		samples.resize(track->file->getSampleRate() * track->file->getChannelCount());
+
+		streamed = 0;
+		lastOffset = 0;
+		state.samplesPlayed = 0;
+		state.isVirtual = false;
+		publish();
+		publishStats();
+	}
+
+	std::uint64_t getSampleOffset() const {
+		return track->detached ? track->clock : track->file->getSampleOffset();
+	}
+
+	// Allocated once, so that the audio thread fills it without allocating; longer loop regions are not kept
+	void resetLoopCopy() {
+		std::vector<std::int16_t>().swap(track->loopCopy);
+		if (track->forward != nullptr && track->loopSpan.length <= MaxForwardLoopSamples)
+			track->loopCopy.reserve(static_cast<std::size_t>(track->loopSpan.length));
+	}
+
+	bool isLoopCopied(std::uint64_t sampleOffset) const {
+		return track->loopSpan.length != 0 && track->loopCopy.size() == track->loopSpan.length &&
+			sampleOffset >= track->loopSpan.offset && sampleOffset < track->loopSpan.offset + track->loopSpan.length;
+	}
+
+	// Whether a wrap can go back to the sample: a forward-only decoder only replays its loop copy
+	bool canWrapTo(std::uint64_t sampleOffset) const {
+		return track->forward == nullptr || isLoopCopied(sampleOffset);
+	}
+
+	// Reads the decoder, keeping what it gives of the loop region when it can only read forward
+	std::uint64_t readDecoder(InputSoundFile& file, std::int16_t* out, std::uint64_t maxCount) {
+		const std::uint64_t from = file.getSampleOffset();
+		const std::uint64_t count = file.read(out, maxCount);
+		if (&file != track->file.get() || track->loopCopy.capacity() < track->loopSpan.length)
+			return count;
+
+		const std::uint64_t next = track->loopSpan.offset + track->loopCopy.size();
+		const std::uint64_t end = std::min(from + count, track->loopSpan.offset + track->loopSpan.length);
+		if (from <= next && next < end)
+			track->loopCopy.insert(track->loopCopy.end(), out + (next - from), out + (end - from));
+		return count;
+	}
+
+	std::uint64_t getSourceReads() const {
+		return (track->stream != nullptr ? track->stream->getSourceReads() : 0) +
+			(track->restartStream != nullptr ? track->restartStream->getSourceReads() : 0);
+	}
+
+	// Samples played from memory, from the governor or else the pcm cache; they may stop before the end of the music.
+	std::uint64_t getCachedSamples(const std::int16_t*& data) const {
+		if (track->pcm != nullptr) {
+			data = track->pcm->data();
+			return track->pcm->size();
+		}
+		if (track->packed != nullptr) {
+			data = nullptr; // See `readPacked`.
+			return track->packed->getSampleCount();
+		}
+		data = track->mapped.samples;
+		return track->mapped.count;
+	}
+
+	void readPacked(std::int16_t* out, std::uint64_t count) {
+		const std::uint64_t blockSize = CompressedPcm::BlockFrames * track->packed->getChannelCount();
+		for (std::uint64_t position = track->clock; count != 0;) {
+			const std::size_t index = static_cast<std::size_t>(position / blockSize);
+			if (blockSource != track->packed || blockIndex != index) {
+				track->packed->decodeBlock(index, block.data());
+				blockSource = track->packed;
+				blockIndex = index;
+			}
+			const std::uint64_t skip = position - index * blockSize;
+			const std::uint64_t n = std::min<std::uint64_t>(count, track->packed->getBlockSize(index) - skip);
+			std::copy_n(block.data() + skip, n, out);
+			out += n;
+			position += n;
+			count -= n;
+		}
+	}
+
+	static PcmCache::Key makeCacheKey(const Track& t) {
+		PcmCache::Key key;
+		key.loopOffset = t.requestedLoop.offset;
+		key.loopLength = t.requestedLoop.length;
+		key.channelCount = t.channelCount;
+		key.sampleRate = t.sampleRate;
+		return key;
+	}
+
+	static void attachPcmCache(Track& t) {
+		const std::shared_ptr<const PcmCache> cache = getPcmCache();
+		PcmCache::Key key = makeCacheKey(t);
+		if (cache == nullptr || t.source.empty() || !PcmCache::makeKey(t.source, key))
+			return;
+		t.mapped = cache->find(t.source, key);
+		t.mapRequested = t.mapped.samples != nullptr;
+	}
+
+	// Asks the parker for a decoder at the loop start of the playing track, see `parkRestart`
+	void requestRestart() {
+		RestartParker::getInstance().request(*this);
+	}
+
+	// Gives the restart decoder back to be parked again, on the thread owning the state
+	void releaseRestart() {
+		if (track->restart == nullptr)
+			return;
+		Command command{ Command::Type::Restart, track->serial };
+		command.restartStream = std::move(track->restartStream);
+		command.restart = std::move(track->restart);
+		release(std::move(command));
+		requestRestart();
+	}
+
+	// The track of a command given back, null if it was retired meanwhile, under `mutex`
+	std::shared_ptr<Track> findTrack(std::uint64_t serial) const {
+		for (const std::shared_ptr<Track>& t : queued) {
+			if (t->serial == serial)
+				return t;
+		}
+		return playing->serial == serial ? playing : nullptr;
+	}
+
+	// Reports loop points the audio thread could not apply, and shows the ones in place again unless others were sent since, under `mutex`
+	void rejectLoop(const Command& command) {
+		err() << "Loop points start before the position of the forward-only stream, which can't go back to them; the previous ones are kept." << std::endl;
+		const std::shared_ptr<Track> t = findTrack(command.serial);
+		if (t != nullptr && t->requestedLoop.offset == command.loopSpan.offset && t->requestedLoop.length == command.loopSpan.length)
+			t->requestedLoop = command.previous;
+	}
+
+	// Keeps a restart decoder given back for its track, under `mutex`
+	void takeSpare(Command& command) {
+		const std::shared_ptr<Track> t = findTrack(command.serial);
+		if (t == nullptr)
+			return; // Released with the command.
+		t->restartSent = false;
+		t->spareStream = std::move(command.restartStream);
+		t->spare = std::move(command.restart);
+		requestRestart();
+	}
+
+	// On the parker: opens a decoder on the data of the playing track, or reuses the one given back, and seeks it to the loop start.
+	// Only while looping, and when the loop isn't played from memory; without a way to reopen the data, loops just seek.
+	void parkRestart() override {
+		std::shared_ptr<Track> t;
+		std::shared_ptr<RegionInputStream> stream;
+		std::unique_ptr<InputSoundFile> file;
+		std::uint64_t loopOffset = 0;
+		{
+			const std::lock_guard lock(mutex);
+			collect();
+			t = getPlaying();
+			if (!looping || closing || !t->reopen || t->restartSent || t->cacheRequested || t->mapRequested)
+				return;
+			stream = std::move(t->spareStream);
+			file = std::move(t->spare);
+			loopOffset = t->requestedLoop.offset;
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		if (file == nullptr) {
+			std::shared_ptr<InputStream> source = t->reopen();
+			stream = source != nullptr ? std::make_shared<RegionInputStream>(std::move(source)) : nullptr;
+			file = std::make_unique<InputSoundFile>();
+			if (stream == nullptr || !file->openFromStream(*stream))
+				return;
+		}
+		file->seek(loopOffset);
+		const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+		const std::lock_guard lock(mutex);
+		if (t->restartSent)
+			return;
+		Command command{ Command::Type::Restart, t->serial };
+		command.loopSpan = { loopOffset, 0 };
+		command.restartStream = std::move(stream);
+		command.restart = std::move(file);
+		command.parkDuration = microseconds(elapsed.count());
+		t->restartSent = true; // Unless given back right away, when applied here
+		if (!change(std::move(command)))
+			t->restartSent = false;
+	}
+
+	std::uint64_t wrap() {
+		// Restart from the loop start without seeking the playing decoder if one is waiting there; the one left at the loop end is parked again
+		if (!track->detached && !isVirtual && track->pcm == nullptr && track->restart != nullptr && canRelease()) {
+			std::swap(track->file, track->restart);
+			std::swap(track->stream, track->restartStream);
+			releaseRestart();
+			++stats.loops.instant;
+		}
+		else {
+			seek(track->loopSpan.offset);
+		}
+		return getSampleOffset();
+	}
+
+	bool isJustAhead(std::uint64_t from, std::uint64_t to, unsigned int channelCount) const {
+		if (from > to)
+			return false;
+		if (to - from <= samples.size())
+			return true;
+
+		// Within the next Ogg pages, the decoder would end up reading the same bytes after its search
+		if (track->index.format != SeekIndex::Format::Ogg)
+			return false;
+		const SeekIndex::Point* a = track->index.find(from / channelCount);
+		const SeekIndex::Point* b = track->index.find(to / channelCount);
+		return a != nullptr && b != nullptr && b->offset - a->offset <= ForwardDecodeBytes;
+	}
+
+	bool seekDecoder(InputSoundFile& file, std::uint64_t sampleOffset) {
+		// Decoding a little is cheaper than seeking when the target is just ahead
+		const unsigned int channelCount = std::max(file.getChannelCount(), 1u);
+		const std::uint64_t from = file.getSampleOffset();
+		if (track->forward != nullptr) {
+			// Only decoding gets a forward-only decoder there
+			if (sampleOffset < from)
+				return false;
+		}
+		else if (!isJustAhead(from, sampleOffset, channelCount)) {
+			file.seek(sampleOffset);
+			return false;
+		}
+		for (std::uint64_t left = sampleOffset - from; left != 0;) {
+			const std::uint64_t count = readDecoder(file, samples.data(), std::min<std::uint64_t>(left, samples.size()));
+			if (count == 0)
+				break;
+			left -= count;
+		}
+		return true;
+	}
+
+	enum class SeekKind {
+		Moved,    // Only the clock moved
+		Decoded,  // The decoder decoded up to the target
+		Searched, // The decoder searched for the target
+		Failed,
+	};
+
+	SeekKind seek(std::uint64_t sampleOffset) {
+		// Only the decoder needs an actual seek, the other sources just move the clock
+		const std::int16_t* cached = nullptr;
+		if (isVirtual || sampleOffset < getCachedSamples(cached) || isLoopCopied(sampleOffset)) {
+			track->clock = std::min(sampleOffset, track->file->getSampleCount());
+			track->detached = true;
+			return SeekKind::Moved;
+		}
+		if (track->forward != nullptr && sampleOffset < track->file->getSampleOffset())
+			return SeekKind::Failed; // Back in a forward-only stream, outside of its loop region.
+		track->detached = false;
+		return seekDecoder(*track->file, sampleOffset) ? SeekKind::Decoded : SeekKind::Searched;
+	}
+
+	std::uint64_t read(std::int16_t* out, std::uint64_t maxCount) {
+		// Suspend decoding while the music can't be heard, unless the decoder could not come back to the clock
+		isVirtual = track->forward == nullptr && volume * gain * audibility < virtualThreshold;
+
+		// A forward-only decoder stays at the loop end, the wraps replay the loop region kept
+		if (isLoopCopied(getSampleOffset())) {
+			if (!track->detached) {
+				track->clock = track->file->getSampleOffset();
+				track->detached = true;
+			}
+			const std::uint64_t count = std::min(maxCount, track->loopSpan.offset + track->loopSpan.length - track->clock);
+			std::copy_n(track->loopCopy.data() + (track->clock - track->loopSpan.offset), count, out);
+			track->clock += count;
+			activity += count;
+			return count;
+		}
+
+		const std::int16_t* cached = nullptr;
+		const std::uint64_t cachedCount = getCachedSamples(cached);
+		if (isVirtual || getSampleOffset() < cachedCount) {
+			if (!track->detached) {
+				track->clock = track->file->getSampleOffset();
+				track->detached = true;
+			}
+			const std::uint64_t total = isVirtual ? track->file->getSampleCount() : cachedCount;
+			const std::uint64_t count = std::min(maxCount, total - std::min(track->clock, total));
+			if (isVirtual) {
+				// Nobody can hear it: output silence and only advance the clock
+				std::fill_n(out, count, std::int16_t{ 0 });
+			}
+			else {
+				if (cached != nullptr)
+					std::copy_n(cached + track->clock, count, out);
+				else
+					readPacked(out, count);
+				activity += count;
+			}
+			track->clock += count;
+			return count;
+		}
+
+		// Catch the decoder up with the position reached by the other sources, or the end of the cached samples
+		if (track->detached) {
+			seekDecoder(*track->file, track->clock);
+			track->detached = false;
+		}
+		const std::uint64_t count = readDecoder(*track->file, out, maxCount);
+		activity += count;
+
+		// The bytes kept to open the decoder are released by the user's threads once read past
+		if (track->forward != nullptr && track->forward->getKeptSize() != 0 && canRelease()) {
+			Command spent{ Command::Type::Retired };
+			spent.kept = track->forward->takeKept();
+			if (!spent.kept.empty())
+				release(std::move(spent));
+		}
+		return count;
+	}
+
+
+	// Seeks where `onSeek` was asked to, and times it
+	void seekTo(std::uint64_t sampleOffset) {
+		const auto start = std::chrono::steady_clock::now();
+		const SeekKind kind = seek(sampleOffset);
+		const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		++stats.seeks.count;
+		if (kind == SeekKind::Moved)
+			++stats.seeks.moved;
+		else if (kind == SeekKind::Decoded)
+			++stats.seeks.indexed;
+		else if (kind == SeekKind::Failed)
+			++stats.seeks.failed;
+		stats.seeks.lastDuration = microseconds(elapsed.count());
+		stats.seeks.maxDuration = std::max(stats.seeks.maxDuration, stats.seeks.lastDuration);
+
+		state.chunkOffset = getSampleOffset();
+		state.chunkCount = 0;
+		state.chunkTime = now();
+		state.ending = false;
+		publish();
+	}
+
+	////////////////////////////////////////////////////////////
+	std::size_t getCacheCost() const override {
+		const std::lock_guard lock(mutex);
+		const std::shared_ptr<Track> t = getPlaying();
+		if (t->requestedPackedBytes != 0)
+			return t->requestedPackedBytes;
+		return t->reopen ? static_cast<std::size_t>(t->sampleCount * sizeof(std::int16_t)) : 0;
+	}
+
+	std::uint64_t takeActivity() override {
+		return activity.exchange(0);
+	}
+
+	bool isCached() const override {
+		const std::lock_guard lock(mutex);
+		return getPlaying()->cacheRequested;
+	}
+
+	// Decode the first samples with a decoder of our own, the playing one is left alone; nothing once `cancel` is set
+	static std::shared_ptr<std::vector<std::int16_t>> decode(const std::function<std::shared_ptr<InputStream>()>& reopen, SeekIndex index, std::uint64_t maxCount,
+		const std::atomic<bool>* cancel = nullptr) {
+		std::shared_ptr<InputStream> stream = reopen();
+		InputSoundFile file;
+
+		// Ogg musics without a page index are still split, at evenly spaced pages
+		char magic[4]{};
+		if (stream != nullptr && index.format == SeekIndex::Format::None && stream->read(magic, sizeof(magic)) == sizeof(magic) &&
+			std::equal(magic, magic + sizeof(magic), "OggS")) {
+			index.format = SeekIndex::Format::Ogg;
+		}
+		if (stream == nullptr || !stream->seek(0) || !file.openFromStream(*stream)) {
+			err() << "Failed to reopen bgm to cache it." << std::endl;
+			return nullptr;
+		}
+		auto pcm = std::make_shared<std::vector<std::int16_t>>(static_cast<std::size_t>(std::min(maxCount, file.getSampleCount())));
+		pcm->resize(pcm->size() - pcm->size() % file.getChannelCount());
+
+		index.channelCount = file.getChannelCount();
+		if (const unsigned int threads = decodeThreads; threads != 1 && decodeParallel(reopen, index, pcm->data(), pcm->size(), threads, cancel))
+			return pcm;
+
+		// In slices of a few seconds, to notice a cancel
+		const std::uint64_t slice = std::uint64_t{ file.getSampleRate() } * file.getChannelCount() * 4;
+		std::uint64_t done = 0;
+		while (done < pcm->size()) {
+			if (cancel != nullptr && *cancel)
+				return nullptr;
+			const std::uint64_t count = file.read(pcm->data() + done, std::min(pcm->size() - done, slice));
+			if (count == 0)
+				break;
+			done += count;
+		}
+		if (done != pcm->size()) {
+			err() << "Failed to decode bgm to cache it." << std::endl;
+			return nullptr;
+		}
+		return pcm;
+	}
+
+	bool promote() override {
+		std::function<std::shared_ptr<InputStream>()> reopen;
+		std::uint64_t serial = 0;
+		std::filesystem::path source;
+		PcmCache::Key key;
+		SeekIndex index;
+		{
+			const std::lock_guard lock(mutex);
+			const std::shared_ptr<Track> t = getPlaying();
+			reopen = t->reopen;
+			serial = t->serial;
+			source = t->source;
+			key = makeCacheKey(*t);
+			index = t->index;
+		}
+		if (!reopen)
+			return false;
+
+		std::shared_ptr<std::vector<std::int16_t>> pcm = decode(reopen, std::move(index), std::numeric_limits<std::uint64_t>::max(), &closing);
+		if (pcm == nullptr)
+			return false;
+
+		// Decoded anyway, so the next run can skip it
+		const std::shared_ptr<const PcmCache> cache = getPcmCache();
+		if (cache != nullptr && !source.empty() && PcmCache::makeKey(source, key) && !cache->find(source, key).samples) {
+			(void)cache->store(source, key, pcm->data(), std::min<std::uint64_t>(key.loopOffset + key.loopLength, pcm->size()));
+		}
+
+		// Blocks are decoded on the audio thread as they are played
+		std::shared_ptr<const CompressedPcm> packed;
+		if (pcmCompression) {
+			packed = CompressedPcm::encode(pcm->data(), pcm->size(), std::max(key.channelCount, 1u));
+			pcm.reset();
+		}
+
+		// The audio thread switches to it on its next chunk, at the same sample
+		const std::lock_guard lock(mutex);
+		const std::shared_ptr<Track> t = getPlaying();
+		if (serial != t->serial)
+			return false;
+		Command command{ Command::Type::Cache, serial };
+		const std::size_t packedBytes = packed != nullptr ? packed->getByteSize() : 0;
+		if (packed != nullptr) {
+			command.buffer.resize(CompressedPcm::BlockFrames * packed->getChannelCount());
+			command.packed = std::move(packed);
+		}
+		else {
+			command.pcm = std::move(pcm);
+		}
+		if (!change(std::move(command)))
+			return false;
+		t->cacheRequested = true;
+		t->requestedPackedBytes = packedBytes;
+		return true;
+	}
+
+	void demote() override {
+		const std::lock_guard lock(mutex);
+		const std::shared_ptr<Track> t = getPlaying();
+		if (t->cacheRequested && change(Command{ Command::Type::Cache, t->serial })) {
+			t->cacheRequested = false;
+			t->requestedPackedBytes = 0;
+			requestRestart();
+		}
 	}
 };
 
@@ -108,25 +1154,33 @@ Music& Music::operator=(Music&&) noexcept = default;
 bool Music::openFromFile(const std::filesystem::path& filename) {
 	// First stop the music if it was already running
 	stop();
+	const std::lock_guard lock(m_impl->mutex); // OHMSBGM: Against the governor, and the audio thread is kept off until opened.
+	const Impl::Takeover  takeover(*m_impl);
+	m_impl->reset(); // OHMSBGM: Drop the queued track.
 
 	//////////////////////////////////////////////////// OHMSBGM.
-	std::shared_ptr<sf::FileInputStream> stream = std::make_shared<sf::FileInputStream>();
-	if (!stream->open(filename)) {
+	std::shared_ptr<InputStream> stream = openFileStream(filename);
+	if (stream == nullptr) {
 		err() << "Failed to open file stream to open bgm from file" << std::endl;
 		return false;
 	}
 
 	std::any points;
-	if (points = readLoopPoints(*stream); !points.has_value()) {
+	if (points = readPointsAndIndex(*stream, m_impl->track->index, filename); !points.has_value()) {
 		err() << "Failed to read comment to open bgm from file" << std::endl;
 		return false;
 	}
+	m_impl->track->gain = getLoudnessGain(filename);
 	(void)stream->seek(0);
-	m_impl->stream = stream;
+	m_impl->track->stream = std::make_shared<RegionInputStream>(stream);
+	m_impl->track->source = filename;
+	m_impl->track->reopen = [filename]() -> std::shared_ptr<InputStream> {
+		return openFileStream(filename);
+	};
 	////////////////////////////////////////////////////
 
 	// Open the underlying sound file
-	if (!m_impl->file.openFromStream(*m_impl->stream)) { // OHMSBGM:: Change to stream.
+	if (!m_impl->track->file->openFromStream(*m_impl->track->stream)) { // OHMSBGM:: Change to stream.
 		err() << "Failed to open music from file" << std::endl;
 		return false;
 	}
@@ -135,9 +1189,10 @@ bool Music::openFromFile(const std::filesystem::path& filename) {
 	m_impl->initialize();
 
 	// Initialize the stream
-	SoundStream::initialize(m_impl->file.getChannelCount(), m_impl->file.getSampleRate(), m_impl->file.getChannelMap());
+	SoundStream::initialize(m_impl->track->file->getChannelCount(), m_impl->track->file->getSampleRate(), m_impl->track->file->getChannelMap());
 
 	//////////////////////////////////////////////////// OHMSBGM.
+	applyGain(m_impl->track->gain);
 	if (points.type() == typeid(Span<std::uint64_t>)) {
 		setLoopPoints(std::any_cast<Span<std::uint64_t>>(points));
 	}
@@ -145,6 +1200,7 @@ bool Music::openFromFile(const std::filesystem::path& filename) {
 		setLoopPoints(std::any_cast<Span<Time>>(points));
 	}
 	setLooping(true);
+	Impl::attachPcmCache(*m_impl->track);
 	////////////////////////////////////////////////////
 
 	return true;
@@ -153,22 +1209,42 @@ bool Music::openFromFile(const std::filesystem::path& filename) {
 
 ////////////////////////////////////////////////////////////
 bool Music::openFromMemory(const void* data, std::size_t sizeInBytes) {
+	// OHMSBGM: Borrowed, the caller keeps the bytes alive.
+	if (!openFromMemory(std::shared_ptr<const std::byte[]>(static_cast<const std::byte*>(data), [](const std::byte*) {}), sizeInBytes))
+		return false;
+	const std::lock_guard lock(m_impl->mutex);
+	const Impl::Takeover  takeover(*m_impl);
+	m_impl->track->sharedBytes = 0;
+	m_impl->publishStats();
+	return true;
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::openFromMemory(std::shared_ptr<const std::byte[]> data, std::size_t sizeInBytes) {
 	// First stop the music if it was already running
 	stop();
+	const std::lock_guard lock(m_impl->mutex); // OHMSBGM: Against the governor, and the audio thread is kept off until opened.
+	const Impl::Takeover  takeover(*m_impl);
+	m_impl->reset(); // OHMSBGM: Drop the queued track.
 
 	//////////////////////////////////////////////////// OHMSBGM.
-	std::shared_ptr<sf::MemoryInputStream> stream = std::make_shared<sf::MemoryInputStream>(data, sizeInBytes);
+	std::shared_ptr<SharedMemoryInputStream> stream = std::make_shared<SharedMemoryInputStream>(data, sizeInBytes);
 	std::any points;
-	if (points = readLoopPoints(*stream); !points.has_value()) {
+	if (points = readPointsAndIndex(*stream, m_impl->track->index, {}); !points.has_value()) {
 		err() << "Failed to read comment to open bgm from memory" << std::endl;
 		return false;
 	}
 	(void)stream->seek(0);
-	m_impl->stream = stream;
+	m_impl->track->stream = std::make_shared<RegionInputStream>(stream);
+	m_impl->track->reopen = [data, sizeInBytes]() -> std::shared_ptr<InputStream> {
+		return std::make_shared<SharedMemoryInputStream>(data, sizeInBytes);
+	};
+	m_impl->track->sharedBytes = sizeInBytes;
 	////////////////////////////////////////////////////
 
 	// Open the underlying sound file
-	if (!m_impl->file.openFromStream(*m_impl->stream)) { // OHMSBGM:: Change to stream.
+	if (!m_impl->track->file->openFromStream(*m_impl->track->stream)) { // OHMSBGM:: Change to stream.
 		err() << "Failed to open music from memory" << std::endl;
 		return false;
 	}
@@ -177,9 +1253,10 @@ bool Music::openFromMemory(const void* data, std::size_t sizeInBytes) {
 	m_impl->initialize();
 
 	// Initialize the stream
-	SoundStream::initialize(m_impl->file.getChannelCount(), m_impl->file.getSampleRate(), m_impl->file.getChannelMap());
+	SoundStream::initialize(m_impl->track->file->getChannelCount(), m_impl->track->file->getSampleRate(), m_impl->track->file->getChannelMap());
 
 	//////////////////////////////////////////////////// OHMSBGM.
+	applyGain(m_impl->track->gain);
 	if (points.type() == typeid(Span<std::uint64_t>)) {
 		setLoopPoints(std::any_cast<Span<std::uint64_t>>(points));
 	}
@@ -197,20 +1274,23 @@ bool Music::openFromMemory(const void* data, std::size_t sizeInBytes) {
 bool Music::openFromStream(InputStream& stream) {
 	// First stop the music if it was already running
 	stop();
+	const std::lock_guard lock(m_impl->mutex); // OHMSBGM: Against the governor, and the audio thread is kept off until opened.
+	const Impl::Takeover  takeover(*m_impl);
+	m_impl->reset(); // OHMSBGM: Drop the queued track.
 
 	//////////////////////////////////////////////////// OHMSBGM.
 	std::shared_ptr<InputStream> _stream = std::shared_ptr<InputStream>(&stream, BGM_STREAM_EMPTY_DELETER());
 	std::any points;
-	if (points = readLoopPoints(*_stream); !points.has_value()) {
+	if (points = readPointsAndIndex(*_stream, m_impl->track->index, {}); !points.has_value()) {
 		err() << "Failed to read comment to open bgm from stream" << std::endl;
 		return false;
 	}
 	(void)_stream->seek(0);
-	m_impl->stream = _stream;
+	m_impl->track->stream = std::make_shared<RegionInputStream>(_stream);
 	////////////////////////////////////////////////////
 
 	// Open the underlying sound file
-	if (!m_impl->file.openFromStream(*m_impl->stream)) { // OHMSBGM:: Change to stream.
+	if (!m_impl->track->file->openFromStream(*m_impl->track->stream)) { // OHMSBGM:: Change to stream.
 		err() << "Failed to open music from stream" << std::endl;
 		return false;
 	}
@@ -219,9 +1299,10 @@ bool Music::openFromStream(InputStream& stream) {
 	m_impl->initialize();
 
 	// Initialize the stream
-	SoundStream::initialize(m_impl->file.getChannelCount(), m_impl->file.getSampleRate(), m_impl->file.getChannelMap());
+	SoundStream::initialize(m_impl->track->file->getChannelCount(), m_impl->track->file->getSampleRate(), m_impl->track->file->getChannelMap());
 
 	//////////////////////////////////////////////////// OHMSBGM.
+	applyGain(m_impl->track->gain);
 	if (points.type() == typeid(Span<std::uint64_t>)) {
 		setLoopPoints(std::any_cast<Span<std::uint64_t>>(points));
 	}
@@ -236,76 +1317,536 @@ bool Music::openFromStream(InputStream& stream) {
 
 
 ////////////////////////////////////////////////////////////
-Time Music::getDuration() const {
-	return m_impl->file.getDuration();
+bool Music::openFromForwardStream(InputStream& stream) {
+	stop();
+	const std::lock_guard lock(m_impl->mutex);
+	const Impl::Takeover  takeover(*m_impl);
+	m_impl->reset();
+
+	// Neither the page index nor a full check can be had without reading the whole stream first
+	auto forward = std::make_shared<ForwardInputStream>(std::shared_ptr<InputStream>(&stream, BGM_STREAM_EMPTY_DELETER()));
+	const PageCheck check = pageCheck == PageCheck::Full ? PageCheck::Headers : pageCheck.load();
+	std::any points;
+	if (points = readLoopPoints(*forward, &m_impl->track->index, false, check); !points.has_value()) {
+		err() << "Failed to read comment to open bgm from forward stream" << std::endl;
+		return false;
+	}
+
+	// Not rewound: the decoder is opened from the start of the kept bytes, which it seeks to from where the scan stopped.
+	// A seek right where the stream already is fails from now on, so that the decoder finds out it can't seek.
+	forward->setProbing(true);
+	if (!m_impl->track->file->openFromStream(*forward)) {
+		err() << "Failed to open music from forward stream" << std::endl;
+		return false;
+	}
+	forward->setProbing(false);
+	forward->release();
+	m_impl->track->forward = std::move(forward);
+
+	m_impl->initialize();
+
+	SoundStream::initialize(m_impl->track->file->getChannelCount(), m_impl->track->file->getSampleRate(), m_impl->track->file->getChannelMap());
+	applyGain(m_impl->track->gain);
+
+	if (points.type() == typeid(Span<std::uint64_t>)) {
+		setLoopPoints(std::any_cast<Span<std::uint64_t>>(points));
+	}
+	else if (points.type() == typeid(Span<Time>)) {
+		setLoopPoints(std::any_cast<Span<Time>>(points));
+	}
+	setLooping(true);
+	m_impl->resetLoopCopy();
+
+	return true;
 }
 
 
 ////////////////////////////////////////////////////////////
-Music::TimeSpan Music::getLoopPoints() const {
-	return TimeSpan{ samplesToTime(m_impl->loopSpan.offset), samplesToTime(m_impl->loopSpan.length) };
+bool Music::openFromPack(const Pack& pack, std::string_view name) {
+	const Pack::Entry* entry = pack.find(name);
+	if (entry == nullptr) {
+		err() << "No bgm named " << name << " in pack " << pack.getPath() << std::endl;
+		return false;
+	}
+
+	stop();
+	const std::lock_guard lock(m_impl->mutex);
+	const Impl::Takeover  takeover(*m_impl);
+	m_impl->reset();
+
+	// Everything the tags would give is in the entry.
+	const std::any points = Pack::getLoopPoints(*entry);
+	pack.getSeekIndex(*entry, m_impl->track->index);
+	std::shared_ptr<InputStream> stream = Pack::openEntry(pack.getFile(), *entry);
+	if (stream == nullptr || !points.has_value()) {
+		err() << "Failed to open bgm " << name << " from pack " << pack.getPath() << std::endl;
+		return false;
+	}
+	m_impl->track->stream = std::make_shared<RegionInputStream>(stream);
+	m_impl->track->reopen = [file = pack.getFile(), entry = *entry]() -> std::shared_ptr<InputStream> {
+		return Pack::openEntry(file, entry);
+	};
+
+	if (!m_impl->track->file->openFromStream(*m_impl->track->stream)) {
+		err() << "Failed to open music from pack" << std::endl;
+		return false;
+	}
+
+	m_impl->initialize();
+
+	SoundStream::initialize(m_impl->track->file->getChannelCount(), m_impl->track->file->getSampleRate(), m_impl->track->file->getChannelMap());
+	applyGain(m_impl->track->gain);
+
+	if (points.type() == typeid(Span<std::uint64_t>)) {
+		setLoopPoints(std::any_cast<Span<std::uint64_t>>(points));
+	}
+	else if (points.type() == typeid(Span<Time>)) {
+		setLoopPoints(std::any_cast<Span<Time>>(points));
+	}
+	setLooping(true);
+
+	return true;
 }
 
 
 ////////////////////////////////////////////////////////////
-void Music::setLoopPoints(TimeSpan timePoints) {
-	Span<std::uint64_t> samplePoints{ timeToSamples(timePoints.offset), timeToSamples(timePoints.length) };
+bool Music::queueFromFile(const std::filesystem::path& filename) {
+	std::shared_ptr<InputStream> stream = openFileStream(filename);
+	if (stream == nullptr) {
+		err() << "Failed to open file stream to queue bgm from file" << std::endl;
+		return false;
+	}
+	return queueTrack(stream, [filename]() -> std::shared_ptr<InputStream> {
+		return openFileStream(filename);
+	}, filename);
+}
 
-	// Check our state. This averts a divide-by-zero. GetChannelCount() is cheap enough to use often
-	if (getChannelCount() == 0 || m_impl->file.getSampleCount() == 0) {
-		err() << "Music is not in a valid state to assign Loop Points." << std::endl;
-		return;
+
+////////////////////////////////////////////////////////////
+bool Music::queueFromMemory(const void* data, std::size_t sizeInBytes) {
+	return queueTrack(std::make_shared<sf::MemoryInputStream>(data, sizeInBytes), [data, sizeInBytes]() -> std::shared_ptr<InputStream> {
+		return std::make_shared<sf::MemoryInputStream>(data, sizeInBytes);
+	}, {});
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::queueFromMemory(std::shared_ptr<const std::byte[]> data, std::size_t sizeInBytes) {
+	return queueTrack(std::make_shared<SharedMemoryInputStream>(data, sizeInBytes), [data, sizeInBytes]() -> std::shared_ptr<InputStream> {
+		return std::make_shared<SharedMemoryInputStream>(data, sizeInBytes);
+	}, {}, sizeInBytes);
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::queueFromStream(InputStream& stream) {
+	return queueTrack(std::shared_ptr<InputStream>(&stream, BGM_STREAM_EMPTY_DELETER()), nullptr, {});
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::clearQueue() {
+	const std::lock_guard lock(m_impl->mutex);
+	if (m_impl->hasQueued() && m_impl->change(Impl::Command{ Impl::Command::Type::Queue }))
+		m_impl->queuedSerial = 0;
+	SoundStream::setLooping(m_impl->looping);
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::hasQueued() const {
+	const std::lock_guard lock(m_impl->mutex);
+	return m_impl->hasQueued();
+}
+
+
+////////////////////////////////////////////////////////////
+Music::TransitionStats Music::getTransitionStats() const {
+	return m_impl->publishedStats.load().transitions;
+}
+
+
+////////////////////////////////////////////////////////////
+Music::LoopStats Music::getLoopStats() const {
+	return m_impl->publishedStats.load().loops;
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::pinLoopRegion() {
+	std::function<std::shared_ptr<InputStream>()> reopen;
+	std::vector<SeekIndex::Point>                 points;
+	Span<std::uint64_t>                           frames;
+	std::uint64_t                                 serial = 0;
+	{
+		const std::lock_guard lock(m_impl->mutex);
+		const unsigned int channelCount = std::max(getChannelCount(), 1u);
+		const std::shared_ptr<Impl::Track> track = m_impl->getPlaying();
+		reopen = track->reopen;
+		points = track->index.points;
+		frames = { track->requestedLoop.offset / channelCount, track->requestedLoop.length / channelCount };
+		serial = track->serial;
+	}
+	if (!reopen || points.empty()) {
+		err() << "Pinning the loop region needs a file or memory music with seek points." << std::endl;
+		return false;
 	}
 
-	// Round up to the next even sample if needed
-	samplePoints.offset += (getChannelCount() - 1);
-	samplePoints.offset -= (samplePoints.offset % getChannelCount());
-	samplePoints.length += (getChannelCount() - 1);
-	samplePoints.length -= (samplePoints.length % getChannelCount());
+	std::shared_ptr<InputStream> source = reopen();
+	const std::optional<std::size_t> size = source != nullptr ? source->getSize() : std::nullopt;
+	if (!size) {
+		err() << "Failed to reopen bgm to pin its loop region." << std::endl;
+		return false;
+	}
 
-	// Validate
-	if (samplePoints.offset >= m_impl->file.getSampleCount()) {
-		err() << "LoopPoints offset val must be in range [0, Duration)." << std::endl;
-		return;
+	// From two seek points before the loop start, for the pre-roll, to two after the loop end.
+	// The margins cover the reads of the decoder around its target when it searches.
+	const auto after = [&points](std::uint64_t frame) {
+		return static_cast<std::size_t>(std::upper_bound(points.cbegin(), points.cend(), frame, [](std::uint64_t f, const SeekIndex::Point& p) {
+			return f < p.frame;
+		}) - points.cbegin());
+	};
+	const std::size_t first = after(frames.offset);
+	const std::size_t last = after(frames.offset + frames.length) + 1;
+	std::uint64_t begin = first >= 2 ? points[first - 2].offset : 0;
+	std::uint64_t end = last < points.size() ? points[last].offset : *size;
+	begin = begin > ForwardDecodeBytes ? begin - ForwardDecodeBytes : 0;
+	end = std::min<std::uint64_t>(end + ForwardDecodeBytes, *size);
+
+	auto bytes = std::make_shared<std::vector<std::byte>>(static_cast<std::size_t>(end - begin));
+	if (auto r = source->seek(static_cast<std::size_t>(begin)); !r || *r != begin) {
+		err() << "Failed to read the loop region of bgm." << std::endl;
+		return false;
+	}
+	if (auto r = source->read(bytes->data(), bytes->size()); !r || *r != bytes->size()) {
+		err() << "Failed to read the loop region of bgm." << std::endl;
+		return false;
 	}
 
-	if (samplePoints.length == 0) {
-		err() << "LoopPoints length val must be nonzero." << std::endl;
-		return;
+	const std::lock_guard lock(m_impl->mutex);
+	if (serial != m_impl->getPlaying()->serial)
+		return false;
+	Impl::Command command{ Impl::Command::Type::Region, serial };
+	command.region = { begin, std::move(bytes) };
+	return m_impl->change(std::move(command));
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::unpinLoopRegion() {
+	const std::lock_guard lock(m_impl->mutex);
+	(void)m_impl->change(Impl::Command{ Impl::Command::Type::Region, m_impl->getPlaying()->serial });
+}
+
+
+////////////////////////////////////////////////////////////
+Music::Residency Music::getResidency() const {
+	return m_impl->publishedStats.load().residency;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setPageIndexing(PageIndexing indexing) {
+	pageIndexing = indexing;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setPageCheck(PageCheck check) {
+	pageCheck = check;
+}
+
+
+////////////////////////////////////////////////////////////
+Music::SeekStats Music::getSeekStats() const {
+	return m_impl->publishedStats.load().seeks;
+}
+
+
+////////////////////////////////////////////////////////////
+Music::ReadStats Music::getReadStats() const {
+	return m_impl->publishedStats.load().reads;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setMarkers(std::vector<Marker> markers) {
+	std::sort(markers.begin(), markers.end(), [](const Marker& a, const Marker& b) {
+		return a.sampleOffset < b.sampleOffset;
+	});
+	Impl::Command command{ Impl::Command::Type::Markers };
+	command.markers = std::make_shared<const std::vector<Marker>>(std::move(markers));
+
+	const std::lock_guard lock(m_impl->mutex);
+	(void)m_impl->change(std::move(command));
+}
+
+
+////////////////////////////////////////////////////////////
+std::optional<Music::Event> Music::pollEvent() {
+	return m_impl->events.pop();
+}
+
+
+////////////////////////////////////////////////////////////
+std::uint64_t Music::getDroppedEvents() const {
+	return m_impl->droppedEvents;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setReadAhead(std::size_t blocks) {
+	readAheadBlocks = blocks;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setPcmCompression(bool enabled) {
+	pcmCompression = enabled;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setDecodeThreads(unsigned int threads) {
+	decodeThreads = threads;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setLoudnessTarget(float lufs) {
+	loudnessTarget = lufs;
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::isInAudioCallback() {
+	return inAudioCallback;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setPcmCache(const std::filesystem::path& directory, std::uint64_t capacity) {
+	std::shared_ptr<const PcmCache> cache = directory.empty() ? nullptr : std::make_shared<const PcmCache>(directory, capacity);
+	if (cache != nullptr)
+		cache->evict();
+	const std::lock_guard lock(pcmCacheMutex);
+	pcmCache = std::move(cache);
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::cachePcm() {
+	const std::shared_ptr<const PcmCache> cache = getPcmCache();
+	std::function<std::shared_ptr<InputStream>()> reopen;
+	std::filesystem::path source;
+	PcmCache::Key key;
+	SeekIndex index;
+	std::uint64_t serial = 0;
+	{
+		const std::lock_guard lock(m_impl->mutex);
+		const std::shared_ptr<Impl::Track> track = m_impl->getPlaying();
+		if (track->mapRequested)
+			return true;
+		reopen = track->reopen;
+		source = track->source;
+		key = Impl::makeCacheKey(*track);
+		index = track->index;
+		serial = track->serial;
+	}
+	if (cache == nullptr || source.empty() || !reopen || !PcmCache::makeKey(source, key)) {
+		err() << "Caching pcm needs the pcm cache to be set and music opened from a file." << std::endl;
+		return false;
 	}
 
-	// Clamp End Point
-	samplePoints.length = std::min(samplePoints.length, m_impl->file.getSampleCount() - samplePoints.offset);
+	// Nothing after the loop end is played while looping
+	const std::shared_ptr<std::vector<std::int16_t>> pcm = Impl::decode(reopen, std::move(index), key.loopOffset + key.loopLength);
+	if (pcm == nullptr || !cache->store(source, key, pcm->data(), pcm->size()))
+		return false;
 
-	// If this change has no effect, we can return without touching anything
-	if (samplePoints.offset == m_impl->loopSpan.offset && samplePoints.length == m_impl->loopSpan.length)
+	PcmCache::Entry entry = cache->find(source, key);
+	const std::lock_guard lock(m_impl->mutex);
+	const std::shared_ptr<Impl::Track> track = m_impl->getPlaying();
+	if (serial != track->serial || entry.samples == nullptr)
+		return false;
+	Impl::Command command{ Impl::Command::Type::Mapped, serial };
+	command.mapped = std::move(entry);
+	if (!m_impl->change(std::move(command)))
+		return false;
+	track->mapRequested = true;
+	return true;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::play() {
+	//////////////////////////////////////////////////// OHMSBGM: Under the lock, so that `streaming` follows the stream.
+	const std::lock_guard lock(m_impl->mutex);
+	if (getChannelCount() != 0 && !m_impl->streaming) {
+		// The rest of the chunk heard when paused is heard from now on
+		const Impl::Takeover takeover(*m_impl);
+		Impl::Published&     p = m_impl->state;
+		if (p.status != Status::Playing) {
+			p.status = Status::Playing;
+			p.chunkTime = Impl::now();
+			m_impl->publish();
+		}
+		m_impl->streaming = true;
+	}
+	////////////////////////////////////////////////////
+	SoundStream::play();
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::pause() {
+	const std::lock_guard lock(m_impl->mutex); // OHMSBGM.
+	SoundStream::pause();
+
+	//////////////////////////////////////////////////// OHMSBGM: Keep the position reached, and what is left of the chunk.
+	m_impl->streaming = false;
+	const Impl::Takeover takeover(*m_impl);
+	Impl::Published&     p = m_impl->state;
+	if (p.status != Status::Playing)
 		return;
+	const std::uint64_t heard = Impl::getHeard(p, Impl::now());
+	p.status = Status::Paused;
+	p.chunkOffset += heard;
+	p.chunkCount -= heard;
+	p.samplesPlayed += heard;
+	m_impl->publish();
+	////////////////////////////////////////////////////
+}
 
-	// When we apply this change, we need to "reset" this instance and its buffer
 
-	// Get old playing status and position
-	const Status oldStatus = getStatus();
-	const Time   oldPos = getPlayingOffset();
+////////////////////////////////////////////////////////////
+void Music::stop() {
+	const std::lock_guard lock(m_impl->mutex); // OHMSBGM.
+	SoundStream::stop();
 
-	// Unload
-	stop();
+	//////////////////////////////////////////////////// OHMSBGM.
+	m_impl->streaming = false;
+	const Impl::Takeover takeover(*m_impl);
+	Impl::Published&     p = m_impl->state;
+	p.status = Status::Stopped;
+	p.chunkOffset = 0;
+	p.chunkCount = 0;
+	m_impl->publish();
+	////////////////////////////////////////////////////
+}
+
+
+////////////////////////////////////////////////////////////
+Music::Snapshot Music::snapshot() const {
+	const Impl::Published p = m_impl->published.load();
+	const std::int64_t    time = Impl::now();
+
+	Snapshot res;
+	res.status = p.status;
+	const std::uint64_t heard = res.status == Status::Playing ? Impl::getHeard(p, time) : 0;
+	res.samplesPlayed = p.samplesPlayed + heard;
+	res.loopCount = p.loopCount;
+
+	// The last chunk is over, the stream has stopped by itself
+	if (res.status == Status::Playing && p.ending && heard == p.chunkCount)
+		res.status = Status::Stopped;
+	if (p.rate != 0)
+		res.position = microseconds(static_cast<std::int64_t>((p.chunkOffset + heard) * 1000000 / p.rate));
+	// Unlike `rate`, set before the first chunk
+	if (const std::uint64_t rate = std::uint64_t{ p.sampleRate } * p.channelCount; rate != 0) {
+		const auto toTime = [rate](std::uint64_t samples) {
+			return microseconds(static_cast<std::int64_t>(samples * 1000000 / rate));
+		};
+		res.duration = toTime(p.sampleCount);
+		res.loopPoints = TimeSpan{ toTime(p.loopOffset), toTime(p.loopLength) };
+	}
+	res.channelCount = p.channelCount;
+	res.sampleRate = p.sampleRate;
+	res.isVirtual = p.isVirtual;
+	res.looping = m_impl->looping;
+	res.volume = m_impl->volume * 100.f;
+	return res;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setLooping(bool loop) {
+	const std::lock_guard lock(m_impl->mutex);
+	m_impl->looping = loop;
+	if (loop)
+		m_impl->requestRestart(); // OHMSBGM: Parked by a worker, see `getLoopStats`.
+
+	// The underlying stream only asks for `onLoop()` when it is looping,
+	// so keep it on while a track is waiting to take over.
+	SoundStream::setLooping(loop || m_impl->hasQueued());
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::isLooping() const {
+	return m_impl->looping;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setVolume(float volume) {
+	m_impl->volume = volume / 100.f;
+	SoundStream::setVolume(volume * m_impl->gain); // OHMSBGM: Normalized.
+}
+
+
+////////////////////////////////////////////////////////////
+float Music::getVolume() const {
+	return m_impl->volume * 100.f;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setAudibility(float gain) {
+	m_impl->audibility = gain;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::setVirtualThreshold(float gain) {
+	m_impl->virtualThreshold = gain;
+}
+
+
+////////////////////////////////////////////////////////////
+bool Music::isVirtual() const {
+	return m_impl->published.load().isVirtual;
+}
+
+
+////////////////////////////////////////////////////////////
+Time Music::getDuration() const {
+	const std::lock_guard lock(m_impl->mutex); // OHMSBGM: The track may be switched by the audio thread.
+	return samplesToTime(m_impl->getPlaying()->sampleCount);
+}
 
-	// Set
-	m_impl->loopSpan = samplePoints;
 
-	// Restore
-	if (oldPos != Time::Zero)
-		setPlayingOffset(oldPos);
+////////////////////////////////////////////////////////////
+Music::TimeSpan Music::getLoopPoints() const {
+	const std::lock_guard lock(m_impl->mutex); // OHMSBGM: The track may be switched by the audio thread.
+	const Span<std::uint64_t> loop = m_impl->getPlaying()->requestedLoop;
+	return TimeSpan{ samplesToTime(loop.offset), samplesToTime(loop.length) };
+}
+
 
-	// Resume
-	if (oldStatus == Status::Playing)
-		play();
+////////////////////////////////////////////////////////////
+void Music::setLoopPoints(TimeSpan timePoints) {
+	setLoopPoints(Span<std::uint64_t>{ timeToSamples(timePoints.offset), timeToSamples(timePoints.length) }); // OHMSBGM: Same checks.
 }
 
 ////////////////////////////////////////////////////////////
 void Music::setLoopPoints(Span<std::uint64_t> samplePoints) {
+	//////////////////////////////////////////////////// OHMSBGM: Checked against the track the change is sent for.
+	const std::lock_guard lock(m_impl->mutex);
+	const std::shared_ptr<Impl::Track> track = m_impl->getPlaying();
+	////////////////////////////////////////////////////
+
 	// Check our state. This averts a divide-by-zero. GetChannelCount() is cheap enough to use often
-	if (getChannelCount() == 0 || m_impl->file.getSampleCount() == 0) {
+	if (getChannelCount() == 0 || track->sampleCount == 0) {
 		err() << "Music is not in a valid state to assign Loop Points." << std::endl;
 		return;
 	}
@@ -317,7 +1858,7 @@ void Music::setLoopPoints(Span<std::uint64_t> samplePoints) {
 	samplePoints.length -= (samplePoints.length % getChannelCount());
 
 	// Validate
-	if (samplePoints.offset >= m_impl->file.getSampleCount()) {
+	if (samplePoints.offset >= track->sampleCount) {
 		err() << "LoopPoints offset val must be in range [0, Duration)." << std::endl;
 		return;
 	}
@@ -328,90 +1869,276 @@ void Music::setLoopPoints(Span<std::uint64_t> samplePoints) {
 	}
 
 	// Clamp End Point
-	samplePoints.length = std::min(samplePoints.length, m_impl->file.getSampleCount() - samplePoints.offset);
+	samplePoints.length = std::min(samplePoints.length, track->sampleCount - samplePoints.offset);
 
 	// If this change has no effect, we can return without touching anything
-	if (samplePoints.offset == m_impl->loopSpan.offset && samplePoints.length == m_impl->loopSpan.length)
+	if (samplePoints.offset == track->requestedLoop.offset && samplePoints.length == track->requestedLoop.length)
 		return;
 
-	// When we apply this change, we need to "reset" this instance and its buffer
-
-	// Get old playing status and position
-	const Status oldStatus = getStatus();
-	const Time   oldPos = getPlayingOffset();
-
-	// Unload
-	stop();
-
-	// Set
-	m_impl->loopSpan = samplePoints;
-
-	// Restore
-	if (oldPos != Time::Zero)
-		setPlayingOffset(oldPos);
+	//////////////////////////////////////////////////// OHMSBGM: A forward-only stream replays its loop from a copy.
+	if (track->forward != nullptr && samplePoints.length > MaxForwardLoopSamples) {
+		err() << "LoopPoints of a forward-only stream can't be longer than " << samplesToTime(MaxForwardLoopSamples).asSeconds() << " seconds." << std::endl;
+		return;
+	}
+	// The copy is made as the loop is first played, so the loop start must be ahead; the audio thread checks it again
+	if (track->forward != nullptr && samplePoints.offset != track->requestedLoop.offset && samplePoints.offset < m_impl->lastOffset) {
+		err() << "LoopPoints of a forward-only stream must start after the position, which can't go back." << std::endl;
+		return;
+	}
+	////////////////////////////////////////////////////
 
-	// Resume
-	if (oldStatus == Status::Playing)
-		play();
+	//////////////////////////////////////////////////// OHMSBGM: Apply it from the next chunk on, without restarting the stream.
+	Impl::Command command{ Impl::Command::Type::LoopPoints, track->serial };
+	command.loopSpan = samplePoints;
+	// Allocated here, so that the audio thread fills it without allocating
+	if (track->forward != nullptr)
+		command.buffer.reserve(static_cast<std::size_t>(samplePoints.length));
+	// Set first, a rejection of the audio thread shows the previous points again
+	const Span<std::uint64_t> previous = track->requestedLoop;
+	track->requestedLoop = samplePoints;
+	if (!m_impl->change(std::move(command)))
+		track->requestedLoop = previous;
+	////////////////////////////////////////////////////
 }
 
 
 ////////////////////////////////////////////////////////////
 bool Music::onGetData(SoundStream::Chunk& data) {
-	const std::lock_guard lock(m_impl->mutex);
+	//////////////////////////////////////////////////// OHMSBGM: Never locks; takes the changes of the user's threads first.
+	const AudioCallbackScope scope(m_impl->callbacks);
+	if (m_impl->takeovers != 0) {
+		// A user's thread has the state while the music stops, this chunk is the last one before
+		data.sampleCount = 0;
+		return true;
+	}
+	m_impl->drain();
+	////////////////////////////////////////////////////
 
 	std::size_t         toFill = m_impl->samples.size();
-	std::uint64_t       currentOffset = m_impl->file.getSampleOffset();
-	const std::uint64_t loopEnd = m_impl->loopSpan.offset + m_impl->loopSpan.length;
+	std::uint64_t       currentOffset = m_impl->getSampleOffset(); // OHMSBGM: Decoder or clock.
+	const std::uint64_t loopEnd = m_impl->track->loopSpan.offset + m_impl->track->loopSpan.length;
 
 	// If the loop end is enabled and imminent, request less data.
 	// This will trip an "onLoop()" call from the underlying SoundStream,
 	// and we can then take action.
-	if (isLooping() && (m_impl->loopSpan.length != 0) && (currentOffset <= loopEnd) && (currentOffset + toFill > loopEnd))
+	if (isLooping() && (m_impl->track->loopSpan.length != 0) && (currentOffset <= loopEnd) && (currentOffset + toFill > loopEnd))
 		toFill = static_cast<std::size_t>(loopEnd - currentOffset);
 
 	// Fill the chunk parameters
+	const auto start = std::chrono::steady_clock::now(); // OHMSBGM: Time the chunk.
 	data.samples = m_impl->samples.data();
-	data.sampleCount = static_cast<std::size_t>(m_impl->file.read(m_impl->samples.data(), toFill));
-	currentOffset += data.sampleCount;
+	data.sampleCount = static_cast<std::size_t>(m_impl->read(m_impl->samples.data(), toFill)); // OHMSBGM: Decoder, cache or silence.
+	//////////////////////////////////////////////////// OHMSBGM.
+	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	ReadStats& reads = m_impl->stats.reads;
+	++reads.count;
+	reads.lastDuration = microseconds(elapsed.count());
+	reads.maxDuration = std::max(reads.maxDuration, reads.lastDuration);
+	m_impl->pushMarkers(currentOffset, currentOffset + data.sampleCount);
+	////////////////////////////////////////////////////
+	const std::uint64_t chunkOffset = currentOffset; // OHMSBGM.
+	currentOffset = m_impl->getSampleOffset();
 
 	// Check if we have stopped obtaining samples or reached either the EOF or the loop end point
-	return (data.sampleCount != 0) && (currentOffset < m_impl->file.getSampleCount()) &&
-		(currentOffset != loopEnd || m_impl->loopSpan.length == 0);
+	const bool more = (data.sampleCount != 0) && (currentOffset < m_impl->track->file->getSampleCount()) &&
+		(currentOffset != loopEnd || m_impl->track->loopSpan.length == 0);
+
+	//////////////////////////////////////////////////// OHMSBGM: Publish the chunk, which starts being heard now.
+	Impl::Published& p = m_impl->state;
+	p.chunkOffset = chunkOffset;
+	p.chunkCount = data.sampleCount;
+	p.chunkTime = Impl::now();
+	p.samplesPlayed = m_impl->streamed;
+	p.loopCount = m_impl->stats.loops.count;
+	p.rate = std::uint64_t{ getSampleRate() } * getChannelCount();
+	p.ending = !more && !SoundStream::isLooping();
+	p.isVirtual = m_impl->isVirtual;
+	m_impl->publish();
+	m_impl->publishStats();
+	m_impl->streamed += data.sampleCount;
+	m_impl->lastOffset.store(currentOffset, std::memory_order_relaxed);
+	////////////////////////////////////////////////////
+
+	// OHMSBGM: Otherwise `onLoop()` decides.
+	if (!more && !SoundStream::isLooping())
+		m_impl->pushEvent(Event::Type::EndOfStream, currentOffset);
+	return more;
 }
 
 
 ////////////////////////////////////////////////////////////
 void Music::onSeek(Time timeOffset) {
-	const std::lock_guard lock(m_impl->mutex);
-	m_impl->file.seek(timeOffset);
+	//////////////////////////////////////////////////// OHMSBGM: Taken by the next chunk, on the thread owning the state, with the changes sent before.
+	std::uint64_t offset = timeToSamples(timeOffset);
+	offset -= offset % std::max(getChannelCount(), 1u);
+	m_impl->seekTarget = offset;
+	////////////////////////////////////////////////////
 }
 
 
 ////////////////////////////////////////////////////////////
 std::optional<std::uint64_t> Music::onLoop() {
 	// Called by underlying SoundStream so we can determine where to loop.
-	const std::lock_guard lock(m_impl->mutex);
-	const std::uint64_t   currentOffset = m_impl->file.getSampleOffset();
+	//////////////////////////////////////////////////// OHMSBGM: Never locks, and acts on the state `onGetData()` ended with.
+	const AudioCallbackScope scope(m_impl->callbacks);
+	if (m_impl->takeovers != 0) {
+		// A user's thread has the state while the music stops: carry on from the end of the last chunk,
+		// the next one ends right away and comes back here
+		return m_impl->lastOffset.load(std::memory_order_relaxed);
+	}
+	////////////////////////////////////////////////////
+	const std::uint64_t currentOffset = m_impl->getSampleOffset(); // OHMSBGM: Decoder or clock.
+
+	//////////////////////////////////////////////////// OHMSBGM: Not while there is no room to give the finished track back, the next wrap tries again.
+	if (m_impl->next != nullptr && m_impl->canRelease()) {
+		// The current track is over, either at its loop end or at its EOF.
+		// Hand the stream over to the queued track, which shares its format,
+		// so the next chunk continues with its first sample without reinitializing anything.
+		const std::uint64_t loopEnd = m_impl->track->loopSpan.offset + m_impl->track->loopSpan.length;
+		const std::uint64_t trackEnd = (isLooping() && (m_impl->track->loopSpan.length != 0) && (currentOffset <= loopEnd)) ?
+			loopEnd : m_impl->track->file->getSampleCount();
+		const std::uint64_t gap = (trackEnd > currentOffset) ? (trackEnd - currentOffset) : 0;
+
+		// The finished track is released by the user's threads, with the block decoded from it
+		Impl::Command retired{ Impl::Command::Type::Retired };
+		retired.track = std::move(m_impl->track);
+		retired.blockSource = std::move(m_impl->blockSource);
+		m_impl->track = std::move(m_impl->next);
+		m_impl->release(std::move(retired));
+		SoundStream::setLooping(m_impl->looping);
+		if (m_impl->track->gain != m_impl->gain)
+			applyGain(m_impl->track->gain);
+
+		TransitionStats& transitions = m_impl->stats.transitions;
+		++transitions.count;
+		transitions.lastGap = gap;
+		transitions.maxGap = std::max(transitions.maxGap, gap);
+		m_impl->state.serial = m_impl->track->serial;
+		m_impl->publish();
+		m_impl->publishStats();
+		m_impl->requestRestart();
+
+		return m_impl->getSampleOffset();
+	}
+	////////////////////////////////////////////////////
 
-	if (isLooping() && (m_impl->loopSpan.length != 0) &&
-		(currentOffset == m_impl->loopSpan.offset + m_impl->loopSpan.length)) {
+	// OHMSBGM: A forward-only stream whose loop region wasn't kept ends there instead.
+	if (isLooping() && (m_impl->track->loopSpan.length != 0) &&
+		(currentOffset == m_impl->track->loopSpan.offset + m_impl->track->loopSpan.length) && m_impl->canWrapTo(m_impl->track->loopSpan.offset)) {
 		// Looping is enabled, and either we're at the loop end, or we're at the EOF
 		// when it's equivalent to the loop end (loop end takes priority). Send us to loop begin
-		m_impl->file.seek(m_impl->loopSpan.offset);
-		return m_impl->file.getSampleOffset();
+		//////////////////////////////////////////////////// OHMSBGM: Time the wrap.
+		const std::uint64_t reads = m_impl->getSourceReads();
+		const auto start = std::chrono::steady_clock::now();
+		const std::uint64_t offset = m_impl->wrap();
+		const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		m_impl->pushEvent(Event::Type::LoopWrapped, currentOffset);
+		LoopStats& loops = m_impl->stats.loops;
+		++loops.count;
+		loops.sourceReads += m_impl->getSourceReads() - reads;
+		loops.lastDuration = microseconds(elapsed.count());
+		loops.maxDuration = std::max(loops.maxDuration, loops.lastDuration);
+		m_impl->publishStats();
+		return offset;
+		////////////////////////////////////////////////////
 	}
 
-	if (isLooping() && (currentOffset >= m_impl->file.getSampleCount())) {
+	if (isLooping() && (currentOffset >= m_impl->track->file->getSampleCount()) && m_impl->canWrapTo(0)) { // OHMSBGM: Same.
 		// If we're at the EOF, reset to 0
-		m_impl->file.seek(0);
+		m_impl->seek(0); // OHMSBGM: Decoder or clock.
+		m_impl->pushEvent(Event::Type::LoopWrapped, currentOffset); // OHMSBGM.
 		return 0;
 	}
 
+	//////////////////////////////////////////////////// OHMSBGM: The stream ends, the changes are applied by the user's threads from now on.
+	m_impl->state.ending = true;
+	m_impl->publish();
+	m_impl->pushEvent(Event::Type::EndOfStream, currentOffset);
+	////////////////////////////////////////////////////
 	return std::nullopt;
 }
 
 
+
+////////////////////////////////////////////////////////////
+bool Music::queueTrack(std::shared_ptr<InputStream> stream, std::function<std::shared_ptr<InputStream>()> reopen, const std::filesystem::path& filename, std::size_t sharedBytes) {
+	if (getChannelCount() == 0 || getSampleRate() == 0) {
+		err() << "Music must be opened before queueing another bgm." << std::endl;
+		return false;
+	}
+
+	std::shared_ptr<Impl::Track> track = std::make_shared<Impl::Track>();
+	std::any points;
+	if (points = readPointsAndIndex(*stream, track->index, filename); !points.has_value()) {
+		err() << "Failed to read comment to queue bgm" << std::endl;
+		return false;
+	}
+	track->gain = getLoudnessGain(filename);
+	(void)stream->seek(0);
+
+	track->stream = std::make_shared<RegionInputStream>(std::move(stream));
+	track->reopen = std::move(reopen);
+	track->source = filename;
+	track->sharedBytes = sharedBytes;
+	if (!track->file->openFromStream(*track->stream)) {
+		err() << "Failed to open queued bgm" << std::endl;
+		return false;
+	}
+
+	// The queued track is played through the same output stream, so it can only take over if nothing has to be reinitialized
+	if (track->file->getChannelCount() != getChannelCount() || track->file->getSampleRate() != getSampleRate() ||
+		track->file->getChannelMap() != getChannelMap()) {
+		err() << "Queued bgm must have the same sample rate and channel map as the playing one." << std::endl;
+		return false;
+	}
+
+	// Same rules as `setLoopPoints()`, applied to the queued file
+	Span<std::uint64_t> samplePoints{ 0, track->file->getSampleCount() };
+	if (points.type() == typeid(Span<std::uint64_t>)) {
+		samplePoints = std::any_cast<Span<std::uint64_t>>(points);
+	}
+	else if (points.type() == typeid(Span<Time>)) {
+		const Span<Time> timePoints = std::any_cast<Span<Time>>(points);
+		samplePoints = { timeToSamples(timePoints.offset), timeToSamples(timePoints.length) };
+	}
+	samplePoints.offset += (getChannelCount() - 1);
+	samplePoints.offset -= (samplePoints.offset % getChannelCount());
+	samplePoints.length += (getChannelCount() - 1);
+	samplePoints.length -= (samplePoints.length % getChannelCount());
+	if (samplePoints.offset >= track->file->getSampleCount() || samplePoints.length == 0) {
+		err() << "Queued bgm has invalid loop points, looping the whole file instead." << std::endl;
+		samplePoints = { 0, track->file->getSampleCount() };
+	}
+	samplePoints.length = std::min(samplePoints.length, track->file->getSampleCount() - samplePoints.offset);
+	track->loopSpan = samplePoints;
+	track->requestedLoop = samplePoints;
+	track->sampleCount = track->file->getSampleCount();
+	track->channelCount = track->file->getChannelCount();
+	track->sampleRate = track->file->getSampleRate();
+	Impl::attachPcmCache(*track);
+
+	// Swapped in by the audio thread, which gives the replaced track back to be released here
+	const std::lock_guard lock(m_impl->mutex);
+	track->serial = ++m_impl->lastSerial;
+	Impl::Command command{ Impl::Command::Type::Queue };
+	command.track = track;
+	if (!m_impl->change(std::move(command)))
+		return false;
+	m_impl->queuedSerial = track->serial;
+	m_impl->queued.push_back(std::move(track));
+	SoundStream::setLooping(true);
+	return true;
+}
+
+
+////////////////////////////////////////////////////////////
+void Music::applyGain(float gain) {
+	// The output volume carries the gain, so normalizing costs nothing per sample
+	m_impl->gain = gain;
+	SoundStream::setVolume(m_impl->volume * gain * 100.f);
+}
+
+
 ////////////////////////////////////////////////////////////
 std::uint64_t Music::timeToSamples(Time position) const {
 	// Always ROUND, no unchecked truncation, hence the addition in the numerator.
@@ -28,6 +28,12 @@
 // Headers
 ////////////////////////////////////////////////////////////
 #include "BgmHeader.h" // OHMSBGM: Change included headers.
+#include "BgmPack.h"
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
 
 
 namespace bgm { // OHMSBGM: Change namespace.
@@ -35,14 +41,132 @@ namespace bgm { // OHMSBGM: Change namespace.
 ////////////////////////////////////////////////////////////
 /// \brief Streamed music played from an audio file
 ///
+/// The `SoundStream` base is private: its looping and volume
+/// are driven by the music, so only the rest of its interface
+/// is exposed below.
+///
 ////////////////////////////////////////////////////////////
-class Music : public SoundStream {
+class Music : private SoundStream { // OHMSBGM: Private base.
 public:
 	// OHMSBGM: Remove defination of Span.
 
+	using SoundStream::Status;
+
 	// Associated `Span` type
 	using TimeSpan = Span<Time>;
 
+	////////////////////////////////////////////////////////////
+	/// \brief Statistics of the switches to queued tracks
+	///
+	////////////////////////////////////////////////////////////
+	struct TransitionStats {
+		std::uint64_t count{};   //!< Number of queued tracks that took over the stream
+		std::uint64_t lastGap{}; //!< Samples of the finished track that were not delivered at the last switch
+		std::uint64_t maxGap{};  //!< Largest value of `lastGap` so far
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief Statistics of the loop wraps
+	///
+	////////////////////////////////////////////////////////////
+	struct LoopStats {
+		std::uint64_t count{};            //!< Number of wraps from the loop end to the loop start
+		std::uint64_t instant{};          //!< Wraps served by the restart decoder instead of a seek
+		Time          lastDuration{};     //!< Time spent in the last wrap
+		Time          maxDuration{};      //!< Longest wrap so far
+		std::uint64_t sourceReads{};      //!< Reads that went past the pinned loop region during wraps
+		std::uint64_t parks{};            //!< Restart decoders parked at the loop start and taken by the music
+		Time          lastParkDuration{}; //!< Time the worker spent opening and seeking the last one
+		Time          maxParkDuration{};  //!< Longest park so far
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief Statistics of the seeks requested through `setPlayingOffset`
+	///
+	////////////////////////////////////////////////////////////
+	struct SeekStats {
+		std::uint64_t count{};        //!< Number of seeks
+		std::uint64_t moved{};        //!< Seeks that only moved the clock over cached, virtual or kept samples
+		std::uint64_t indexed{};      //!< Decoder seeks that did not need the decoder to search for the position
+		std::uint64_t failed{};       //!< Seeks back in a forward-only stream, outside of the loop region kept, which left the position as it was
+		Time          lastDuration{}; //!< Time spent in the last seek
+		Time          maxDuration{};  //!< Longest seek so far
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief Statistics of the chunks of samples fed to the sound stream
+	///
+	////////////////////////////////////////////////////////////
+	struct ReadStats {
+		std::uint64_t count{};        //!< Number of chunks
+		Time          lastDuration{}; //!< Time spent producing the last chunk
+		Time          maxDuration{};  //!< Longest chunk so far, disk stalls included
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief Bytes of the music held in memory
+	///
+	////////////////////////////////////////////////////////////
+	struct Residency {
+		std::uint64_t residentBytes{}; //!< Size of the pinned loop region
+		std::uint64_t sourceReads{};   //!< Reads that went to the file or source stream, by all decoders of the track
+		std::uint64_t sharedBytes{};   //!< Size of the buffer shared with other musics, see `openFromMemory`
+		std::uint64_t privateBytes{};  //!< Buffers of this music alone: chunk, pinned region, samples decoded by the governor or kept for the loop wraps (not the codec state)
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief Position of the music to be notified of
+	///
+	////////////////////////////////////////////////////////////
+	struct Marker {
+		std::uint64_t sampleOffset{}; //!< Position, in samples of all channels like the loop points
+		std::uint64_t id{};           //!< Value given back in the event
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief Something the streaming thread went through while filling a chunk
+	///
+	////////////////////////////////////////////////////////////
+	struct Event {
+		enum class Type {
+			Marker,      //!< A marker was decoded
+			LoopWrapped, //!< The loop end (or the end of a looping music) was reached, and playing went back
+			EndOfStream  //!< The music ended without looping
+		};
+
+		Type          type{};
+		std::uint64_t id{};           //!< Id of the marker
+		std::uint64_t sampleOffset{}; //!< Position of the event in the music, comparable to `getPlayingOffset`
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief State of the playback published by the streaming thread
+	///
+	////////////////////////////////////////////////////////////
+	struct Snapshot {
+		Status        status{};        //!< Status of the stream
+		Time          position{};      //!< Playing position, like `getPlayingOffset`
+		std::uint64_t loopCount{};     //!< Loop wraps heard so far
+		std::uint64_t samplesPlayed{}; //!< Samples of all channels heard since the music was opened
+		Time          duration{};      //!< Duration of the track heard, like `getDuration`
+		TimeSpan      loopPoints{};    //!< Loop of the track heard, once applied by the streaming thread
+		unsigned int  channelCount{};
+		unsigned int  sampleRate{};
+		bool          looping{};       //!< Like `isLooping`
+		float         volume{};        //!< Like `getVolume`, in [0, 100]
+		bool          isVirtual{};     //!< Like `isVirtual`
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief How the pages of Ogg files are indexed when opened
+	///
+	////////////////////////////////////////////////////////////
+	enum class PageIndexing {
+		Off,        //!< Only the FLAC seek points are read (default)
+		Scan,       //!< Every page header is read once when opening
+		ScanAndSave //!< Same as `Scan`, and the index is kept in a `.ohmsidx` file next to the music file
+	};
+
 	////////////////////////////////////////////////////////////
 	/// \brief Default constructor
 	///
@@ -134,6 +258,49 @@ public:
 	////////////////////////////////////////////////////////////
 	Music& operator=(Music&&) noexcept;
 
+	////////////////////////////////////////// SoundStream
+	using SoundStream::getChannelCount;
+	using SoundStream::getSampleRate;
+	using SoundStream::getChannelMap;
+	using SoundStream::getStatus;
+	using SoundStream::setPlayingOffset;
+	using SoundStream::getPlayingOffset;
+	using SoundStream::setEffectProcessor;
+	////////////////////////////////////////// SoundStream
+
+	////////////////////////////////////////// SoundSource
+	using SoundStream::setPitch;
+	using SoundStream::setPan;
+	using SoundStream::setSpatializationEnabled;
+	using SoundStream::setPosition;
+	using SoundStream::setDirection;
+	using SoundStream::setCone;
+	using SoundStream::setVelocity;
+	using SoundStream::setDopplerFactor;
+	using SoundStream::setDirectionalAttenuationFactor;
+	using SoundStream::setRelativeToListener;
+	using SoundStream::setMinDistance;
+	using SoundStream::setMaxDistance;
+	using SoundStream::setMinGain;
+	using SoundStream::setMaxGain;
+	using SoundStream::setAttenuation;
+	using SoundStream::getPitch;
+	using SoundStream::getPan;
+	using SoundStream::isSpatializationEnabled;
+	using SoundStream::getPosition;
+	using SoundStream::getDirection;
+	using SoundStream::getCone;
+	using SoundStream::getVelocity;
+	using SoundStream::getDopplerFactor;
+	using SoundStream::getDirectionalAttenuationFactor;
+	using SoundStream::isRelativeToListener;
+	using SoundStream::getMinDistance;
+	using SoundStream::getMaxDistance;
+	using SoundStream::getMinGain;
+	using SoundStream::getMaxGain;
+	using SoundStream::getAttenuation;
+	////////////////////////////////////////// SoundSource
+
 	////////////////////////////////////////////////////////////
 	/// \brief Open a music from an audio file
 	///
@@ -178,6 +345,24 @@ public:
 	////////////////////////////////////////////////////////////
 	[[nodiscard]] bool openFromMemory(const void* data, std::size_t sizeInBytes);
 
+	////////////////////////////////////////////////////////////
+	/// \brief Open a music from an audio file in memory, sharing its ownership
+	///
+	/// The bytes are neither copied nor required to outlive the
+	/// caller: the music, its decoders and any music opened on the
+	/// same buffer each hold a reference, and the last one to let
+	/// go releases it through the deleter of `data`.
+	///
+	/// \param data        File data in memory, never written to
+	/// \param sizeInBytes Size of the data to load, in bytes
+	///
+	/// \return `true` if loading succeeded, `false` if it failed
+	///
+	/// \see `getResidency`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool openFromMemory(std::shared_ptr<const std::byte[]> data, std::size_t sizeInBytes);
+
 	////////////////////////////////////////////////////////////
 	/// \brief Open a music from an audio file in a custom stream
 	///
@@ -199,6 +384,529 @@ public:
 	////////////////////////////////////////////////////////////
 	[[nodiscard]] bool openFromStream(InputStream& stream);
 
+	////////////////////////////////////////////////////////////
+	/// \brief Longest loop kept in memory for a stream that can't seek
+	///
+	/// In samples of all channels: 3 minutes of 48 kHz stereo, 33 MiB.
+	///
+	/// \see `openFromForwardStream`
+	///
+	////////////////////////////////////////////////////////////
+	static constexpr std::uint64_t MaxForwardLoopSamples = 48000ull * 2 * 60 * 3;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Open a music from a stream that can't seek, such as a pipe or a socket
+	///
+	/// The stream is read once, from the start and in order: the
+	/// bytes read to find the loop tags and open the decoder are
+	/// kept in memory and read again, then the decoder only reads
+	/// forward. The loop region is kept as it is first played, and
+	/// the loop wraps replay it from memory. It is kept up to
+	/// `MaxForwardLoopSamples`; a music whose loop is longer, or
+	/// was not played from its start, stops at the loop end.
+	///
+	/// Loop points set afterwards must start after the position,
+	/// or keep the loop start and shorten the loop; others can't be
+	/// replayed and are rejected with a message to `err()`, right
+	/// away or on a later call once the audio thread found out.
+	///
+	/// Seeking forward decodes up to the target. Seeking back,
+	/// `stop()` included, only works inside the loop region once it
+	/// has been played. Ogg pages are neither indexed nor fully
+	/// checked (see `setPageIndexing` and `setPageCheck`), which
+	/// would need the whole stream. For an Ogg stream, the decoder
+	/// doesn't know the duration.
+	///
+	/// \warning The `stream` must remain accessible until the
+	/// `sf::Music` object loads a new music or is destroyed.
+	///
+	/// \param stream Source stream to read from, its `seek` is never called
+	///
+	/// \return `true` if loading succeeded, `false` if it failed
+	///
+	/// \see `openFromStream`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool openFromForwardStream(InputStream& stream);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Open a music stored in a pack
+	///
+	/// The loop points, stream info and seek points come from the
+	/// tables of the pack, so the tags of the music are not read.
+	/// Nothing is opened nor read again: the music reads its entry
+	/// through the handle the pack opened once, shared with all the
+	/// other musics of the pack and their restart decoders.
+	///
+	/// The pack may be destroyed afterwards, the music keeps the
+	/// handle open.
+	///
+	/// \param pack Opened pack
+	/// \param name Name of the entry in the pack
+	///
+	/// \return `true` if loading succeeded, `false` if it failed
+	///
+	/// \see `bgm::Pack`, `openFromFile`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool openFromPack(const Pack& pack, std::string_view name);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Queue an audio file to be played after the current one
+	///
+	/// The queued music takes over when the current one ends, which is
+	/// its loop end if looping is enabled, or its end of file otherwise.
+	/// The switch happens on the exact sample, in the audio thread, and
+	/// reuses the output stream, so there is no gap between the two.
+	/// This requires the queued music to have the same sample rate and
+	/// channel map as the current one; otherwise the call fails and the
+	/// music has to be opened with `openFromFile` instead.
+	///
+	/// Queueing again replaces the previously queued music.
+	///
+	/// \param filename Path of the music file to queue
+	///
+	/// \return `true` if the music was queued, `false` if it failed
+	///
+	/// \see `queueFromMemory`, `queueFromStream`, `clearQueue`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool queueFromFile(const std::filesystem::path& filename);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Queue an audio file in memory to be played after the current one
+	///
+	/// \warning The `data` buffer must remain accessible until the queued
+	/// music has been played, cleared, or replaced.
+	///
+	/// \param data        Pointer to the file data in memory
+	/// \param sizeInBytes Size of the data to load, in bytes
+	///
+	/// \return `true` if the music was queued, `false` if it failed
+	///
+	/// \see `queueFromFile`, `queueFromStream`, `clearQueue`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool queueFromMemory(const void* data, std::size_t sizeInBytes);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Queue an audio file in memory to be played after the current one, sharing its ownership
+	///
+	/// \param data        File data in memory, never written to
+	/// \param sizeInBytes Size of the data to load, in bytes
+	///
+	/// \return `true` if the music was queued, `false` if it failed
+	///
+	/// \see `openFromMemory`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool queueFromMemory(std::shared_ptr<const std::byte[]> data, std::size_t sizeInBytes);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Queue an audio file in a custom stream to be played after the current one
+	///
+	/// \warning The `stream` must remain accessible until the queued
+	/// music has been played, cleared, or replaced.
+	///
+	/// \param stream Source stream to read from
+	///
+	/// \return `true` if the music was queued, `false` if it failed
+	///
+	/// \see `queueFromFile`, `queueFromMemory`, `clearQueue`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool queueFromStream(InputStream& stream);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Drop the queued music, if any
+	///
+	////////////////////////////////////////////////////////////
+	void clearQueue();
+
+	////////////////////////////////////////////////////////////
+	/// \brief Tell whether a music is waiting to be played after the current one
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool hasQueued() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get the statistics of the switches to queued musics
+	///
+	/// `lastGap` and `maxGap` count the samples of a finished music that
+	/// were not delivered before the switch; they stay 0 unless the
+	/// decoder stopped short of the expected end.
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] TransitionStats getTransitionStats() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get the statistics of the loop wraps
+	///
+	/// When the data can be opened a second time (file, memory or
+	/// pack), a looping music keeps a second decoder waiting at the
+	/// loop start, and a wrap just swaps the decoders. A worker thread
+	/// shared by all the musics opens that decoder and parks it at the
+	/// loop start, then parks the one left at the loop end again after
+	/// each wrap; the audio thread only wakes it. Its cost is counted
+	/// in the park times. No second decoder is opened while the loop
+	/// is played from memory (see `Governor`, `cachePcm`). Streams
+	/// given by the user can't be reopened, so their wraps still seek,
+	/// as do the wraps that come before the decoder is parked.
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] LoopStats getLoopStats() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get the statistics of the seeks
+	///
+	/// Seeks into cached, virtual or kept samples only move the
+	/// clock and are counted as moved. Of the seeks that reach the
+	/// decoder, a seek is indexed when the target is at most one
+	/// second ahead of the decoder, or a few Ogg pages ahead when
+	/// pages are indexed (see `setPageIndexing`), in which case the
+	/// decoder just decodes up to it. Other seeks are left to the
+	/// decoder, which uses the FLAC SEEKTABLE itself. A seek that
+	/// `setPlayingOffset` requested is done on the next chunk.
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] SeekStats getSeekStats() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get the statistics of the chunks fed to the sound stream
+	///
+	/// The longest chunk shows how long the streaming thread
+	/// was held up by the decoder and by the reads of the file.
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] ReadStats getReadStats() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set the positions to be notified of through `pollEvent`
+	///
+	/// Markers are checked against each chunk as it is filled, so
+	/// their events come out on the exact sample, ahead of when they
+	/// are heard by the length of the queued chunks. Wait for
+	/// `getPlayingOffset` to reach `sampleOffset` to act on the
+	/// audible position.
+	///
+	/// \param markers Positions of the music, in any order
+	///
+	////////////////////////////////////////////////////////////
+	void setMarkers(std::vector<Marker> markers);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Take the next event of the streaming thread
+	///
+	/// Never locks: events are passed through a queue between the
+	/// streaming thread and one consumer thread at a time. When it
+	/// is full, the newest events are dropped.
+	///
+	/// \return The oldest event not taken yet, if any
+	///
+	/// \see `setMarkers`, `getDroppedEvents`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] std::optional<Event> pollEvent();
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get the number of events dropped because the queue was full
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] std::uint64_t getDroppedEvents() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set how the pages of Ogg files are indexed, for all musics opened afterwards
+	///
+	/// The index maps granule positions to page offsets, which
+	/// lets a seek to a position a few pages ahead be decoded
+	/// forward instead of searched. A saved index is reused as
+	/// long as the size of the music file does not change.
+	///
+	/// \param indexing Indexing mode
+	///
+	////////////////////////////////////////////////////////////
+	static void setPageIndexing(PageIndexing indexing);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set which pages of Ogg files have their CRC checked, for all musics opened afterwards
+	///
+	/// A music with a page failing the check is not opened, so
+	/// that a corrupted download is reported by `openFromFile`
+	/// rather than by the decoder in the middle of playback.
+	/// `PageCheck::Full` reads the whole file when opening.
+	///
+	/// \param check Pages checked, `PageCheck::Off` by default
+	///
+	////////////////////////////////////////////////////////////
+	static void setPageCheck(PageCheck check);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set how far files are read ahead in the background, for all musics opened afterwards
+	///
+	/// With read-ahead, the blocks following the position of the
+	/// decoder are read by a few worker threads, shared by all the
+	/// musics, before the decoder needs them, so that a slow disk
+	/// does not hold up the streaming thread.
+	/// Only music opened from a file is affected.
+	///
+	/// \param blocks Blocks of 64 KiB kept in flight, 0 to read the file directly
+	///
+	////////////////////////////////////////////////////////////
+	static void setReadAhead(std::size_t blocks);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set the directory where decoded musics are kept across runs, for all musics opened afterwards
+	///
+	/// A music opened from a file whose decoded samples are in the
+	/// directory plays them from a mapping of the cache file, up
+	/// to its loop end, without decoding. Cache files are written
+	/// by `cachePcm`, and whenever the memory governor decodes a
+	/// music anyway.
+	///
+	/// \param directory Directory of the cache, empty to disable it
+	/// \param capacity  Bytes kept in the directory, the files used least recently are deleted beyond it
+	///
+	/// \see `cachePcm`
+	///
+	////////////////////////////////////////////////////////////
+	static void setPcmCache(const std::filesystem::path& directory, std::uint64_t capacity);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set whether musics decoded by the memory governor are kept compressed, from the next promotion on
+	///
+	/// The samples are compressed losslessly in blocks that decode
+	/// independently, so loops and seeks still reach any sample by
+	/// decoding one block. The governor counts the compressed size
+	/// against its budget, which then holds more musics.
+	///
+	/// \param enabled `true` to compress, `false` to keep raw samples
+	///
+	/// \see `bgm::Governor`, `bgm::CompressedPcm`
+	///
+	////////////////////////////////////////////////////////////
+	static void setPcmCompression(bool enabled);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set how many threads decode a music when it is cached whole
+	///
+	/// Used by the memory governor and `cachePcm`. FLAC musics are
+	/// split at their seek points, Ogg musics at their pages, across
+	/// the threads; the other formats are decoded serially.
+	///
+	/// \param threads Number of threads, 0 for one per core (default), 1 to decode serially
+	///
+	/// \see `bgm::decodeParallel`
+	///
+	////////////////////////////////////////////////////////////
+	static void setDecodeThreads(unsigned int threads);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set the loudness musics are normalized to
+	///
+	/// Musics opened or queued from a file afterwards play at a gain
+	/// bringing their integrated loudness to the target, lowered so
+	/// that their true peak stays under -1 dBTP. The loudness is read
+	/// from the sidecar written by `BgmTool loudness --save`; musics
+	/// without one, or changed since it was written (size or
+	/// modification time), or opened from memory, play unchanged. The gain
+	/// is applied through the volume of the stream, so `getVolume`
+	/// still returns the volume set by the user.
+	///
+	/// \param lufs Target loudness in LUFS, 0 (the default) disables normalization
+	///
+	/// \see `bgm::analyzeLoudness`, `bgm::getLoudnessSidecar`
+	///
+	////////////////////////////////////////////////////////////
+	static void setLoudnessTarget(float lufs);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Tell whether the calling thread is feeding a music to the sound stream
+	///
+	/// True inside `onGetData` and `onLoop`. These never lock nor
+	/// write to `err()`, and once a music plays they don't allocate,
+	/// loop wraps and queued tracks included; an allocator can check
+	/// it to enforce that, as `BgmTool rtcheck` does. The changes made
+	/// from other threads while the music plays are passed to them
+	/// through a queue, and applied from the next chunk on.
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] static bool isInAudioCallback();
+
+	////////////////////////////////////////////////////////////
+	/// \brief Decode the music up to its loop end into the pcm cache, and play it from there
+	///
+	/// Decoding is done with a decoder of its own, playback goes
+	/// on meanwhile. Call it where the CPU time is cheap, the next
+	/// runs open the music already decoded.
+	///
+	/// \return `true` if the music is in the cache, `false` if it failed
+	///
+	/// \see `setPcmCache`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool cachePcm();
+
+	////////////////////////////////////////////////////////////
+	/// \brief Keep the compressed bytes of the loop in memory
+	///
+	/// Using the seek points (FLAC SEEKTABLE, or the Ogg page index,
+	/// see `setPageIndexing`), the bytes covering the loop, plus the
+	/// pre-roll of the decoder and some margin for its searches,
+	/// are read once and served from memory from then on, so that
+	/// playing the loop and wrapping around it doesn't read the file.
+	/// The rest of the music is still read from its source.
+	///
+	/// The region is dropped when another music is opened.
+	///
+	/// \return `true` if the region is pinned, `false` if it failed
+	///
+	/// \see `unpinLoopRegion`, `getResidency`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool pinLoopRegion();
+
+	////////////////////////////////////////////////////////////
+	/// \brief Release the bytes kept by `pinLoopRegion`
+	///
+	////////////////////////////////////////////////////////////
+	void unpinLoopRegion();
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get how much of the music is held in memory and how often its source is read
+	///
+	/// As of the last chunk: a cache or region set while the music
+	/// plays is counted once the next chunk is filled.
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] Residency getResidency() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Start or resume playing the music
+	///
+	/// Overrides `SoundStream::play` to publish the status for `snapshot`.
+	///
+	////////////////////////////////////////////////////////////
+	void play() override;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Pause the music
+	///
+	/// Overrides `SoundStream::pause` to publish the status for `snapshot`.
+	///
+	////////////////////////////////////////////////////////////
+	void pause() override;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Stop playing the music
+	///
+	/// Overrides `SoundStream::stop` to publish the status for `snapshot`.
+	///
+	////////////////////////////////////////////////////////////
+	void stop() override;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get the state of the playback without locking
+	///
+	/// Each chunk is published by the streaming thread when it is
+	/// handed to the sound stream, which is when its first sample
+	/// starts being heard; the position is then advanced by the
+	/// time spent in the chunk. It costs a few atomic loads, and
+	/// never waits for the streaming thread or the audio device,
+	/// unlike `getPlayingOffset`. It may lag the device by its
+	/// output latency.
+	///
+	/// The rest of the state comes along, so that a whole state is
+	/// read without taking the lock that `getDuration` and
+	/// `getLoopPoints` take: the track fields as of the same chunk,
+	/// looping and volume as last set.
+	///
+	/// \return Status, position, loop count, samples played, and the rest of the state
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] Snapshot snapshot() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set whether or not the music should loop after reaching the end
+	///
+	/// The looping of the underlying stream is also driven
+	/// internally to switch to a queued music.
+	///
+	/// \param loop `true` to play in loop, `false` to play once
+	///
+	////////////////////////////////////////////////////////////
+	void setLooping(bool loop);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Tell whether or not the music is in loop mode
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool isLooping() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set the volume of the music
+	///
+	/// The volume is also part of the gain checked against
+	/// the virtual threshold, along with the loudness
+	/// normalization.
+	///
+	/// \param volume Volume of the music, in the range [0, 100]
+	///
+	/// \see `setVirtualThreshold`
+	///
+	////////////////////////////////////////////////////////////
+	void setVolume(float volume);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get the volume of the music
+	///
+	/// The loudness normalization is not included.
+	///
+	/// \return Volume of the music, in the range [0, 100]
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] float getVolume() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Report how much of the music reaches the listener
+	///
+	/// The music can't know about distance attenuation, mixer
+	/// busses or occlusion applied by the game, so the game
+	/// reports them here as a single factor. It is multiplied
+	/// with the volume to get the gain checked against the
+	/// virtual threshold.
+	///
+	/// \param gain Attenuation factor, 1 by default
+	///
+	/// \see `setVirtualThreshold`
+	///
+	////////////////////////////////////////////////////////////
+	void setAudibility(float gain);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set the gain under which the music becomes virtual
+	///
+	/// A virtual music stops decoding and outputs silence, but
+	/// keeps a sample clock running which follows the loop points,
+	/// so that it resumes at the right place once its gain gets
+	/// back above the threshold.
+	///
+	/// \param gain Threshold, 0 (the default) disables virtualization
+	///
+	/// \see `setAudibility`, `isVirtual`
+	///
+	////////////////////////////////////////////////////////////
+	void setVirtualThreshold(float gain);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Tell whether the music is currently virtual
+	///
+	/// As of the last chunk filled.
+	///
+	/// \see `setVirtualThreshold`
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool isVirtual() const;
+
 	////////////////////////////////////////////////////////////
 	/// \brief Get the total duration of the music
 	///
@@ -237,8 +945,10 @@ protected: // OHMSBGM: Set protected.
 	/// safely called at any point after a stream is opened, and will be applied to a playing sound
 	/// without affecting the current playing offset.
 	///
-	/// \warning Setting the loop points while the stream's status is Paused
-	/// will set its status to Stopped. The playing offset will be unaffected.
+	/// OHMSBGM: The stream is not restarted, the new loop applies from the next chunk on;
+	/// the chunks already queued play as they were. The points are checked against the
+	/// track heard as of the last chunk; if a queued track replaced it meanwhile, the change
+	/// is dropped.
 	///
 	/// \param timePoints The definition of the loop. Can be any time points within the sound's length
 	///
@@ -284,6 +994,26 @@ protected:
 	std::optional<std::uint64_t> onLoop() override;
 
 private:
+	////////////////////////////////////////////////////////////
+	/// \brief Open a stream as the track following the current one
+	///
+	/// \param stream   Source stream of the queued track
+	/// \param reopen   Opens another stream on the same data, or empty if it can't
+	/// \param filename Path of the queued file, empty if it is not a file
+	///
+	/// \return `true` if the track was queued, `false` if it failed
+	///
+	////////////////////////////////////////////////////////////
+	[[nodiscard]] bool queueTrack(std::shared_ptr<InputStream> stream, std::function<std::shared_ptr<InputStream>()> reopen, const std::filesystem::path& filename, std::size_t sharedBytes = 0);
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set the loudness normalization of the playing track
+	///
+	/// \param gain Factor applied on top of the volume
+	///
+	////////////////////////////////////////////////////////////
+	void applyGain(float gain);
+
 	////////////////////////////////////////////////////////////
 	/// \brief Helper to convert an `sf::Time` to a sample position
 	///
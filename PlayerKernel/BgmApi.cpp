@@ -0,0 +1,177 @@
+﻿#include "BgmApi.h"
+
+#include "Bgm.h"
+#include <exception>
+#include <new>
+#include <ostream>
+#include <string>
+
+struct BgmMusic {
+	bgm::Music music;
+};
+
+namespace {
+// Runs `f`, returning 0 instead of letting an exception out to the caller
+template <typename F>
+int guard(F&& f) noexcept {
+	try {
+		return f() ? 1 : 0;
+	}
+	catch (const std::exception& e) {
+		bgm::err() << "Bgm api call failed: " << e.what() << std::endl;
+	}
+	catch (...) {
+		bgm::err() << "Bgm api call failed." << std::endl;
+	}
+	return 0;
+}
+
+bool apply(BgmMusic& m, BgmCommand command, double value) {
+	switch (command) {
+	case BGM_PLAY:
+		m.music.play();
+		return true;
+	case BGM_PAUSE:
+		m.music.pause();
+		return true;
+	case BGM_STOP:
+		m.music.stop();
+		return true;
+	case BGM_SET_VOLUME:
+		m.music.setVolume(static_cast<float>(value));
+		return true;
+	case BGM_SET_OFFSET:
+		m.music.setPlayingOffset(sf::seconds(static_cast<float>(value)));
+		return true;
+	case BGM_SET_LOOPING:
+		m.music.setLooping(value != 0.);
+		return true;
+	}
+	return false;
+}
+}
+
+extern "C" {
+
+BgmMusic* bgmCreate(void) {
+	BgmMusic* res = nullptr;
+	guard([&res] {
+		res = new BgmMusic();
+		return true;
+	});
+	return res;
+}
+
+void bgmDestroy(BgmMusic* music) {
+	guard([music] {
+		delete music;
+		return true;
+	});
+}
+
+int bgmOpenFromFile(BgmMusic* music, const char* path) {
+	if (music == nullptr || path == nullptr) {
+		return 0;
+	}
+	return guard([music, path] {
+		const std::u8string utf8(reinterpret_cast<const char8_t*>(path));
+		return music->music.openFromFile(std::filesystem::path(utf8));
+	});
+}
+
+int bgmOpenFromMemory(BgmMusic* music, const void* data, size_t size) {
+	if (music == nullptr || data == nullptr) {
+		return 0;
+	}
+	return guard([music, data, size] {
+		return music->music.openFromMemory(data, size);
+	});
+}
+
+int bgmPlay(BgmMusic* music) {
+	return bgmControlMany(&music, 1, BGM_PLAY, 0.) != 0 ? 1 : 0;
+}
+
+int bgmPause(BgmMusic* music) {
+	return bgmControlMany(&music, 1, BGM_PAUSE, 0.) != 0 ? 1 : 0;
+}
+
+int bgmStop(BgmMusic* music) {
+	return bgmControlMany(&music, 1, BGM_STOP, 0.) != 0 ? 1 : 0;
+}
+
+int bgmSetPlayingOffset(BgmMusic* music, double seconds) {
+	return bgmControlMany(&music, 1, BGM_SET_OFFSET, seconds) != 0 ? 1 : 0;
+}
+
+int bgmSetLooping(BgmMusic* music, int loop) {
+	return bgmControlMany(&music, 1, BGM_SET_LOOPING, loop) != 0 ? 1 : 0;
+}
+
+int bgmSetVolume(BgmMusic* music, float volume) {
+	return bgmControlMany(&music, 1, BGM_SET_VOLUME, volume) != 0 ? 1 : 0;
+}
+
+int bgmQuery(const BgmMusic* music, BgmState* state) {
+	if (music == nullptr || state == nullptr) {
+		return 0;
+	}
+	return guard([music, state] {
+		const bgm::Music::Snapshot snapshot = music->music.snapshot();
+
+		BgmState res{};
+		switch (snapshot.status) {
+		case bgm::Music::Status::Stopped:
+			res.status = BGM_STOPPED;
+			break;
+		case bgm::Music::Status::Paused:
+			res.status = BGM_PAUSED;
+			break;
+		case bgm::Music::Status::Playing:
+			res.status = BGM_PLAYING;
+			break;
+		}
+		res.looping = snapshot.looping ? 1 : 0;
+		res.channelCount = snapshot.channelCount;
+		res.sampleRate = snapshot.sampleRate;
+		res.duration = snapshot.duration.asSeconds();
+		res.position = snapshot.position.asSeconds();
+		res.loopBegin = snapshot.loopPoints.offset.asSeconds();
+		res.loopEnd = (snapshot.loopPoints.offset + snapshot.loopPoints.length).asSeconds();
+		res.loopCount = snapshot.loopCount;
+		res.samplesPlayed = snapshot.samplesPlayed;
+		res.volume = snapshot.volume;
+		res.isVirtual = snapshot.isVirtual ? 1 : 0;
+		*state = res;
+		return true;
+	});
+}
+
+size_t bgmQueryMany(const BgmMusic* const* musics, size_t count, BgmState* states) {
+	if (musics == nullptr || states == nullptr) {
+		return 0;
+	}
+	size_t filled = 0;
+	for (size_t i = 0; i < count; ++i) {
+		states[i] = BgmState{};
+		filled += static_cast<size_t>(bgmQuery(musics[i], states + i));
+	}
+	return filled;
+}
+
+size_t bgmControlMany(BgmMusic* const* musics, size_t count, BgmCommand command, double value) {
+	if (musics == nullptr) {
+		return 0;
+	}
+	size_t done = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (musics[i] != nullptr) {
+			done += static_cast<size_t>(guard([&] {
+				return apply(*musics[i], command, value);
+			}));
+		}
+	}
+	return done;
+}
+
+}
@@ -0,0 +1,92 @@
+﻿#pragma once
+
+/*
+ * Flat C interface over bgm::Music, for callers that can't use C++:
+ * the managed layers and tools written in other languages.
+ * Every function takes a handle from `bgmCreate`; the state of a
+ * music is queried as a whole into one plain struct.
+ * No exception crosses the interface: a function that fails, by
+ * its arguments or by an exception inside, returns 0.
+ * Built into its own native library, see BgmApi.vcxproj.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(OHMSBGM_API_EXPORTS)
+#define OHMSBGM_API __declspec(dllexport)
+#else
+#define OHMSBGM_API __declspec(dllimport)
+#endif
+#else
+#define OHMSBGM_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct BgmMusic BgmMusic;
+
+typedef enum BgmStatus {
+	BGM_STOPPED = 0,
+	BGM_PAUSED  = 1,
+	BGM_PLAYING = 2
+} BgmStatus;
+
+typedef enum BgmCommand {
+	BGM_PLAY        = 0,
+	BGM_PAUSE       = 1,
+	BGM_STOP        = 2,
+	BGM_SET_VOLUME  = 3, /* value: volume in [0, 100] */
+	BGM_SET_OFFSET  = 4, /* value: position in seconds */
+	BGM_SET_LOOPING = 5  /* value: nonzero to loop */
+} BgmCommand;
+
+/* Everything `bgmQuery` reads, in one call, from the lock-free
+ * snapshot, see `bgm::Music::snapshot`. Times are in seconds. */
+typedef struct BgmState {
+	uint32_t status;        /* BgmStatus */
+	uint32_t looping;       /* Nonzero if looping */
+	uint32_t channelCount;
+	uint32_t sampleRate;
+	double   duration;
+	double   position;
+	double   loopBegin;     /* Loop points once applied by the streaming thread */
+	double   loopEnd;
+	uint64_t loopCount;
+	uint64_t samplesPlayed;
+	float    volume;        /* In [0, 100] */
+	uint32_t isVirtual;     /* Nonzero if decoding is suspended */
+} BgmState;
+
+/* Returns NULL if it failed. */
+OHMSBGM_API BgmMusic* bgmCreate(void);
+OHMSBGM_API void bgmDestroy(BgmMusic* music);
+
+/* Return nonzero on success. `path` is UTF-8. */
+OHMSBGM_API int bgmOpenFromFile(BgmMusic* music, const char* path);
+/* The data must stay valid while the music is open. */
+OHMSBGM_API int bgmOpenFromMemory(BgmMusic* music, const void* data, size_t size);
+
+/* Return nonzero on success. */
+OHMSBGM_API int bgmPlay(BgmMusic* music);
+OHMSBGM_API int bgmPause(BgmMusic* music);
+OHMSBGM_API int bgmStop(BgmMusic* music);
+OHMSBGM_API int bgmSetPlayingOffset(BgmMusic* music, double seconds);
+OHMSBGM_API int bgmSetLooping(BgmMusic* music, int loop);
+OHMSBGM_API int bgmSetVolume(BgmMusic* music, float volume);
+
+/* Return nonzero on success. */
+OHMSBGM_API int bgmQuery(const BgmMusic* music, BgmState* state);
+
+/* Queries `count` musics into `states`; returns how many were filled, NULL handles and failures are left zeroed. */
+OHMSBGM_API size_t bgmQueryMany(const BgmMusic* const* musics, size_t count, BgmState* states);
+
+/* Applies one command to `count` musics; returns how many succeeded, NULL handles and unknown commands fail. */
+OHMSBGM_API size_t bgmControlMany(BgmMusic* const* musics, size_t count, BgmCommand command, double value);
+
+#ifdef __cplusplus
+}
+#endif
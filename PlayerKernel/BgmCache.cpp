@@ -0,0 +1,239 @@
+﻿#include "BgmCache.h"
+#include "BgmHeader.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace bgm {
+
+namespace {
+constexpr char CacheMagic[8] = { 'O', 'H', 'M', 'S', 'P', 'C', 'M', '1' };
+
+struct CacheHeader {
+	char          magic[8];
+	std::uint64_t sourceSize;
+	std::int64_t  sourceTime;
+	std::uint64_t loopOffset;
+	std::uint64_t loopLength;
+	std::uint32_t channelCount;
+	std::uint32_t sampleRate;
+	std::uint64_t count; // Samples stored after the header.
+	std::uint64_t reserved;
+};
+static_assert(sizeof(CacheHeader) == 64);
+
+bool matches(const CacheHeader& header, const PcmCache::Key& key) {
+	return std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) == 0 && header.sourceSize == key.sourceSize &&
+		header.sourceTime == key.sourceTime && header.loopOffset == key.loopOffset && header.loopLength == key.loopLength &&
+		header.channelCount == key.channelCount && header.sampleRate == key.sampleRate;
+}
+}
+
+MappedPcm::~MappedPcm() {
+	if (m_view == nullptr) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(m_view);
+#else
+	munmap(m_view, m_size);
+#endif
+}
+
+std::shared_ptr<const MappedPcm> MappedPcm::map(const std::filesystem::path& filename) {
+	std::shared_ptr<MappedPcm> res(new MappedPcm());
+#ifdef _WIN32
+	// Deleting the file stays possible while it is mapped, for the eviction of other users.
+	HANDLE file = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return nullptr;
+	}
+	HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		return nullptr;
+	}
+	res->m_view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	res->m_size = static_cast<std::size_t>(size.QuadPart);
+#else
+	const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat st{};
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return nullptr;
+	}
+	void* view = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	res->m_view = view != MAP_FAILED ? view : nullptr;
+	res->m_size = static_cast<std::size_t>(st.st_size);
+#endif
+	return res->m_view != nullptr ? res : nullptr;
+}
+
+const std::byte* MappedPcm::getData() const {
+	return static_cast<const std::byte*>(m_view);
+}
+
+std::size_t MappedPcm::getSize() const {
+	return m_size;
+}
+
+PcmCache::PcmCache(std::filesystem::path directory, std::uint64_t capacity) :
+	m_directory(std::move(directory)),
+	m_capacity(capacity) {}
+
+bool PcmCache::makeKey(const std::filesystem::path& source, Key& key) {
+	std::error_code ec;
+	const std::uintmax_t size = std::filesystem::file_size(source, ec);
+	if (ec) {
+		return false;
+	}
+	const std::filesystem::file_time_type time = std::filesystem::last_write_time(source, ec);
+	if (ec) {
+		return false;
+	}
+	key.sourceSize = size;
+	key.sourceTime = static_cast<std::int64_t>(time.time_since_epoch().count());
+	return true;
+}
+
+PcmCache::Entry PcmCache::find(const std::filesystem::path& source, const Key& key) const {
+	const std::filesystem::path filename = getFilename(source);
+	std::shared_ptr<const MappedPcm> mapping = MappedPcm::map(filename);
+	if (mapping == nullptr || mapping->getSize() < sizeof(CacheHeader)) {
+		return {};
+	}
+	CacheHeader header{};
+	std::memcpy(&header, mapping->getData(), sizeof(header));
+	if (!matches(header, key) || header.count > (mapping->getSize() - sizeof(CacheHeader)) / sizeof(std::int16_t)) {
+		return {};
+	}
+
+	// The modification time of the cache file tells the eviction when it was last used.
+	std::error_code ec;
+	std::filesystem::last_write_time(filename, std::filesystem::file_time_type::clock::now(), ec);
+
+	Entry res;
+	res.samples = reinterpret_cast<const std::int16_t*>(mapping->getData() + sizeof(CacheHeader));
+	res.count = header.count;
+	res.mapping = std::move(mapping);
+	return res;
+}
+
+bool PcmCache::store(const std::filesystem::path& source, const Key& key, const std::int16_t* samples, std::uint64_t count) const {
+	std::error_code ec;
+	std::filesystem::create_directories(m_directory, ec);
+
+	CacheHeader header{};
+	std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+	header.sourceSize = key.sourceSize;
+	header.sourceTime = key.sourceTime;
+	header.loopOffset = key.loopOffset;
+	header.loopLength = key.loopLength;
+	header.channelCount = key.channelCount;
+	header.sampleRate = key.sampleRate;
+	header.count = count;
+
+	// Written aside then renamed, a reader never sees half a file.
+	const std::filesystem::path filename = getFilename(source);
+	std::filesystem::path temporary = filename;
+	temporary += ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(samples), static_cast<std::streamsize>(count * sizeof(std::int16_t)));
+		if (!out.flush()) {
+			out.close();
+			std::filesystem::remove(temporary, ec);
+			err() << "Failed to write pcm cache: " << filename << std::endl;
+			return false;
+		}
+	}
+	std::filesystem::rename(temporary, filename, ec);
+	if (ec) {
+		std::filesystem::remove(temporary, ec);
+		err() << "Failed to write pcm cache: " << filename << std::endl;
+		return false;
+	}
+	evict();
+	return true;
+}
+
+void PcmCache::evict() const {
+	struct File {
+		std::filesystem::path           path;
+		std::uint64_t                   size;
+		std::filesystem::file_time_type time;
+	};
+	std::vector<File> files;
+	std::uint64_t total = 0;
+	std::error_code ec;
+	for (const auto& item : std::filesystem::directory_iterator(m_directory, ec)) {
+		if (item.path().extension() != ".ohmspcm") {
+			continue;
+		}
+		File file{ item.path(), item.file_size(ec), item.last_write_time(ec) };
+		if (!ec) {
+			total += file.size;
+			files.push_back(std::move(file));
+		}
+	}
+
+	std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+		return a.time < b.time;
+	});
+	for (const File& file : files) {
+		if (total <= m_capacity) {
+			break;
+		}
+		if (std::filesystem::remove(file.path, ec)) {
+			total -= file.size;
+		}
+	}
+}
+
+const std::filesystem::path& PcmCache::getDirectory() const {
+	return m_directory;
+}
+
+std::uint64_t PcmCache::getCapacity() const {
+	return m_capacity;
+}
+
+std::filesystem::path PcmCache::getFilename(const std::filesystem::path& source) const {
+	std::error_code ec;
+	const std::filesystem::path absolute = std::filesystem::absolute(source, ec);
+	const std::size_t hash = std::hash<std::u8string>()((ec ? source : absolute).generic_u8string());
+
+	char name[32]{};
+	std::snprintf(name, sizeof(name), "%016llx.ohmspcm", static_cast<unsigned long long>(hash));
+	return m_directory / name;
+}
+
+}
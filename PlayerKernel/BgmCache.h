@@ -0,0 +1,89 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+
+namespace bgm {
+
+////////////////////////////////////////////////////////////
+/// \brief Decoded samples of a music read from a cache file
+///
+/// The file is mapped into memory, pages are only read when
+/// the samples are played.
+///
+////////////////////////////////////////////////////////////
+class MappedPcm final {
+public:
+	~MappedPcm();
+
+	MappedPcm(const MappedPcm&) = delete;
+	MappedPcm& operator=(const MappedPcm&) = delete;
+
+	[[nodiscard]] static std::shared_ptr<const MappedPcm> map(const std::filesystem::path& filename);
+
+	[[nodiscard]] const std::byte* getData() const;
+	[[nodiscard]] std::size_t getSize() const;
+
+private:
+	MappedPcm() = default;
+
+	void*       m_view = nullptr;
+	std::size_t m_size = 0;
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Directory of decoded musics, kept across runs
+///
+/// Each music is stored decoded up to its loop end, which is
+/// all a looping music ever plays. A cache file is only used
+/// while the size and modification time of its music, and the
+/// loop and format it was decoded with, are unchanged.
+///
+/// Beyond the capacity, the files used least recently are
+/// deleted first.
+///
+////////////////////////////////////////////////////////////
+class PcmCache final {
+public:
+	struct Key {
+		std::uint64_t sourceSize = 0;
+		std::int64_t  sourceTime = 0; // Modification time of the music, in ticks of the file clock.
+		std::uint64_t loopOffset = 0;
+		std::uint64_t loopLength = 0;
+		std::uint32_t channelCount = 0;
+		std::uint32_t sampleRate = 0;
+	};
+
+	// Samples of a cached music, valid as long as the mapping is kept.
+	struct Entry {
+		std::shared_ptr<const MappedPcm> mapping;
+		const std::int16_t*              samples = nullptr;
+		std::uint64_t                    count = 0;
+	};
+
+	PcmCache(std::filesystem::path directory, std::uint64_t capacity);
+
+	// Fill the size and time of the music, false if it can't be found.
+	[[nodiscard]] static bool makeKey(const std::filesystem::path& source, Key& key);
+
+	// Empty entry if there is no valid cache file for the music.
+	[[nodiscard]] Entry find(const std::filesystem::path& source, const Key& key) const;
+
+	// Write the samples, then evict the files beyond the capacity.
+	[[nodiscard]] bool store(const std::filesystem::path& source, const Key& key, const std::int16_t* samples, std::uint64_t count) const;
+
+	void evict() const;
+
+	[[nodiscard]] const std::filesystem::path& getDirectory() const;
+	[[nodiscard]] std::uint64_t getCapacity() const;
+
+private:
+	[[nodiscard]] std::filesystem::path getFilename(const std::filesystem::path& source) const;
+
+	std::filesystem::path m_directory;
+	std::uint64_t         m_capacity;
+};
+
+}
@@ -0,0 +1,213 @@
+﻿#include "BgmCodec.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+
+namespace bgm {
+
+namespace {
+constexpr std::size_t GroupSize = 32;
+constexpr unsigned int MaxOrder = 2;
+
+// Unpacking loads 8 bytes at the byte holding a residual, which may reach past the last group
+constexpr std::size_t UnpackPadding = 8;
+static_assert(std::endian::native == std::endian::little, "Unpacking loads the packed bytes as a little-endian word");
+
+std::uint32_t zigzag(std::int32_t value) {
+	return (static_cast<std::uint32_t>(value) << 1) ^ static_cast<std::uint32_t>(value >> 31);
+}
+
+std::int32_t unzigzag(std::uint32_t value) {
+	return static_cast<std::int32_t>(value >> 1) ^ -static_cast<std::int32_t>(value & 1);
+}
+
+// Residual of the fixed polynomial predictor of the order.
+std::int32_t residual(const std::int32_t* s, std::size_t i, unsigned int order) {
+	switch (order) {
+	case 0:
+		return s[i];
+	case 1:
+		return s[i] - s[i - 1];
+	default:
+		return s[i] - 2 * s[i - 1] + s[i - 2];
+	}
+}
+
+unsigned int width(std::uint32_t max) {
+	return max == 0 ? 0 : static_cast<unsigned int>(std::bit_width(max));
+}
+
+// Bytes taken by the residuals of a channel with the order.
+std::size_t packedSize(const std::int32_t* s, std::size_t frames, unsigned int order) {
+	std::size_t bytes = 0;
+	for (std::size_t g = order; g < frames; g += GroupSize) {
+		const std::size_t end = std::min(g + GroupSize, frames);
+		std::uint32_t max = 0;
+		for (std::size_t i = g; i < end; ++i) {
+			max |= zigzag(residual(s, i, order));
+		}
+		bytes += 1 + (width(max) * (end - g) + 7) / 8;
+	}
+	return bytes;
+}
+
+void encodeChannel(const std::int32_t* s, std::size_t frames, std::vector<std::uint8_t>& out) {
+	const unsigned int maxOrder = static_cast<unsigned int>(std::min<std::size_t>(MaxOrder, frames));
+	unsigned int order = 0;
+	std::size_t best = packedSize(s, frames, 0);
+	for (unsigned int o = 1; o <= maxOrder; ++o) {
+		if (const std::size_t size = packedSize(s, frames, o) + 2 * o; size < best) {
+			best = size;
+			order = o;
+		}
+	}
+
+	out.push_back(static_cast<std::uint8_t>(order));
+	for (unsigned int i = 0; i < order; ++i) {
+		const std::uint16_t warmup = static_cast<std::uint16_t>(s[i]);
+		out.push_back(static_cast<std::uint8_t>(warmup));
+		out.push_back(static_cast<std::uint8_t>(warmup >> 8));
+	}
+
+	std::array<std::uint32_t, GroupSize> values{};
+	for (std::size_t g = order; g < frames; g += GroupSize) {
+		const std::size_t count = std::min(g + GroupSize, frames) - g;
+		std::uint32_t max = 0;
+		for (std::size_t i = 0; i < count; ++i) {
+			values[i] = zigzag(residual(s, g + i, order));
+			max |= values[i];
+		}
+		const unsigned int bits = width(max);
+		out.push_back(static_cast<std::uint8_t>(bits));
+
+		// Least significant bits first
+		std::uint64_t accumulator = 0;
+		unsigned int filled = 0;
+		for (std::size_t i = 0; i < count; ++i) {
+			accumulator |= static_cast<std::uint64_t>(values[i]) << filled;
+			filled += bits;
+			while (filled >= 8) {
+				out.push_back(static_cast<std::uint8_t>(accumulator));
+				accumulator >>= 8;
+				filled -= 8;
+			}
+		}
+		if (filled != 0) {
+			out.push_back(static_cast<std::uint8_t>(accumulator));
+		}
+	}
+}
+
+const std::uint8_t* decodeChannel(const std::uint8_t* in, std::size_t frames, unsigned int channelCount, std::int16_t* out) {
+	const unsigned int order = *in++;
+	std::int32_t previous[2]{}; // Last two samples, most recent first.
+	for (unsigned int i = 0; i < order; ++i) {
+		const std::int16_t warmup = static_cast<std::int16_t>(static_cast<std::uint16_t>(in[0] | (in[1] << 8)));
+		in += 2;
+		out[i * channelCount] = warmup;
+		previous[1] = previous[0];
+		previous[0] = warmup;
+	}
+
+	std::array<std::int32_t, GroupSize> residuals{};
+	for (std::size_t g = order; g < frames; g += GroupSize) {
+		const std::size_t count = std::min(g + GroupSize, frames) - g;
+		const unsigned int bits = *in++;
+		const std::uint32_t mask = bits == 0 ? 0 : static_cast<std::uint32_t>((std::uint64_t{ 1 } << bits) - 1);
+
+		// Every residual starts at a fixed bit of the group, so no state carries from one to the next
+		for (std::size_t i = 0; i < count; ++i) {
+			const std::size_t bit = i * bits;
+			std::uint64_t word = 0;
+			std::memcpy(&word, in + bit / 8, sizeof(word));
+			residuals[i] = unzigzag(static_cast<std::uint32_t>(word >> (bit % 8)) & mask);
+		}
+		in += (count * bits + 7) / 8;
+
+		// Prediction is a running sum, kept in registers
+		std::int16_t* o = out + g * channelCount;
+		switch (order) {
+		case 0:
+			for (std::size_t i = 0; i < count; ++i) {
+				o[i * channelCount] = static_cast<std::int16_t>(residuals[i]);
+			}
+			break;
+		case 1:
+			for (std::size_t i = 0; i < count; ++i) {
+				previous[0] += residuals[i];
+				o[i * channelCount] = static_cast<std::int16_t>(previous[0]);
+			}
+			break;
+		default:
+			for (std::size_t i = 0; i < count; ++i) {
+				const std::int32_t sample = 2 * previous[0] - previous[1] + residuals[i];
+				previous[1] = previous[0];
+				previous[0] = sample;
+				o[i * channelCount] = static_cast<std::int16_t>(sample);
+			}
+			break;
+		}
+	}
+	return in;
+}
+}
+
+std::shared_ptr<const CompressedPcm> CompressedPcm::encode(const std::int16_t* samples, std::uint64_t count, unsigned int channelCount) {
+	if (channelCount == 0) {
+		return nullptr;
+	}
+	std::shared_ptr<CompressedPcm> res(new CompressedPcm());
+	res->m_channelCount = channelCount;
+	res->m_sampleCount = count - count % channelCount;
+
+	const std::uint64_t frameCount = res->m_sampleCount / channelCount;
+	std::vector<std::int32_t> channel(BlockFrames);
+	res->m_data.reserve(static_cast<std::size_t>(res->m_sampleCount)); // About half of the raw size.
+	for (std::uint64_t first = 0; first < frameCount; first += BlockFrames) {
+		res->m_blockOffsets.push_back(res->m_data.size());
+		const std::size_t frames = static_cast<std::size_t>(std::min<std::uint64_t>(BlockFrames, frameCount - first));
+		for (unsigned int c = 0; c < channelCount; ++c) {
+			for (std::size_t i = 0; i < frames; ++i) {
+				channel[i] = samples[(first + i) * channelCount + c];
+			}
+			encodeChannel(channel.data(), frames, res->m_data);
+		}
+	}
+	res->m_blockOffsets.push_back(res->m_data.size());
+	res->m_data.resize(res->m_data.size() + UnpackPadding);
+	res->m_data.shrink_to_fit();
+	return res;
+}
+
+unsigned int CompressedPcm::getChannelCount() const {
+	return m_channelCount;
+}
+
+std::uint64_t CompressedPcm::getSampleCount() const {
+	return m_sampleCount;
+}
+
+std::size_t CompressedPcm::getBlockCount() const {
+	return m_blockOffsets.size() - 1;
+}
+
+std::size_t CompressedPcm::getBlockSize(std::size_t block) const {
+	const std::uint64_t first = static_cast<std::uint64_t>(block) * BlockFrames * m_channelCount;
+	return static_cast<std::size_t>(std::min<std::uint64_t>(BlockFrames * m_channelCount, m_sampleCount - first));
+}
+
+std::size_t CompressedPcm::getByteSize() const {
+	return m_data.size() + m_blockOffsets.size() * sizeof(std::uint64_t);
+}
+
+void CompressedPcm::decodeBlock(std::size_t block, std::int16_t* out) const {
+	const std::size_t frames = getBlockSize(block) / m_channelCount;
+	const std::uint8_t* in = m_data.data() + m_blockOffsets[block];
+	for (unsigned int c = 0; c < m_channelCount; ++c) {
+		in = decodeChannel(in, frames, m_channelCount, out + c);
+	}
+}
+
+}
@@ -0,0 +1,49 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace bgm {
+
+////////////////////////////////////////////////////////////
+/// \brief Lossless compressed copy of decoded samples
+///
+/// The samples are cut into blocks of `BlockFrames` frames which
+/// decode independently, so that any position can be reached by
+/// decoding a single block. In a block, every channel is predicted
+/// by a fixed polynomial of order 0 to 2, the best one for that
+/// block, and the residuals are bit-packed in groups of 32 with a
+/// width per group. Decoding is a few shifts and adds per sample.
+///
+////////////////////////////////////////////////////////////
+class CompressedPcm final {
+public:
+	static constexpr std::size_t BlockFrames = 4096;
+
+	[[nodiscard]] static std::shared_ptr<const CompressedPcm> encode(const std::int16_t* samples, std::uint64_t count, unsigned int channelCount);
+
+	[[nodiscard]] unsigned int getChannelCount() const;
+	[[nodiscard]] std::uint64_t getSampleCount() const;
+	[[nodiscard]] std::size_t getBlockCount() const;
+
+	// Samples in a block, `BlockFrames` frames except for the last block.
+	[[nodiscard]] std::size_t getBlockSize(std::size_t block) const;
+
+	// Bytes held by the compressed samples.
+	[[nodiscard]] std::size_t getByteSize() const;
+
+	// Decode one block, `out` must hold `getBlockSize(block)` samples.
+	void decodeBlock(std::size_t block, std::int16_t* out) const;
+
+private:
+	CompressedPcm() = default;
+
+	unsigned int               m_channelCount = 0;
+	std::uint64_t              m_sampleCount = 0;
+	std::vector<std::uint64_t> m_blockOffsets; // One more than the blocks, the last one is the end of the data.
+	std::vector<std::uint8_t>  m_data;
+};
+
+}
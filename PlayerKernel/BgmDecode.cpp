@@ -0,0 +1,135 @@
+﻿#include "BgmDecode.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace bgm {
+
+namespace {
+// Below this, starting the workers costs more than it saves.
+constexpr std::uint64_t MinSegmentFrames = 1 << 16;
+
+// Samples read at once, between checks of the cancel flag.
+constexpr std::uint64_t ReadSlice = 1 << 16;
+
+// Longest Vorbis block; decoding this much before a segment covers the overlap of the blocks it starts in.
+constexpr std::uint64_t VorbisPreRollFrames = 8192;
+
+struct Segment {
+	std::uint64_t begin; // Frames.
+	std::uint64_t end;
+	std::uint64_t preRoll = 0; // Frames decoded before `begin` and dropped.
+};
+
+// Segment starts snapped to the seek points, a few per worker so that they even out.
+std::vector<Segment> plan(const SeekIndex& index, std::uint64_t frames, unsigned int threadCount) {
+	const std::uint64_t wanted = std::max<std::uint64_t>(1, std::min<std::uint64_t>(threadCount * 4ull, frames / MinSegmentFrames));
+	std::vector<std::uint64_t> starts{ 0 };
+	for (std::uint64_t i = 1; i < wanted; ++i) {
+		std::uint64_t start = frames * i / wanted;
+		if (const SeekIndex::Point* point = index.find(start); point != nullptr) {
+			start = point->frame;
+		}
+		if (start > starts.back() && start < frames) {
+			starts.push_back(start);
+		}
+	}
+
+	std::vector<Segment> res;
+	for (std::size_t i = 0; i < starts.size(); ++i) {
+		res.push_back({ starts[i], i + 1 < starts.size() ? starts[i + 1] : frames });
+	}
+	return res;
+}
+
+// Page-aligned segments, each decoding the end of the previous one first, as a serial decode would have.
+std::vector<Segment> planOgg(const SeekIndex& index, std::uint64_t frames, unsigned int threadCount) {
+	std::vector<Segment> res = plan(index, frames, threadCount);
+	for (Segment& segment : res) {
+		segment.preRoll = std::min(segment.begin, VorbisPreRollFrames);
+	}
+	return res;
+}
+}
+
+bool decodeParallel(const StreamOpener& open, const SeekIndex& index, std::int16_t* out, std::uint64_t count, unsigned int threadCount,
+	const std::atomic<bool>* cancel) {
+	if (!open || index.channelCount == 0) {
+		return false;
+	}
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	const unsigned int channelCount = index.channelCount;
+	const std::uint64_t frames = count / channelCount;
+
+	std::vector<Segment> segments;
+	switch (index.format) {
+	case SeekIndex::Format::Flac:
+		segments = plan(index, frames, threadCount);
+		break;
+	case SeekIndex::Format::Ogg:
+		segments = planOgg(index, frames, threadCount);
+		break;
+	default:
+		return false;
+	}
+	if (segments.size() < 2 || threadCount < 2) {
+		return false;
+	}
+
+	std::atomic<std::size_t> next{ 0 };
+	std::atomic<bool>        failed{ false };
+	const auto stopped = [&]() {
+		return failed || (cancel != nullptr && *cancel);
+	};
+	const auto work = [&]() {
+		std::shared_ptr<InputStream> stream = open();
+		InputSoundFile file;
+		if (stream == nullptr || !file.openFromStream(*stream) || file.getChannelCount() != channelCount) {
+			failed = true;
+			return;
+		}
+		std::vector<std::int16_t> dropped;
+		for (std::size_t i = next++; i < segments.size() && !stopped(); i = next++) {
+			const Segment& segment = segments[i];
+			file.seek((segment.begin - segment.preRoll) * channelCount);
+			dropped.resize(static_cast<std::size_t>(segment.preRoll * channelCount));
+			for (std::uint64_t done = 0; done < dropped.size();) {
+				const std::uint64_t n = file.read(dropped.data() + done, std::min(dropped.size() - done, ReadSlice));
+				if (n == 0 || stopped()) {
+					failed = true;
+					return;
+				}
+				done += n;
+			}
+
+			std::int16_t* o = out + segment.begin * channelCount;
+			for (std::uint64_t left = (segment.end - segment.begin) * channelCount; left != 0;) {
+				const std::uint64_t n = file.read(o, std::min(left, ReadSlice));
+				if (n == 0 || stopped()) {
+					failed = true;
+					return;
+				}
+				o += n;
+				left -= n;
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	const std::size_t workerCount = std::min<std::size_t>(threadCount, segments.size());
+	for (std::size_t i = 1; i < workerCount; ++i) {
+		workers.emplace_back(work);
+	}
+	work();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	return !stopped();
+}
+
+}
@@ -0,0 +1,43 @@
+﻿#pragma once
+
+#include "BgmHeader.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace bgm {
+
+// Opens a new stream on the data of a music, for a decoder of its own.
+using StreamOpener = std::function<std::shared_ptr<InputStream>()>;
+
+////////////////////////////////////////////////////////////
+/// \brief Decode the start of a music with several decoders at once
+///
+/// The music is cut into segments, each decoded by a worker with
+/// a decoder of its own, straight into its place in `out`.
+/// FLAC is cut at the points of its SEEKTABLE, where its decoder
+/// lands on a frame without searching; its frames decode on their
+/// own so the segments join exactly.
+/// Ogg Vorbis is cut at page boundaries (from the page index if
+/// the music has one, otherwise where vorbisfile lands), and every
+/// segment first decodes and drops a pre-roll of the longest Vorbis
+/// block, so that the blocks overlapping its start come out as
+/// they would in a serial decode.
+///
+/// \param open        Opens the streams of the workers
+/// \param index       Seek points of the music
+/// \param out         Buffer of `count` samples
+/// \param count       Samples to decode from the start, a multiple of the channel count
+/// \param threadCount Workers, 0 for one per core
+/// \param cancel      Stops the workers once set, checked between reads
+///
+/// \return `false` if the format can't be split, a decoder failed,
+///          or the decode was cancelled; the caller then decodes
+///          serially, unless cancelled
+///
+////////////////////////////////////////////////////////////
+[[nodiscard]] bool decodeParallel(const StreamOpener& open, const SeekIndex& index, std::int16_t* out, std::uint64_t count, unsigned int threadCount = 0,
+	const std::atomic<bool>* cancel = nullptr);
+
+}
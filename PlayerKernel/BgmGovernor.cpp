@@ -0,0 +1,117 @@
+﻿#include "BgmGovernor.h"
+
+#include <algorithm>
+
+namespace bgm {
+
+Governor& Governor::getInstance() {
+	static Governor instance;
+	return instance;
+}
+
+void Governor::setBudget(std::size_t bytes) {
+	{
+		const std::lock_guard lock(m_mutex);
+		m_budget = bytes;
+	}
+	rebalance();
+}
+
+std::size_t Governor::getBudget() const {
+	const std::lock_guard lock(m_mutex);
+	return m_budget;
+}
+
+void Governor::rebalance() {
+	// The clients are chosen under the lock, then decoded without it, so that musics can come and go meanwhile.
+	const std::lock_guard rebalancing(m_rebalance);
+	std::unique_lock lock(m_mutex);
+
+	struct Candidate {
+		Client* client;
+		std::size_t cost;
+		std::uint64_t activity;
+	};
+	std::vector<Candidate> candidates;
+	candidates.reserve(m_clients.size());
+	for (Client* client : m_clients) {
+		candidates.push_back({ client, client->getCacheCost(), client->takeActivity() });
+	}
+
+	// Musics being played come first, then the cheapest ones, so that the budget covers as many loops as possible.
+	std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+		if ((a.activity != 0) != (b.activity != 0))
+			return a.activity != 0;
+		return a.cost < b.cost;
+	});
+
+	std::vector<Client*> keep;
+	std::vector<Client*> drop;
+	std::size_t planned = 0;
+	for (const Candidate& c : candidates) {
+		if (c.cost != 0 && planned + c.cost <= m_budget) {
+			planned += c.cost;
+			keep.push_back(c.client);
+		}
+		else {
+			drop.push_back(c.client);
+		}
+	}
+
+	// Release memory before taking more.
+	for (Client* client : drop) {
+		if (client->isCached()) {
+			client->demote();
+			++m_demotions;
+		}
+	}
+	for (Client* client : keep) {
+		// It may have left since it was chosen
+		if (std::find(m_clients.cbegin(), m_clients.cend(), client) == m_clients.cend() || client->isCached()) {
+			continue;
+		}
+		m_busy = client;
+		lock.unlock();
+		const bool promoted = client->promote();
+		lock.lock();
+		m_busy = nullptr;
+		m_idle.notify_all();
+		if (promoted) {
+			++m_promotions;
+		}
+	}
+}
+
+Governor::Allocation Governor::getAllocation() const {
+	const std::lock_guard lock(m_mutex);
+	Allocation res;
+	res.budget = m_budget;
+	res.promotions = m_promotions;
+	res.demotions = m_demotions;
+	for (const Client* client : m_clients) {
+		if (client->isCached()) {
+			res.used += client->getCacheCost();
+			++res.cached;
+		}
+		else {
+			++res.streaming;
+		}
+	}
+	return res;
+}
+
+void Governor::add(Client& client) {
+	const std::lock_guard lock(m_mutex);
+	m_clients.push_back(&client);
+}
+
+void Governor::remove(Client& client) {
+	// Only the client being decoded has to wait, for its decode to be cancelled
+	std::unique_lock lock(m_mutex);
+	m_idle.wait(lock, [this, &client]() {
+		return m_busy != &client;
+	});
+	m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), &client), m_clients.end());
+}
+
+}
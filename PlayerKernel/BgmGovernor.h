@@ -0,0 +1,101 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace bgm {
+
+////////////////////////////////////////////////////////////
+/// \brief Process-wide memory budget for decoded musics
+///
+/// Every `bgm::Music` registers itself here. Within the budget,
+/// `rebalance()` promotes the most active and shortest musics
+/// to in-memory PCM playback, and demotes the others back to
+/// streaming from their decoder. Musics switch between the two
+/// between chunks, at the same sample, so it can't be heard.
+///
+/// The budget is 0 by default, which keeps every music streamed.
+///
+////////////////////////////////////////////////////////////
+class Governor final {
+public:
+	////////////////////////////////////////////////////////////
+	/// \brief Interface of the musics managed by the governor
+	///
+	////////////////////////////////////////////////////////////
+	class Client {
+	public:
+		virtual ~Client() = default;
+
+		/// \brief Bytes needed to hold the decoded music, 0 if it can't be cached
+		[[nodiscard]] virtual std::size_t getCacheCost() const = 0;
+
+		/// \brief Samples played since the previous call
+		[[nodiscard]] virtual std::uint64_t takeActivity() = 0;
+
+		/// \brief Tell whether the music is currently played from memory
+		[[nodiscard]] virtual bool isCached() const = 0;
+
+		/// \brief Decode the music and switch to playing it from memory
+		[[nodiscard]] virtual bool promote() = 0;
+
+		/// \brief Release the decoded music and switch back to streaming
+		virtual void demote() = 0;
+	};
+
+	////////////////////////////////////////////////////////////
+	/// \brief Current state of the governor
+	///
+	////////////////////////////////////////////////////////////
+	struct Allocation {
+		std::size_t   budget{};     //!< Bytes allowed for decoded musics
+		std::size_t   used{};       //!< Bytes held by decoded musics
+		std::size_t   cached{};     //!< Musics played from memory
+		std::size_t   streaming{};  //!< Musics streamed from their decoder
+		std::uint64_t promotions{}; //!< Switches to memory so far
+		std::uint64_t demotions{};  //!< Switches back to streaming so far
+	};
+
+	[[nodiscard]] static Governor& getInstance();
+
+	////////////////////////////////////////////////////////////
+	/// \brief Set the bytes allowed for decoded musics, and rebalance
+	///
+	////////////////////////////////////////////////////////////
+	void setBudget(std::size_t bytes);
+
+	[[nodiscard]] std::size_t getBudget() const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Decide again which musics are played from memory
+	///
+	/// Decoding happens on the calling thread, so call it from a
+	/// worker or a loading screen, not from the audio thread.
+	/// Musics can be created and destroyed meanwhile; destroying
+	/// the one being decoded cancels its decode.
+	///
+	////////////////////////////////////////////////////////////
+	void rebalance();
+
+	[[nodiscard]] Allocation getAllocation() const;
+
+	void add(Client& client);
+	void remove(Client& client);
+
+private:
+	Governor() = default;
+
+	std::mutex                   m_rebalance; //!< Held through a whole rebalance, one at a time
+	mutable std::mutex           m_mutex;     //!< Held between the decodes only
+	std::condition_variable      m_idle;      //!< Notified when `m_busy` is done
+	std::vector<Client*>         m_clients;
+	Client*                      m_busy = nullptr; //!< Client being decoded, without `m_mutex`
+	std::size_t                  m_budget = 0;
+	std::uint64_t                m_promotions = 0;
+	std::uint64_t                m_demotions = 0;
+};
+
+}
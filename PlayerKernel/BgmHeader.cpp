@@ -1,13 +1,27 @@
 ﻿#include "BgmHeader.h"
 #include <SFML/System/Err.hpp>
+#include <SFML/System/FileInputStream.hpp>
 #include <SFML/System/InputStream.hpp>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
 
 namespace {
 constexpr char InvalidOggFile[] = "Invalid OGG file";
 constexpr char InvalidFlacFile[] = "Invalid FLAC file";
 constexpr char FileCorrupted[] = "Corrupted";
-bool readOggVorbisCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val);
-bool readFlacCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val);
+bool readOggVorbisCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val, bool verify);
+bool readFlacCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val, bgm::SeekIndex* index);
+bool walkOggPages(bgm::InputStream& file, bgm::SeekIndex* index, bgm::PageCheck check, uint64_t* badOffset);
+bool writeOggComment(const std::filesystem::path& filename, const std::string& entry, bool& rewritten);
+bool writeFlacComment(const std::filesystem::path& filename, const std::string& entry, bool& rewritten);
+constexpr char SeekIndexMagic[8] = { 'O', 'H', 'M', 'S', 'I', 'D', 'X', '2' };
+
+// Smallest Ogg page: its header without any segment.
+constexpr std::uint64_t MinOggPageSize = 27;
 }
 
 namespace bgm {
@@ -16,7 +30,7 @@ std::ostream& err() {
 	return sf::err();
 }
 
-std::any readLoopPoints(InputStream& stream) {
+std::any readLoopPoints(InputStream& stream, SeekIndex* index, bool scanPages, PageCheck check) {
 	try {
 		std::string key;
 		std::string val;
@@ -38,13 +52,24 @@ std::any readLoopPoints(InputStream& stream) {
 		{
 			std::string h = std::string(header, 4);
 			if (h == "OggS") {
-				if (!readOggVorbisCommentOHMSSP(stream, key, val)) {
+				// 头页的校验随注释一起读；只有全部页都要校验或要建索引时才再遍历一遍
+				if (!readOggVorbisCommentOHMSSP(stream, key, val, check != PageCheck::Off)) {
 					err() << "Failed to read comments for OGG file." << std::endl;
 					return {};
 				}
+				const bool indexing = index != nullptr && scanPages;
+				const PageCheck walkCheck = check == PageCheck::Full ? PageCheck::Full : PageCheck::Off;
+				if ((indexing || walkCheck != PageCheck::Off) && !walkOggPages(stream, indexing ? index : nullptr, walkCheck, nullptr)) {
+					if (walkCheck != PageCheck::Off) {
+						err() << "Failed to check pages of OGG file." << std::endl;
+						return {};
+					}
+					err() << "Failed to index pages of OGG file." << std::endl;
+					index->points.clear();
+				}
 			}
 			else if (h == "fLaC") {
-				if (!readFlacCommentOHMSSP(stream, key, val)) {
+				if (!readFlacCommentOHMSSP(stream, key, val, index)) {
 					err() << "Failed to read comments for FLAC file." << std::endl;
 					return {};
 				}
@@ -99,6 +124,153 @@ std::any readLoopPoints(InputStream& stream) {
 	return {};
 }
 
+const SeekIndex::Point* SeekIndex::find(std::uint64_t frame) const {
+	auto it = std::upper_bound(points.cbegin(), points.cend(), frame, [](std::uint64_t f, const Point& p) {
+		return f < p.frame;
+	});
+	return it == points.cbegin() ? nullptr : &*(it - 1);
+}
+
+bool loadSeekIndex(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, SeekIndex& index) {
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+
+	char magic[8]{};
+	uint8_t format = 0;
+	uint32_t channelCount = 0;
+	uint32_t sampleRate = 0;
+	uint64_t frameCount = 0;
+	uint64_t size = 0;
+	int64_t time = 0;
+	uint64_t count = 0;
+	file.read(magic, 8);
+	file.read(reinterpret_cast<char*>(&format), 1);
+	file.read(reinterpret_cast<char*>(&channelCount), 4);
+	file.read(reinterpret_cast<char*>(&sampleRate), 4);
+	file.read(reinterpret_cast<char*>(&frameCount), 8);
+	file.read(reinterpret_cast<char*>(&size), 8);
+	file.read(reinterpret_cast<char*>(&time), 8);
+	file.read(reinterpret_cast<char*>(&count), 8);
+	// At most one point per page, so a corrupt count can't ask for more than the music could hold
+	if (!file || std::string(magic, 8) != std::string(SeekIndexMagic, 8) || size != sourceSize || time != sourceTime ||
+		format > (uint8_t)SeekIndex::Format::Ogg || count > size / MinOggPageSize) {
+		return false;
+	}
+
+	std::vector<SeekIndex::Point> points((size_t)count);
+	file.read(reinterpret_cast<char*>(points.data()), (std::streamsize)(count * sizeof(SeekIndex::Point)));
+	if (!file) {
+		return false;
+	}
+
+	index.format = (SeekIndex::Format)format;
+	index.channelCount = channelCount;
+	index.sampleRate = sampleRate;
+	index.frameCount = frameCount;
+	index.points = std::move(points);
+	return true;
+}
+
+bool saveSeekIndex(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, const SeekIndex& index) {
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		err() << "Failed to create seek index file." << std::endl;
+		return false;
+	}
+
+	uint8_t format = (uint8_t)index.format;
+	uint32_t channelCount = index.channelCount;
+	uint32_t sampleRate = index.sampleRate;
+	uint64_t count = index.points.size();
+	file.write(SeekIndexMagic, 8);
+	file.write(reinterpret_cast<const char*>(&format), 1);
+	file.write(reinterpret_cast<const char*>(&channelCount), 4);
+	file.write(reinterpret_cast<const char*>(&sampleRate), 4);
+	file.write(reinterpret_cast<const char*>(&index.frameCount), 8);
+	file.write(reinterpret_cast<const char*>(&sourceSize), 8);
+	file.write(reinterpret_cast<const char*>(&sourceTime), 8);
+	file.write(reinterpret_cast<const char*>(&count), 8);
+	file.write(reinterpret_cast<const char*>(index.points.data()), (std::streamsize)(count * sizeof(SeekIndex::Point)));
+	if (!file) {
+		err() << "Failed to write seek index file." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool writeLoopPoints(const std::filesystem::path& filename, const std::string& entry, bool* rewritten) {
+	char header[4]{};
+	{
+		std::ifstream file(filename, std::ios::binary);
+		if (!file.read(header, 4)) {
+			err() << "Failed to read file to write loop points: " << filename << std::endl;
+			return false;
+		}
+	}
+
+	bool moved = false;
+	bool res = false;
+	if (std::string(header, 4) == "OggS") {
+		res = writeOggComment(filename, entry, moved);
+	}
+	else if (std::string(header, 4) == "fLaC") {
+		res = writeFlacComment(filename, entry, moved);
+	}
+	else {
+		err() << "Unsupported file format." << std::endl;
+	}
+	if (rewritten != nullptr) {
+		*rewritten = moved;
+	}
+	return res;
+}
+
+bool writeLoopPoints(const std::filesystem::path& filename, Span<std::uint64_t> samplePoints, bool* rewritten) {
+	return writeLoopPoints(filename, "OHMSSPD=<" + std::to_string(samplePoints.offset) + "|" + std::to_string(samplePoints.length) + ">", rewritten);
+}
+
+bool writeLoopPoints(const std::filesystem::path& filename, Span<Time> timePoints, bool* rewritten) {
+	return writeLoopPoints(filename, "OHMSSPC=>" + std::to_string(timePoints.offset.asMicroseconds()) + ":" + std::to_string(timePoints.length.asMicroseconds()) + "<", rewritten);
+}
+
+bool checkOggPages(InputStream& stream, PageCheck check, std::uint64_t* badOffset) {
+	return walkOggPages(stream, nullptr, check, badOffset);
+}
+
+std::uint32_t getOggCrc(const void* data, std::size_t size, std::uint32_t crc) {
+	// Slice-by-8: table[k] gives the CRC of a byte followed by k zero bytes, so that 8 bytes are folded at once
+	static const auto table = []() {
+		std::array<std::array<std::uint32_t, 256>, 8> res{};
+		for (std::uint32_t i = 0; i < 256; ++i) {
+			std::uint32_t r = i << 24;
+			for (int k = 0; k < 8; ++k) {
+				r = (r & 0x80000000) ? (r << 1) ^ 0x04C11DB7 : (r << 1);
+			}
+			res[0][i] = r;
+		}
+		for (std::uint32_t i = 0; i < 256; ++i) {
+			for (std::size_t k = 1; k < 8; ++k) {
+				res[k][i] = (res[k - 1][i] << 8) ^ res[0][res[k - 1][i] >> 24];
+			}
+		}
+		return res;
+	}();
+
+	const auto* p = static_cast<const std::uint8_t*>(data);
+	for (; size >= 8; p += 8, size -= 8) {
+		const std::uint32_t a = crc ^ ((std::uint32_t)p[0] << 24 | (std::uint32_t)p[1] << 16 | (std::uint32_t)p[2] << 8 | p[3]);
+		const std::uint32_t b = (std::uint32_t)p[4] << 24 | (std::uint32_t)p[5] << 16 | (std::uint32_t)p[6] << 8 | p[7];
+		crc = table[7][a >> 24] ^ table[6][(a >> 16) & 0xFF] ^ table[5][(a >> 8) & 0xFF] ^ table[4][a & 0xFF] ^
+			  table[3][b >> 24] ^ table[2][(b >> 16) & 0xFF] ^ table[1][(b >> 8) & 0xFF] ^ table[0][b & 0xFF];
+	}
+	for (; size > 0; ++p, --size) {
+		crc = (crc << 8) ^ table[0][((crc >> 24) ^ *p) & 0xFF];
+	}
+	return crc;
+}
+
 void BGM_STREAM_EMPTY_DELETER::operator()(InputStream* object) const {
 	(void)object;
 }
@@ -230,6 +402,21 @@ struct OggPageHeader {
 	uint8_t* segmentTable;
 };
 
+// A page header as stored: the 27 fixed bytes, then the segment table.
+struct OggPageBytes {
+	uint8_t  header[27 + 255]{};
+	size_t   headerSize = 0;
+	uint64_t bodySize = 0;
+
+	uint64_t getGranule() const;
+};
+
+enum class OggPageRead {
+	Page,
+	End,
+	Invalid,
+};
+
 /*struct OggCommentPacketHeader {
 	uint8_t headerTypeFlag; // 1 = identification, 3 = comment, 5 = setup;
 	char packetPattern[6]; // "vorbis"
@@ -240,137 +427,205 @@ struct OggPageHeader {
 	uint8_t framingFlag; // = 1;
 };*/
 
-bool readOggVorbisCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val) {
+OggPageRead readOggPageHeader(bgm::InputStream& file, OggPageBytes& page) {
+	if (auto r = file.read(&(page.header[0]), 27); !r || *r == 0) {
+		return OggPageRead::End;
+	}
+	else if (r != 27 || std::string((char*)&(page.header[0]), 4) != "OggS") {
+		bgm::err() << InvalidOggFile << std::endl;
+		return OggPageRead::Invalid;
+	}
+
+	const uint8_t segmentCount = page.header[26];
+	if (auto r = file.read(&(page.header[27]), segmentCount); !r || r != segmentCount) {
+		bgm::err() << InvalidOggFile << std::endl;
+		return OggPageRead::Invalid;
+	}
+	page.headerSize = 27 + (size_t)segmentCount;
+	page.bodySize = 0;
+	for (uint8_t i = 0; i < segmentCount; ++i) {
+		page.bodySize += page.header[27 + i];
+	}
+	return OggPageRead::Page;
+}
+
+uint64_t OggPageBytes::getGranule() const {
+	uint64_t granule = 0;
+	for (int i = 7; i >= 0; --i) {
+		granule = (granule << 8) | header[6 + i];
+	}
+	return granule;
+}
+
+// verify 时读出整页核对 CRC，找到注释后读完其余头页和第一个音频页
+bool readOggVorbisCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val, bool verify) {
 	// OGG文件由多个packet组成，需要找到包含注释的packet
 
 	uint64_t packetSize = 0;
 	std::vector<std::byte> packetData;
+	std::vector<uint8_t> body;
 	bool isCurentCommentPacket = false;
+	bool found = false;
+	uint64_t pageOffset = 0;
 
 	while (true) {
-		OggPageHeader header{};
-
-		if (auto r = file.read(&(header.capturePattern[0]), 4); !r || r != 4) {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
-		}
-		if (std::string(header.capturePattern, 4) != "OggS") {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
-		}
-
-		if (auto r = file.read(&header.version, 1); !r || r != 1) {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
-		}
-		if (auto r = file.read(&header.headerType, 1); !r || r != 1) {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
-		}
-
-		if (auto r = readle64(file); !r) {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
-		}
-		else {
-			header.granulePosition = *r;
-		}
-
-		if (auto r = readle32(file); !r) {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
-		}
-		else {
-			header.bitstreamSerialNumber = *r;
-		}
-
-		if (auto r = readle32(file); !r) {
-			bgm::err() << InvalidOggFile << std::endl;
+		OggPageBytes page;
+		if (const OggPageRead r = readOggPageHeader(file, page); r != OggPageRead::Page) {
+			if (r == OggPageRead::End) {
+				bgm::err() << InvalidOggFile << std::endl;
+			}
 			return false;
 		}
-		else {
-			header.pageSequenceNumber = *r;
-		}
-
-		if (auto r = readle32(file); !r) {
+		body.resize(page.bodySize);
+		if (auto r = file.read(body.data(), body.size()); !r || r != body.size()) {
 			bgm::err() << InvalidOggFile << std::endl;
 			return false;
 		}
-		else {
-			header.checksum = *r;
-		}
-
-		if (auto r = file.read(&header.segmentCount, 1); !r || r != 1) {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
+		if (verify) {
+			// 校验和按其字段为 0 计算
+			const uint32_t checksum = page.header[22] | (uint32_t)page.header[23] << 8 | (uint32_t)page.header[24] << 16 | (uint32_t)page.header[25] << 24;
+			std::fill(page.header + 22, page.header + 26, (uint8_t)0);
+			if (bgm::getOggCrc(body.data(), body.size(), bgm::getOggCrc(page.header, page.headerSize)) != checksum) {
+				bgm::err() << "OGG page at " << pageOffset << " is corrupted." << std::endl;
+				return false;
+			}
 		}
-
-		// 读取segment大小表
-		std::vector<uint8_t> segmentTable(header.segmentCount);
-		if (auto r = file.read(segmentTable.data(), header.segmentCount); !r || r != header.segmentCount) {
-			bgm::err() << InvalidOggFile << std::endl;
-			return false;
+		pageOffset += page.headerSize + page.bodySize;
+		if (found) {
+			const uint64_t granule = page.getGranule();
+			if (granule != 0xFFFFFFFFFFFFFFFFULL && granule > 0) {
+				return true;
+			}
+			continue;
 		}
 
 		// 拼接Packet的数据
-		for (auto size : segmentTable) {
-			packetData.resize(packetSize + size);
+		size_t bodyPos = 0;
+		for (size_t i = 0; i < (size_t)page.header[26]; ++i) {
+			const uint8_t size = page.header[27 + i];
 			if (packetSize == 0 || isCurentCommentPacket) {
-				if (auto r = file.read(packetData.data() + packetSize, size); !r || r != size) {
-					bgm::err() << InvalidOggFile << std::endl;
-					return false;
-				}
-				isCurentCommentPacket = isCurentCommentPacket || ((uint8_t)packetData[0] == 0x03);
-			}
-			else {
-				if (auto p = file.tell(); !p) {
-					bgm::err() << InvalidOggFile << std::endl;
-					return false;
-				}
-				else if (auto r = file.seek(*p + size); !r || r != (*p + size)) {
-					bgm::err() << InvalidOggFile << std::endl;
-					return false;
-				}
+				packetData.insert(packetData.end(), (const std::byte*)&body[bodyPos], (const std::byte*)&body[bodyPos] + size);
+				isCurentCommentPacket = isCurentCommentPacket || (size > 0 && (uint8_t)packetData[0] == 0x03);
 			}
+			bodyPos += size;
 			packetSize += size;
 			if (size == 0xFF) {
 				continue;
 			}
 			// 当前packet结束
-			bool found = false;
-			while (isCurentCommentPacket) {
-				isCurentCommentPacket = false;
-
-				size_t pos = 1;
-				if (std::string((char*)(&packetData[pos]), 6) != "vorbis") {
-					break;
-				}
-				pos += 6;
-				if (pos > packetSize) {
+			if (isCurentCommentPacket) {
+				if (packetSize < 8 || std::string((char*)(&packetData[1]), 6) != "vorbis") {
 					bgm::err() << InvalidOggFile << std::endl;
 					return false;
 				}
-
-				found = readTagData(packetData.data() + pos, packetSize - pos - 1, _key, _val);
+				found = readTagData(packetData.data() + 7, packetSize - 8, _key, _val);
 
 				// 注释结束
 				if ((uint8_t)packetData[packetSize - 1] != 0x01) {
 					bgm::err() << InvalidOggFile << std::endl;
 					return false;
 				}
-			}
-			if (found) {
-				return true;
+				// 注释包只有一个
+				if (!found) {
+					return false;
+				}
+				if (!verify) {
+					return true;
+				}
+				break;
 			}
 			packetData.clear();
 			packetSize = 0;
 		}
 	}
-	return false;
 }
 
 
-bool readFlacCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val) {
+// 从头遍历所有页：index 不为空时为页建立索引，按 check 读出整页核对 CRC
+bool walkOggPages(bgm::InputStream& file, bgm::SeekIndex* index, bgm::PageCheck check, uint64_t* badOffset) {
+	if (auto r = file.seek(0); !r || r != 0) {
+		bgm::err() << InvalidOggFile << std::endl;
+		return false;
+	}
+
+	std::vector<bgm::SeekIndex::Point> points;
+	std::vector<uint8_t> body;
+	uint64_t pageOffset = 0;
+	uint64_t lastGranule = 0;
+	bool audio = false;
+	while (true) {
+		OggPageBytes page;
+		if (const OggPageRead r = readOggPageHeader(file, page); r == OggPageRead::End) {
+			break; // 文件结束
+		}
+		else if (r == OggPageRead::Invalid) {
+			if (badOffset != nullptr) {
+				*badOffset = pageOffset;
+			}
+			return false;
+		}
+
+		// 没有包在此页结束时 granule 为 -1；从该页开始能解出的第一个样本接在上一个 granule 之后
+		const uint64_t granule = page.getGranule();
+		const bool verify = check == bgm::PageCheck::Full || (check == bgm::PageCheck::Headers && !audio);
+		if (granule != 0xFFFFFFFFFFFFFFFFULL) {
+			if (granule > 0) {
+				points.push_back({ lastGranule, pageOffset });
+				audio = true;
+			}
+			lastGranule = granule;
+		}
+
+		if (verify) {
+			// 校验和按其字段为 0 计算
+			const uint32_t checksum = page.header[22] | (uint32_t)page.header[23] << 8 | (uint32_t)page.header[24] << 16 | (uint32_t)page.header[25] << 24;
+			std::fill(page.header + 22, page.header + 26, (uint8_t)0);
+			body.resize(page.bodySize);
+			if (auto r = file.read(body.data(), body.size()); !r || r != body.size() ||
+				bgm::getOggCrc(body.data(), body.size(), bgm::getOggCrc(page.header, page.headerSize)) != checksum) {
+				bgm::err() << "OGG page at " << pageOffset << " is corrupted." << std::endl;
+				if (badOffset != nullptr) {
+					*badOffset = pageOffset;
+				}
+				return false;
+			}
+			pageOffset += page.headerSize + page.bodySize;
+		}
+		else if (index == nullptr) {
+			break; // 不再需要往后读
+		}
+		else {
+			pageOffset += page.headerSize + page.bodySize;
+			if (auto r = file.seek(pageOffset); !r || r != pageOffset) {
+				bgm::err() << InvalidOggFile << std::endl;
+				return false;
+			}
+		}
+	}
+
+	if (index != nullptr) {
+		index->format = bgm::SeekIndex::Format::Ogg;
+		index->frameCount = lastGranule;
+		index->points = std::move(points);
+	}
+	return true;
+}
+
+
+// Type in the low 7 bits, last block flag in the high bit.
+bool readFlacBlockHeader(bgm::InputStream& file, uint8_t& blockCtrl, uint32_t& blockDataSize) {
+	if (auto r = readbe32(file); !r) {
+		bgm::err() << InvalidFlacFile << std::endl;
+		return false;
+	}
+	else {
+		blockCtrl = (*r >> 24) & 0xFF;
+		blockDataSize = *r & 0x00FFFFFF;
+	}
+	return true;
+}
+
+bool readFlacCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::string& _val, bgm::SeekIndex* index) {
 	char header[4]{};
 
 	if (auto r = file.read(&(header[0]), 4); !r || r != 4) {
@@ -382,22 +637,55 @@ bool readFlacCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::strin
 		return false;
 	}
 
+	bool found = false;
 	bool isLastBlock = false;
 	while (!isLastBlock) {
-		uint32_t blockHeader = 0;
-		if (auto r = readbe32(file); !r) {
-			bgm::err() << InvalidFlacFile << std::endl;
+		uint8_t blockCtrl = 0;
+		uint32_t blockDataSize = 0;
+		if (!readFlacBlockHeader(file, blockCtrl, blockDataSize)) {
 			return false;
 		}
-		else {
-			blockHeader = *r;
-		}
-
-		uint8_t blockCtrl = (blockHeader >> 24) & 0xFF;
-		uint32_t blockDataSize = blockHeader & 0x00FFFFFF;
 
 		isLastBlock = (blockCtrl & 0x80) == 0x80;
-		if ((blockCtrl & 0x7F) != 4) {
+
+		// 索引需要的 STREAMINFO 和 SEEKTABLE
+		if (index != nullptr && ((blockCtrl & 0x7F) == 0 || (blockCtrl & 0x7F) == 3)) {
+			std::vector<std::byte> block(blockDataSize);
+			if (auto r = file.read(block.data(), blockDataSize); !r || r != blockDataSize) {
+				bgm::err() << InvalidFlacFile << std::endl;
+				return false;
+			}
+			auto be = [&block](size_t pos, size_t len) {
+				uint64_t res = 0;
+				for (size_t i = 0; i < len; ++i) {
+					res = (res << 8) | (uint64_t)block[pos + i];
+				}
+				return res;
+			};
+			if ((blockCtrl & 0x7F) == 0) {
+				if (blockDataSize < 18) {
+					bgm::err() << InvalidFlacFile << std::endl;
+					return false;
+				}
+				// 20 bits sample rate, 3 bits channels - 1, 5 bits bps - 1, 36 bits total samples
+				uint64_t packed = be(10, 8);
+				index->sampleRate = (unsigned int)(packed >> 44);
+				index->channelCount = (unsigned int)((packed >> 41) & 0x07) + 1;
+				index->frameCount = packed & 0xFFFFFFFFFULL;
+			}
+			else {
+				for (size_t pos = 0; pos + 18 <= blockDataSize; pos += 18) {
+					uint64_t frame = be(pos, 8);
+					if (frame == 0xFFFFFFFFFFFFFFFFULL) {
+						continue; // placeholder
+					}
+					index->points.push_back({ frame, be(pos + 8, 8) });
+				}
+			}
+			continue;
+		}
+
+		if ((blockCtrl & 0x7F) != 4 || found) {
 			if (auto p = file.tell(); !p) {
 				bgm::err() << InvalidFlacFile << std::endl;
 				return false;
@@ -416,14 +704,452 @@ bool readFlacCommentOHMSSP(bgm::InputStream& file, std::string& _key, std::strin
 			return false;
 		}
 
-		bool res = readTagData(tagData.data(), blockDataSize, _key, _val);
+		found = readTagData(tagData.data(), blockDataSize, _key, _val);
 
-		if (res) {
+		// 不需要索引时找到就结束
+		if (found && index == nullptr) {
 			return true;
 		}
 	}
 
-	return false;
+	if (index != nullptr && found) {
+		// SEEKTABLE 的偏移从第一个音频帧算起
+		auto audioOffset = file.tell();
+		if (!audioOffset) {
+			bgm::err() << InvalidFlacFile << std::endl;
+			return false;
+		}
+		for (auto& point : index->points) {
+			point.offset += *audioOffset;
+		}
+		std::sort(index->points.begin(), index->points.end(), [](const bgm::SeekIndex::Point& a, const bgm::SeekIndex::Point& b) {
+			return a.frame < b.frame;
+		});
+		index->format = bgm::SeekIndex::Format::Flac;
+	}
+
+	return found;
+}
+
+
+// 写标签：注释改变长度时，用填充吸收差值，只重写文件头部
+
+constexpr char PaddingKey[] = "OHMSPAD="; // Comment only there to keep the size of the comments.
+constexpr size_t PaddingOverhead = 4 + sizeof(PaddingKey) - 1;
+constexpr size_t RewritePadding = 1024;   // Room left for later edits when the file has to be rewritten.
+
+struct Comments {
+	std::string              vendor;
+	std::vector<std::string> entries;
+};
+
+bool parseComments(const std::byte* buf, size_t len, Comments& comments) {
+	auto le32 = [buf](size_t pos) {
+		return ((uint32_t)buf[pos] | ((uint32_t)buf[pos + 1] << 8) | ((uint32_t)buf[pos + 2] << 16) | ((uint32_t)buf[pos + 3] << 24));
+	};
+	size_t pos = 0;
+	if (len < 8 || le32(0) > len - 8) {
+		return false;
+	}
+	comments.vendor.assign((const char*)buf + 4, le32(0));
+	pos = 4 + comments.vendor.size();
+	const uint32_t count = le32(pos);
+	pos += 4;
+	comments.entries.clear();
+	for (uint32_t c = 0; c < count; ++c) {
+		if (len - pos < 4 || le32(pos) > len - pos - 4) {
+			return false;
+		}
+		comments.entries.emplace_back((const char*)buf + pos + 4, le32(pos));
+		pos += 4 + comments.entries.back().size();
+	}
+	return pos == len;
+}
+
+std::vector<std::byte> buildComments(const Comments& comments) {
+	std::vector<std::byte> res;
+	auto put32 = [&res](size_t value) {
+		for (int i = 0; i < 4; ++i) {
+			res.push_back((std::byte)((value >> (8 * i)) & 0xFF));
+		}
+	};
+	auto putString = [&](const std::string& str) {
+		put32(str.size());
+		for (char c : str) {
+			res.push_back((std::byte)c);
+		}
+	};
+	putString(comments.vendor);
+	put32(comments.entries.size());
+	for (const std::string& entry : comments.entries) {
+		putString(entry);
+	}
+	return res;
+}
+
+// Replaces the loop points and drops the padding.
+void setLoopComment(Comments& comments, const std::string& entry) {
+	std::erase_if(comments.entries, [](const std::string& e) {
+		return e.starts_with("OHMSSP") || e.starts_with(PaddingKey);
+	});
+	comments.entries.push_back(entry);
+}
+
+// Pads the comments to `size` bytes, if there is room for the padding comment.
+bool padComments(Comments& comments, size_t size) {
+	const size_t current = buildComments(comments).size();
+	if (current == size) {
+		return true;
+	}
+	if (current + PaddingOverhead > size) {
+		return false;
+	}
+	comments.entries.push_back(PaddingKey + std::string(size - current - PaddingOverhead, ' '));
+	return true;
+}
+
+// Writes the new header in place of the old one, then the rest of the file.
+bool rewriteFile(const std::filesystem::path& filename, const std::vector<std::byte>& header, uint64_t oldHeaderSize, const std::function<bool(std::istream&, std::ostream&)>& copy) {
+	std::filesystem::path temp = filename;
+	temp += ".ohmstmp";
+	{
+		std::ifstream in(filename, std::ios::binary);
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+		if (!in || !out) {
+			bgm::err() << "Failed to create file: " << temp << std::endl;
+			return false;
+		}
+		in.seekg((std::streamoff)oldHeaderSize);
+		out.write((const char*)header.data(), (std::streamsize)header.size());
+		if (!copy(in, out) || !out) {
+			bgm::err() << "Failed to write file: " << temp << std::endl;
+			out.close();
+			std::filesystem::remove(temp);
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(temp, filename, error);
+	if (error) {
+		bgm::err() << "Failed to replace file: " << filename << std::endl;
+		std::filesystem::remove(temp, error);
+		return false;
+	}
+	return true;
+}
+
+bool copyRest(std::istream& in, std::ostream& out) {
+	std::vector<char> buffer(1 << 16);
+	while (in) {
+		in.read(buffer.data(), (std::streamsize)buffer.size());
+		out.write(buffer.data(), in.gcount());
+	}
+	return in.eof();
+}
+
+bool writeInPlace(const std::filesystem::path& filename, uint64_t offset, const std::byte* data, size_t size) {
+	std::fstream file(filename, std::ios::binary | std::ios::in | std::ios::out);
+	file.seekp((std::streamoff)offset);
+	file.write((const char*)data, (std::streamsize)size);
+	if (!file) {
+		bgm::err() << "Failed to write file: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool writeFlacComment(const std::filesystem::path& filename, const std::string& entry, bool& rewritten) {
+	struct Block {
+		uint8_t                type;
+		std::vector<std::byte> data;
+	};
+
+	// 读出所有元数据块
+	std::vector<Block> blocks;
+	uint64_t headerSize = 4;
+	{
+		sf::FileInputStream file;
+		char magic[4]{};
+		if (!file.open(filename) || file.read(magic, 4) != 4 || std::string(magic, 4) != "fLaC") {
+			bgm::err() << InvalidFlacFile << std::endl;
+			return false;
+		}
+		bool isLastBlock = false;
+		while (!isLastBlock) {
+			uint8_t blockCtrl = 0;
+			uint32_t blockDataSize = 0;
+			if (!readFlacBlockHeader(file, blockCtrl, blockDataSize)) {
+				return false;
+			}
+			isLastBlock = (blockCtrl & 0x80) == 0x80;
+			blocks.push_back({ (uint8_t)(blockCtrl & 0x7F), std::vector<std::byte>(blockDataSize) });
+			if (auto r = file.read(blocks.back().data.data(), blockDataSize); !r || r != blockDataSize) {
+				bgm::err() << InvalidFlacFile << std::endl;
+				return false;
+			}
+			headerSize += 4 + (uint64_t)blockDataSize;
+		}
+	}
+	if (blocks.empty() || blocks[0].type != 0) {
+		bgm::err() << InvalidFlacFile << std::endl;
+		return false;
+	}
+
+	auto comment = std::find_if(blocks.begin(), blocks.end(), [](const Block& b) { return b.type == 4; });
+	Comments comments;
+	if (comment == blocks.end()) {
+		comment = blocks.insert(blocks.begin() + 1, Block{ 4, {} });
+	}
+	else if (!parseComments(comment->data.data(), comment->data.size(), comments)) {
+		bgm::err() << InvalidFlacFile << std::endl;
+		return false;
+	}
+	setLoopComment(comments, entry);
+	comment->data = buildComments(comments);
+	if (comment->data.size() > 0xFFFFFF) {
+		bgm::err() << "Comments too long." << std::endl;
+		return false;
+	}
+
+	// PADDING 吸收长度变化
+	auto getSize = [&blocks]() {
+		uint64_t res = 4;
+		for (const Block& b : blocks) {
+			res += 4 + b.data.size();
+		}
+		return res;
+	};
+	auto padding = std::find_if(blocks.begin(), blocks.end(), [](const Block& b) { return b.type == 1; });
+	const int64_t change = (int64_t)getSize() - (int64_t)headerSize;
+	if (change != 0 && padding != blocks.end() && (int64_t)padding->data.size() >= change) {
+		padding->data.resize((size_t)((int64_t)padding->data.size() - change));
+	}
+	else if (change <= -4 && padding == blocks.end()) {
+		blocks.push_back({ 1, std::vector<std::byte>((size_t)(-change - 4)) });
+	}
+	rewritten = getSize() != headerSize;
+	if (rewritten) {
+		padding = std::find_if(blocks.begin(), blocks.end(), [](const Block& b) { return b.type == 1; });
+		if (padding == blocks.end()) {
+			blocks.push_back({ 1, {} });
+			padding = blocks.end() - 1;
+		}
+		padding->data.assign(RewritePadding, std::byte{ 0 });
+	}
+
+	std::vector<std::byte> header = { std::byte{ 'f' }, std::byte{ 'L' }, std::byte{ 'a' }, std::byte{ 'C' } };
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		const size_t size = blocks[i].data.size();
+		header.push_back((std::byte)(blocks[i].type | (i + 1 == blocks.size() ? 0x80 : 0)));
+		header.push_back((std::byte)((size >> 16) & 0xFF));
+		header.push_back((std::byte)((size >> 8) & 0xFF));
+		header.push_back((std::byte)(size & 0xFF));
+		header.insert(header.end(), blocks[i].data.begin(), blocks[i].data.end());
+	}
+
+	// SEEKTABLE 的偏移从第一个音频帧算起，挪动音频数据不影响它
+	if (!rewritten) {
+		return writeInPlace(filename, 0, header.data(), header.size());
+	}
+	return rewriteFile(filename, header, headerSize, copyRest);
+}
+
+// Page with its checksum computed.
+std::vector<std::byte> makeOggPage(uint8_t headerType, uint64_t granule, uint32_t serial, uint32_t sequence, const std::vector<uint8_t>& segments, const std::byte* body, size_t bodySize) {
+	std::vector<uint8_t> page = { 'O', 'g', 'g', 'S', 0, headerType };
+	for (int i = 0; i < 8; ++i) {
+		page.push_back((uint8_t)(granule >> (8 * i)));
+	}
+	for (int i = 0; i < 4; ++i) {
+		page.push_back((uint8_t)(serial >> (8 * i)));
+	}
+	for (int i = 0; i < 4; ++i) {
+		page.push_back((uint8_t)(sequence >> (8 * i)));
+	}
+	page.insert(page.end(), 4, 0);
+	page.push_back((uint8_t)segments.size());
+	page.insert(page.end(), segments.begin(), segments.end());
+	page.insert(page.end(), (const uint8_t*)body, (const uint8_t*)body + bodySize);
+	const uint32_t crc = bgm::getOggCrc(page.data(), page.size());
+	for (int i = 0; i < 4; ++i) {
+		page[22 + i] = (uint8_t)(crc >> (8 * i));
+	}
+	return std::vector<std::byte>((const std::byte*)page.data(), (const std::byte*)page.data() + page.size());
+}
+
+// Lays packets out on pages from `sequence` on; a page ends with the last packet.
+std::vector<std::byte> paginate(const std::vector<std::vector<std::byte>>& packets, uint32_t serial, uint32_t& sequence) {
+	std::vector<std::byte> res;
+	std::vector<uint8_t> segments;
+	std::vector<std::byte> body;
+	bool continued = false;
+	bool finished = false;
+	auto flush = [&]() {
+		std::vector<std::byte> page = makeOggPage(continued ? 0x01 : 0x00, finished ? 0 : 0xFFFFFFFFFFFFFFFFULL, serial, sequence++, segments, body.data(), body.size());
+		res.insert(res.end(), page.begin(), page.end());
+		continued = segments.back() == 0xFF;
+		finished = false;
+		segments.clear();
+		body.clear();
+	};
+	for (const std::vector<std::byte>& packet : packets) {
+		size_t pos = 0;
+		while (true) {
+			const size_t size = std::min<size_t>(packet.size() - pos, 0xFF);
+			segments.push_back((uint8_t)size);
+			body.insert(body.end(), packet.begin() + pos, packet.begin() + pos + size);
+			pos += size;
+			finished = finished || size < 0xFF;
+			if (segments.size() == 0xFF) {
+				flush();
+			}
+			if (size < 0xFF) {
+				break;
+			}
+		}
+	}
+	if (!segments.empty()) {
+		flush();
+	}
+	return res;
+}
+
+bool writeOggComment(const std::filesystem::path& filename, const std::string& entry, bool& rewritten) {
+	// 读出三个头包所在的页
+	std::vector<OggPageBytes> pages;
+	std::vector<std::byte> bodies;
+	std::vector<size_t> packetSizes;
+	size_t packetSize = 0;
+	{
+		sf::FileInputStream file;
+		if (!file.open(filename)) {
+			bgm::err() << InvalidOggFile << std::endl;
+			return false;
+		}
+		while (packetSizes.size() < 3) {
+			OggPageBytes& page = pages.emplace_back();
+			if (readOggPageHeader(file, page) != OggPageRead::Page || std::memcmp(&page.header[14], &pages[0].header[14], 4) != 0 ||
+				(packetSizes.size() == 0 && packetSize == 0 && pages.size() > 1)) {
+				bgm::err() << InvalidOggFile << std::endl;
+				return false;
+			}
+			const size_t offset = bodies.size();
+			bodies.resize(offset + (size_t)page.bodySize);
+			if (auto r = file.read(bodies.data() + offset, page.bodySize); !r || r != page.bodySize) {
+				bgm::err() << InvalidOggFile << std::endl;
+				return false;
+			}
+			for (size_t i = 27; i < page.headerSize; ++i) {
+				packetSize += page.header[i];
+				if (page.header[i] < 0xFF) {
+					packetSizes.push_back(packetSize);
+					packetSize = 0;
+				}
+			}
+		}
+	}
+
+	// 头包结束的页之后才是音频
+	size_t headerSize = 0;
+	for (const OggPageBytes& page : pages) {
+		headerSize += page.headerSize + (size_t)page.bodySize;
+	}
+	if (packetSizes.size() != 3 || packetSize != 0 || packetSizes[0] + packetSizes[1] + packetSizes[2] != bodies.size()) {
+		bgm::err() << InvalidOggFile << std::endl;
+		return false;
+	}
+	const size_t commentBegin = packetSizes[0];
+	const size_t commentSize = packetSizes[1];
+	if (commentSize < 8 || (uint8_t)bodies[commentBegin] != 0x03 || std::memcmp(&bodies[commentBegin + 1], "vorbis", 6) != 0 ||
+		(uint8_t)bodies[commentBegin + commentSize - 1] != 0x01) {
+		bgm::err() << InvalidOggFile << std::endl;
+		return false;
+	}
+	Comments comments;
+	if (!parseComments(&bodies[commentBegin + 7], commentSize - 8, comments)) {
+		bgm::err() << InvalidOggFile << std::endl;
+		return false;
+	}
+	setLoopComment(comments, entry);
+
+	// 长度不变时原地重写各页，只需重算校验和
+	rewritten = !padComments(comments, commentSize - 8);
+	if (!rewritten) {
+		const std::vector<std::byte> data = buildComments(comments);
+		std::copy(data.begin(), data.end(), bodies.begin() + (std::ptrdiff_t)commentBegin + 7);
+		std::vector<std::byte> header;
+		size_t offset = 0;
+		for (const OggPageBytes& page : pages) {
+			// Same header, new body, new checksum
+			const size_t begin = header.size();
+			header.insert(header.end(), (const std::byte*)page.header, (const std::byte*)page.header + page.headerSize);
+			header.insert(header.end(), bodies.begin() + (std::ptrdiff_t)offset, bodies.begin() + (std::ptrdiff_t)(offset + page.bodySize));
+			std::memset(&header[begin + 22], 0, 4);
+			const uint32_t crc = bgm::getOggCrc(&header[begin], header.size() - begin);
+			for (int i = 0; i < 4; ++i) {
+				header[begin + 22 + i] = (std::byte)((crc >> (8 * i)) & 0xFF);
+			}
+			offset += (size_t)page.bodySize;
+		}
+		const size_t firstSize = pages[0].headerSize + (size_t)pages[0].bodySize;
+		return writeInPlace(filename, firstSize, header.data() + firstSize, header.size() - firstSize);
+	}
+
+	// 放不下：重排头页，后面的页只改序号
+	(void)padComments(comments, buildComments(comments).size() + PaddingOverhead + RewritePadding);
+	std::vector<std::byte> packet = { std::byte{ 0x03 }, std::byte{ 'v' }, std::byte{ 'o' }, std::byte{ 'r' }, std::byte{ 'b' }, std::byte{ 'i' }, std::byte{ 's' } };
+	const std::vector<std::byte> data = buildComments(comments);
+	packet.insert(packet.end(), data.begin(), data.end());
+	packet.push_back(std::byte{ 0x01 });
+	const std::vector<std::byte> setup(bodies.begin() + (std::ptrdiff_t)(commentBegin + commentSize), bodies.end());
+
+	uint32_t serial = 0;
+	std::memcpy(&serial, &pages[0].header[14], 4);
+	uint32_t sequence = 1;
+	std::vector<std::byte> header(pages[0].headerSize + (size_t)pages[0].bodySize);
+	std::memcpy(header.data(), pages[0].header, pages[0].headerSize);
+	std::memcpy(header.data() + pages[0].headerSize, bodies.data(), (size_t)pages[0].bodySize);
+	const std::vector<std::byte> rest = paginate({ packet, setup }, serial, sequence);
+	header.insert(header.end(), rest.begin(), rest.end());
+
+	// Other logical streams multiplexed into the file keep their own numbering
+	const uint32_t shift = sequence - (uint32_t)pages.size();
+	return rewriteFile(filename, header, headerSize, [shift, serial](std::istream& in, std::ostream& out) {
+		if (shift == 0) {
+			return copyRest(in, out);
+		}
+		std::vector<char> page(27 + 255 + 255 * 255);
+		while (in.read(page.data(), 27)) {
+			const size_t segmentCount = (uint8_t)page[26];
+			if (std::string(page.data(), 4) != "OggS" || !in.read(page.data() + 27, (std::streamsize)segmentCount)) {
+				return false;
+			}
+			size_t bodySize = 0;
+			for (size_t i = 0; i < segmentCount; ++i) {
+				bodySize += (uint8_t)page[27 + i];
+			}
+			if (!in.read(page.data() + 27 + segmentCount, (std::streamsize)bodySize)) {
+				return false;
+			}
+			uint32_t pageSerial = 0;
+			std::memcpy(&pageSerial, &page[14], 4);
+			if (pageSerial != serial) {
+				out.write(page.data(), (std::streamsize)(27 + segmentCount + bodySize));
+				continue;
+			}
+			uint32_t sequence = 0;
+			std::memcpy(&sequence, &page[18], 4);
+			sequence += shift;
+			std::memcpy(&page[18], &sequence, 4);
+			std::memset(&page[22], 0, 4);
+			const uint32_t crc = bgm::getOggCrc(page.data(), 27 + segmentCount + bodySize);
+			for (int i = 0; i < 4; ++i) {
+				page[22 + i] = (char)((crc >> (8 * i)) & 0xFF);
+			}
+			out.write(page.data(), (std::streamsize)(27 + segmentCount + bodySize));
+		}
+		return in.eof() && in.gcount() == 0;
+	});
 }
 
 }
@@ -4,7 +4,11 @@
 #include <SFML/Audio/SoundStream.hpp>
 #include <SFML/System/Time.hpp>
 #include <any>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
 #include <ostream>
+#include <vector>
 
 namespace bgm {
 
@@ -21,7 +25,57 @@ constexpr Time microseconds(std::int64_t amount) {
 	return sf::microseconds(amount);
 }
 
-std::any readLoopPoints(InputStream& stream);
+// Positions in the stream where the decoder can start right away, parsed along with the tags.
+struct SeekIndex {
+	enum class Format {
+		None,
+		Flac, // From SEEKTABLE and STREAMINFO.
+		Ogg,  // From the granule positions of every page.
+	};
+
+	struct Point {
+		std::uint64_t frame;  // First sample frame (per channel) decoded from there.
+		std::uint64_t offset; // Byte position in the stream.
+	};
+
+	Format format = Format::None;
+	unsigned int channelCount = 0;
+	unsigned int sampleRate = 0;
+	std::uint64_t frameCount = 0; // Total sample frames (per channel), 0 if unknown.
+	std::vector<Point> points;    // Sorted by frame.
+
+	// Last point at or before the frame, nullptr if there is none.
+	[[nodiscard]] const Point* find(std::uint64_t frame) const;
+};
+
+// Which pages of an Ogg file have their CRC checked. The pages checked are read whole.
+enum class PageCheck {
+	Off,
+	Headers, // Pages up to the first one ending an audio packet.
+	Full,    // Every page, reading the whole file.
+};
+
+// `scanPages` walks every Ogg page header to index them, otherwise only the FLAC metadata is indexed.
+// Nothing is returned for an Ogg file with a page failing `check`.
+std::any readLoopPoints(InputStream& stream, SeekIndex* index = nullptr, bool scanPages = false, PageCheck check = PageCheck::Off);
+
+// Checks the pages of an Ogg file, from the start of the stream, without looking for tags.
+// `badOffset` gets the position of the first page failing, or of the data that is not a page.
+bool checkOggPages(InputStream& stream, PageCheck check = PageCheck::Full, std::uint64_t* badOffset = nullptr);
+
+// CRC-32 of Ogg pages (polynomial 0x04C11DB7, not reflected), carrying on from `crc` for the bytes before.
+[[nodiscard]] std::uint32_t getOggCrc(const void* data, std::size_t size, std::uint32_t crc = 0);
+
+// Sidecar file keeping a seek index next to the music, checked against the size and modification time of the music
+// (see `PcmCache::makeKey`).
+bool loadSeekIndex(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, SeekIndex& index);
+bool saveSeekIndex(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, const SeekIndex& index);
+
+// Sets the OHMSSPD (samples) or OHMSSPC (microseconds) comment of a file, only rewriting its header
+// when the comments keep their size, which a padding comment or the FLAC PADDING block takes care of.
+// Otherwise the whole file is rewritten, leaving padding for the next time, and `rewritten` is set.
+bool writeLoopPoints(const std::filesystem::path& filename, Span<std::uint64_t> samplePoints, bool* rewritten = nullptr);
+bool writeLoopPoints(const std::filesystem::path& filename, Span<Time> timePoints, bool* rewritten = nullptr);
 
 struct BGM_STREAM_EMPTY_DELETER {
 	void operator()(InputStream* object) const;
@@ -0,0 +1,540 @@
+﻿#include "BgmLoop.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <SFML/System/FileInputStream.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <numbers>
+#include <thread>
+
+namespace bgm {
+
+namespace {
+constexpr std::size_t Hop = 1024;      // Frames between two spectra.
+constexpr std::size_t Window = 2048;   // Frames of each spectrum.
+constexpr std::size_t BandCount = 24;  // Log-spaced bands of each spectrum.
+constexpr std::size_t RunWindow = 16;  // Spectra averaged while following a match back.
+constexpr float       MatchThreshold = 0.7f;
+constexpr float       PeakThreshold = 0.5f;
+
+// Seam checks
+constexpr std::size_t StepFrames = 256;         // Frames on either side giving the typical step.
+constexpr float       JumpThreshold = 0.05f;    // Smallest jump heard as a click, full scale being 1...
+constexpr float       JumpRatio = 6.f;          // ...when it is that many times larger than the typical step.
+constexpr float       RepeatThreshold = 0.2f;   // Spectral distance between what follows both ends.
+constexpr float       ContinuityThreshold = 0.5f; // Spectral distance between both sides of the seam.
+
+using Complex = std::complex<float>;
+
+std::size_t getPowerOfTwo(std::size_t count) {
+	std::size_t res = 1;
+	while (res < count) {
+		res <<= 1;
+	}
+	return res;
+}
+
+// Radix 2, in place, with the twiddles and the bit reversal computed once per size.
+class Fft {
+public:
+	explicit Fft(std::size_t size) :
+		m_twiddles(size / 2),
+		m_reversed(size) {
+		for (std::size_t k = 0; k < size / 2; ++k) {
+			const double angle = -2. * std::numbers::pi * static_cast<double>(k) / static_cast<double>(size);
+			m_twiddles[k] = Complex(static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)));
+		}
+		for (std::size_t i = 1, j = 0; i < size; ++i) {
+			std::size_t bit = size >> 1;
+			for (; j & bit; bit >>= 1) {
+				j ^= bit;
+			}
+			j ^= bit;
+			m_reversed[i] = j;
+		}
+	}
+
+	// The inverse is scaled.
+	void operator()(std::vector<Complex>& data, bool inverse) const {
+		const std::size_t n = m_reversed.size();
+		for (std::size_t i = 1; i < n; ++i) {
+			if (i < m_reversed[i]) {
+				std::swap(data[i], data[m_reversed[i]]);
+			}
+		}
+		for (std::size_t length = 2; length <= n; length <<= 1) {
+			const std::size_t half = length / 2;
+			const std::size_t stride = n / length;
+			for (std::size_t i = 0; i < n; i += length) {
+				for (std::size_t k = 0; k < half; ++k) {
+					const Complex w = inverse ? std::conj(m_twiddles[k * stride]) : m_twiddles[k * stride];
+					const Complex u = data[i + k];
+					const Complex v = data[i + k + half] * w;
+					data[i + k] = u + v;
+					data[i + k + half] = u - v;
+				}
+			}
+		}
+		if (inverse) {
+			const float scale = 1.f / static_cast<float>(n);
+			for (Complex& x : data) {
+				x *= scale;
+			}
+		}
+	}
+
+private:
+	std::vector<Complex>     m_twiddles;
+	std::vector<std::size_t> m_reversed;
+};
+
+// `res[d] = sum(a[k] * b[d + k])` for `d` in [0, count).
+std::vector<float> correlate(const float* a, std::size_t aCount, const float* b, std::size_t bCount, std::size_t count) {
+	const Fft fft(getPowerOfTwo(aCount + bCount));
+	std::vector<Complex> fa(getPowerOfTwo(aCount + bCount));
+	std::vector<Complex> fb(fa.size());
+	std::copy_n(a, aCount, fa.begin());
+	std::copy_n(b, bCount, fb.begin());
+	fft(fa, false);
+	fft(fb, false);
+	for (std::size_t i = 0; i < fa.size(); ++i) {
+		fb[i] *= std::conj(fa[i]);
+	}
+	fft(fb, true);
+
+	std::vector<float> res(count);
+	for (std::size_t d = 0; d < count; ++d) {
+		res[d] = fb[d].real();
+	}
+	return res;
+}
+
+template <typename F>
+void parallelFor(std::size_t count, unsigned int threadCount, F&& work) {
+	std::atomic<std::size_t> next{ 0 };
+	const auto run = [&]() {
+		for (std::size_t i = next++; i < count; i = next++) {
+			work(i);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (std::size_t i = 1; i < std::min<std::size_t>(threadCount, count); ++i) {
+		workers.emplace_back(run);
+	}
+	run();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+// Shape of a spectrum: log band energies, centered and scaled to unit length,
+// so that a fade or a change of level doesn't break a match.
+class Bands {
+public:
+	Bands(std::size_t window, double rate) :
+		m_weights(window),
+		m_fft(window) {
+		for (std::size_t i = 0; i < window; ++i) {
+			m_weights[i] = static_cast<float>(0.5 - 0.5 * std::cos(2. * std::numbers::pi * static_cast<double>(i) / static_cast<double>(window)));
+		}
+		const double high = std::min(12000., rate / 2.);
+		for (std::size_t b = 0; b <= BandCount; ++b) {
+			const double frequency = 60. * std::pow(high / 60., static_cast<double>(b) / BandCount);
+			m_edges[b] = std::max(static_cast<std::size_t>(frequency * static_cast<double>(window) / rate), b == 0 ? 1 : m_edges[b - 1] + 1);
+		}
+	}
+
+	// Writes `BandCount` values, returns the level of the window in dB.
+	float getShape(const float* in, float* shape, std::vector<Complex>& buffer) const {
+		const std::size_t window = m_weights.size();
+		buffer.resize(window);
+		for (std::size_t i = 0; i < window; ++i) {
+			buffer[i] = in[i] * m_weights[i];
+		}
+		m_fft(buffer, false);
+
+		double total = 0.;
+		float mean = 0.f;
+		for (std::size_t b = 0; b < BandCount; ++b) {
+			double energy = 0.;
+			for (std::size_t i = m_edges[b]; i < std::min(m_edges[b + 1], window / 2); ++i) {
+				energy += std::norm(buffer[i]);
+			}
+			total += energy;
+			shape[b] = static_cast<float>(10. * std::log10(energy + 1e-10));
+			mean += shape[b];
+		}
+		mean /= BandCount;
+		float length = 0.f;
+		for (std::size_t b = 0; b < BandCount; ++b) {
+			shape[b] -= mean;
+			length += shape[b] * shape[b];
+		}
+		length = std::sqrt(length);
+		for (std::size_t b = 0; b < BandCount; ++b) {
+			shape[b] = length > 1e-6f ? shape[b] / length : 0.f;
+		}
+		return static_cast<float>(10. * std::log10(total + 1e-10));
+	}
+
+private:
+	std::vector<float> m_weights;
+	std::size_t        m_edges[BandCount + 1]{};
+	Fft                m_fft;
+};
+
+// Shapes of the spectrum of every hop.
+struct Spectra {
+	std::size_t        count = 0;
+	std::vector<float> shapes;   // `BandCount` per hop.
+	std::vector<bool>  silent;
+
+	float getSimilarity(std::size_t a, std::size_t b) const {
+		if (silent[a] || silent[b]) {
+			return silent[a] && silent[b] ? 1.f : 0.f;
+		}
+		float res = 0.f;
+		for (std::size_t i = 0; i < BandCount; ++i) {
+			res += shapes[a * BandCount + i] * shapes[b * BandCount + i];
+		}
+		return res;
+	}
+};
+
+Spectra analyze(const std::vector<float>& mono, unsigned int sampleRate, unsigned int threadCount) {
+	Spectra res;
+	res.count = mono.size() >= Window ? (mono.size() - Window) / Hop + 1 : 0;
+	res.shapes.assign(res.count * BandCount, 0.f);
+	res.silent.assign(res.count, false);
+
+	// The spectra are taken around 11 kHz, the shape of the lower half of the spectrum is enough to tell parts apart
+	std::size_t factor = 1;
+	while (factor < 8 && sampleRate / (factor * 2) >= 11025) {
+		factor *= 2;
+	}
+	std::vector<float> reduced(mono.size() / factor);
+	for (std::size_t i = 0; i < reduced.size(); ++i) {
+		float sum = 0.f;
+		for (std::size_t k = 0; k < factor; ++k) {
+			sum += mono[i * factor + k];
+		}
+		reduced[i] = sum / static_cast<float>(factor);
+	}
+	const std::size_t hop = Hop / factor;
+	const Bands bands(Window / factor, static_cast<double>(sampleRate) / static_cast<double>(factor));
+
+	std::vector<float> levels(res.count);
+	constexpr std::size_t HopsPerTask = 256;
+	parallelFor((res.count + HopsPerTask - 1) / HopsPerTask, threadCount, [&](std::size_t task) {
+		std::vector<Complex> buffer;
+		for (std::size_t t = task * HopsPerTask; t < std::min(res.count, (task + 1) * HopsPerTask); ++t) {
+			levels[t] = bands.getShape(reduced.data() + t * hop, res.shapes.data() + t * BandCount, buffer);
+		}
+	});
+
+	// Anything 50 dB under the loudest spectrum counts as silence
+	const float loudest = res.count != 0 ? *std::max_element(levels.begin(), levels.end()) : 0.f;
+	for (std::size_t t = 0; t < res.count; ++t) {
+		res.silent[t] = levels[t] < loudest - 50.f;
+	}
+	return res;
+}
+
+struct Match {
+	std::size_t start;  // Hop.
+	std::size_t length; // Hops.
+	float       score;
+};
+
+// Locates the tail of the music earlier in it, and follows each match back to where the repetition starts.
+std::vector<Match> findMatches(const Spectra& spectra, unsigned int sampleRate, std::size_t maxCount, unsigned int threadCount) {
+	const std::size_t second = sampleRate / Hop;
+	std::size_t end = spectra.count;
+	while (end > 0 && spectra.silent[end - 1]) {
+		--end;
+	}
+	const std::size_t templateCount = std::min(4 * second, end / 4);
+	const std::size_t minLength = std::max(templateCount, 2 * second);
+	if (templateCount < RunWindow || end < templateCount + minLength + 1) {
+		return {};
+	}
+	const std::size_t tail = end - templateCount;
+	const std::size_t positions = tail - minLength + 1;
+
+	// One cross-correlation per band, summed into the mean similarity of the tail at each position
+	std::vector<std::vector<float>> bands(BandCount);
+	parallelFor(BandCount, threadCount, [&](std::size_t b) {
+		std::vector<float> track(end);
+		std::vector<float> pattern(templateCount);
+		for (std::size_t t = 0; t < end; ++t) {
+			track[t] = spectra.shapes[t * BandCount + b];
+		}
+		std::copy(track.begin() + tail, track.end(), pattern.begin());
+		bands[b] = correlate(pattern.data(), pattern.size(), track.data(), track.size(), positions);
+	});
+	std::vector<float> scores(positions, 0.f);
+	for (const std::vector<float>& band : bands) {
+		for (std::size_t p = 0; p < positions; ++p) {
+			scores[p] += band[p] / templateCount;
+		}
+	}
+
+	// Best peaks, at least a second apart
+	std::vector<std::size_t> peaks;
+	for (std::size_t p = 0; p < positions; ++p) {
+		if (scores[p] >= PeakThreshold && (p == 0 || scores[p] >= scores[p - 1]) && (p + 1 == positions || scores[p] >= scores[p + 1])) {
+			peaks.push_back(p);
+		}
+	}
+	std::sort(peaks.begin(), peaks.end(), [&scores](std::size_t a, std::size_t b) {
+		return scores[a] > scores[b];
+	});
+	std::vector<Match> res;
+	for (const std::size_t p : peaks) {
+		if (res.size() == maxCount) {
+			break;
+		}
+		const std::size_t length = tail - p;
+		if (std::any_of(res.begin(), res.end(), [&](const Match& match) { return match.length + second > length && length + second > match.length; })) {
+			continue;
+		}
+
+		// Back while the spectra a loop length apart stay alike
+		std::size_t start = p;
+		float sum = 0.f;
+		for (std::size_t k = 0; k < RunWindow; ++k) {
+			sum += spectra.getSimilarity(p + k, p + k + length);
+		}
+		while (start > 0) {
+			const float next = sum + spectra.getSimilarity(start - 1, start - 1 + length) - spectra.getSimilarity(start - 1 + RunWindow, start - 1 + RunWindow + length);
+			if (next / RunWindow < MatchThreshold) {
+				break;
+			}
+			sum = next;
+			--start;
+		}
+		// The average lets the window run over the edge of the repetition, trim what doesn't match on its own
+		while (start < p && spectra.getSimilarity(start, start + length) < MatchThreshold) {
+			++start;
+		}
+		res.push_back({ start, length, scores[p] });
+	}
+	return res;
+}
+
+// Moves the loop end by up to a hop, to where the waveform continues the loop start best.
+float alignSeam(const std::vector<float>& mono, std::uint64_t start, std::uint64_t& end) {
+	constexpr std::size_t Count = 4096;
+	if (end < Hop || end + Hop + Count > mono.size()) {
+		return -1.f;
+	}
+
+	const float* a = mono.data() + start;
+	const float* b = mono.data() + end - Hop;
+	double energy = 0.;
+	for (std::size_t k = 0; k < Count; ++k) {
+		energy += a[k] * a[k];
+	}
+	if (energy < 1e-6) {
+		return -1.f;
+	}
+
+	const std::vector<float> products = correlate(a, Count, b, 2 * Hop + Count, 2 * Hop + 1);
+	std::vector<double> sums(2 * Hop + Count + 1, 0.);
+	for (std::size_t k = 0; k < 2 * Hop + Count; ++k) {
+		sums[k + 1] = sums[k] + b[k] * b[k];
+	}
+	float best = -1.f;
+	std::size_t shift = Hop;
+	for (std::size_t d = 0; d <= 2 * Hop; ++d) {
+		const double other = sums[d + Count] - sums[d];
+		const float similarity = other > 1e-9 ? static_cast<float>(products[d] / std::sqrt(energy * other)) : 0.f;
+		if (similarity > best) {
+			best = similarity;
+			shift = d;
+		}
+	}
+	end = end - Hop + shift;
+	return best;
+}
+}
+
+std::vector<LoopCandidate> findLoopPoints(const std::filesystem::path& filename, std::size_t maxCount, unsigned int threadCount) {
+	InputSoundFile file;
+	if (!file.openFromFile(filename) || file.getChannelCount() == 0) {
+		err() << "Failed to open file to find its loop points: " << filename << std::endl;
+		return {};
+	}
+	std::vector<std::int16_t> samples(static_cast<std::size_t>(file.getSampleCount()));
+	samples.resize(static_cast<std::size_t>(file.read(samples.data(), samples.size())));
+	return findLoopPoints(samples.data(), samples.size(), file.getChannelCount(), file.getSampleRate(), maxCount, threadCount);
+}
+
+std::vector<LoopCandidate> findLoopPoints(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount, unsigned int sampleRate,
+	std::size_t maxCount, unsigned int threadCount) {
+	if (channelCount == 0 || sampleRate < Hop || maxCount == 0) {
+		return {};
+	}
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	std::vector<float> mono(static_cast<std::size_t>(sampleCount / channelCount));
+	for (std::size_t i = 0; i < mono.size(); ++i) {
+		int sum = 0;
+		for (unsigned int c = 0; c < channelCount; ++c) {
+			sum += samples[i * channelCount + c];
+		}
+		mono[i] = static_cast<float>(sum) / (32768.f * static_cast<float>(channelCount));
+	}
+
+	const Spectra spectra = analyze(mono, sampleRate, threadCount);
+	const std::vector<Match> matches = findMatches(spectra, sampleRate, maxCount, threadCount);
+
+	std::vector<LoopCandidate> res(matches.size());
+	parallelFor(matches.size(), threadCount, [&](std::size_t i) {
+		const Match& match = matches[i];
+		// A hop into the repetition, unless it goes back to the very beginning
+		const std::uint64_t start = match.start == 0 ? 0 : (match.start + 1) * Hop;
+		std::uint64_t end = start + match.length * Hop;
+		const float seam = alignSeam(mono, start, end);
+		end = std::min<std::uint64_t>(end, mono.size());
+
+		res[i].samplePoints = { start * channelCount, (end - start) * channelCount };
+		res[i].confidence = std::clamp(match.score, 0.f, 1.f) * (seam < 0.f ? 1.f : std::clamp(seam, 0.f, 1.f));
+	});
+	std::stable_sort(res.begin(), res.end(), [](const LoopCandidate& a, const LoopCandidate& b) {
+		return a.confidence > b.confidence;
+	});
+	return res;
+}
+
+bool SeamReport::isSuspicious() const {
+	return (jump > JumpThreshold && jump > JumpRatio * typicalStep) || spectralDistance > (repeated ? RepeatThreshold : ContinuityThreshold);
+}
+
+bool checkLoopSeam(const std::filesystem::path& filename, SeamReport& report) {
+	sf::FileInputStream stream;
+	if (!stream.open(filename)) {
+		err() << "Failed to open file to check its loop: " << filename << std::endl;
+		return false;
+	}
+	const std::any points = readLoopPoints(stream);
+	InputSoundFile file;
+	if (!points.has_value() || !stream.seek(0).has_value() || !file.openFromStream(stream) || file.getChannelCount() == 0) {
+		err() << "Failed to read loop of file: " << filename << std::endl;
+		return false;
+	}
+
+	// Same rounding as `Music::setLoopPoints`
+	const std::uint64_t channelCount = file.getChannelCount();
+	const std::uint64_t sampleCount = file.getSampleCount();
+	Span<std::uint64_t> samplePoints{};
+	if (points.type() == typeid(Span<std::uint64_t>)) {
+		samplePoints = std::any_cast<Span<std::uint64_t>>(points);
+	}
+	else if (points.type() == typeid(Span<Time>)) {
+		const Span<Time> timePoints = std::any_cast<Span<Time>>(points);
+		const auto toSamples = [&](Time time) {
+			return static_cast<std::uint64_t>((time.asMicroseconds() * file.getSampleRate() * channelCount + 500000) / 1000000);
+		};
+		samplePoints = { toSamples(timePoints.offset), toSamples(timePoints.length) };
+	}
+	samplePoints.offset = (samplePoints.offset + channelCount - 1) / channelCount * channelCount;
+	samplePoints.length = (samplePoints.length + channelCount - 1) / channelCount * channelCount;
+	if (samplePoints.offset >= sampleCount || samplePoints.length == 0) {
+		err() << "Loop points out of the music: " << filename << std::endl;
+		return false;
+	}
+	samplePoints.length = std::min(samplePoints.length, sampleCount - samplePoints.offset);
+
+	// Only a window after the loop start, and one on each side of the loop end
+	const std::uint64_t start = samplePoints.offset / channelCount;
+	const std::uint64_t end = (samplePoints.offset + samplePoints.length) / channelCount;
+	const std::uint64_t before = std::min<std::uint64_t>(end, Window);
+	std::vector<std::int16_t> head(Window * channelCount);
+	std::vector<std::int16_t> tail(2 * Window * channelCount);
+	file.seek(start * channelCount);
+	head.resize(static_cast<std::size_t>(file.read(head.data(), head.size())));
+	file.seek((end - before) * channelCount);
+	tail.resize(static_cast<std::size_t>(file.read(tail.data(), tail.size())));
+	const std::size_t headFrames = head.size() / channelCount;
+	const std::size_t tailFrames = tail.size() / channelCount;
+	if (headFrames == 0 || tailFrames < before) {
+		err() << "Failed to read loop of file: " << filename << std::endl;
+		return false;
+	}
+
+	// The sample played after the loop end is the loop start
+	report = SeamReport{};
+	report.samplePoints = samplePoints;
+	for (std::size_t c = 0; c < channelCount; ++c) {
+		const auto at = [&](const std::vector<std::int16_t>& samples, std::size_t frame) {
+			return static_cast<float>(samples[frame * channelCount + c]) / 32768.f;
+		};
+		const auto getStep = [&](const std::vector<std::int16_t>& samples, std::size_t from, std::size_t to) {
+			float sum = 0.f;
+			for (std::size_t i = from + 1; i < to; ++i) {
+				sum += std::abs(at(samples, i) - at(samples, i - 1));
+			}
+			return to > from + 1 ? sum / static_cast<float>(to - from - 1) : 0.f;
+		};
+		if (before != 0) {
+			report.jump = std::max(report.jump, std::abs(at(head, 0) - at(tail, before - 1)));
+		}
+		report.typicalStep = std::max({ report.typicalStep,
+			getStep(head, 0, std::min(headFrames, StepFrames)), getStep(tail, before - std::min<std::size_t>(before, StepFrames), before) });
+	}
+
+	// What follows the loop end should sound like the loop start, otherwise the spectrum shouldn't change much across the seam
+	const auto toMono = [&](const std::vector<std::int16_t>& samples, std::size_t frame, std::size_t count) {
+		std::vector<float> res(Window, 0.f);
+		for (std::size_t i = 0; i < std::min(count, Window); ++i) {
+			float sum = 0.f;
+			for (std::size_t c = 0; c < channelCount; ++c) {
+				sum += samples[(frame + i) * channelCount + c];
+			}
+			res[i] = sum / (32768.f * static_cast<float>(channelCount));
+		}
+		return res;
+	};
+	report.repeated = tailFrames >= before + Window;
+	const std::vector<float> after = toMono(head, 0, headFrames);
+	const std::vector<float> compared = report.repeated ? toMono(tail, before, Window) : toMono(tail, 0, before);
+	const Bands bands(Window, file.getSampleRate());
+	std::vector<Complex> buffer;
+	float a[BandCount];
+	float b[BandCount];
+	const bool silentA = bands.getShape(after.data(), a, buffer) < -60.f;
+	const bool silentB = bands.getShape(compared.data(), b, buffer) < -60.f;
+	if (silentA || silentB) {
+		report.spectralDistance = silentA == silentB ? 0.f : 1.f;
+	}
+	else {
+		float similarity = 0.f;
+		for (std::size_t i = 0; i < BandCount; ++i) {
+			similarity += a[i] * b[i];
+		}
+		report.spectralDistance = 1.f - similarity;
+	}
+	return true;
+}
+
+std::vector<std::optional<SeamReport>> checkLoopSeams(const std::vector<std::filesystem::path>& files, unsigned int threadCount) {
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	std::vector<std::optional<SeamReport>> res(files.size());
+	parallelFor(files.size(), threadCount, [&](std::size_t i) {
+		SeamReport report;
+		if (checkLoopSeam(files[i], report)) {
+			res[i] = report;
+		}
+	});
+	return res;
+}
+
+}
@@ -0,0 +1,75 @@
+﻿#pragma once
+
+#include "BgmHeader.h"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace bgm {
+
+// Loop points proposed for a music, in the samples `Music::setLoopPoints` takes.
+struct LoopCandidate {
+	Span<std::uint64_t> samplePoints;
+	float               confidence = 0.f; // 0 to 1.
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Propose loop points for a music without loop tags
+///
+/// Looks for the end of the music repeating an earlier part of
+/// it, the way looped musics are exported: the tail of the file
+/// is located earlier in the music by FFT cross-correlation of
+/// their spectra, the match is followed back to where the
+/// repetition starts, and the seam is then aligned to the sample
+/// by cross-correlating the waveforms. A music ending exactly at
+/// its loop end repeats nothing and gets no candidate.
+///
+/// \param filename    Music to analyze, decoded whole
+/// \param maxCount    Most candidates returned
+/// \param threadCount Threads sharing the analysis, 0 for one per core
+///
+/// \return Candidates, best first, empty if nothing repeats
+///
+////////////////////////////////////////////////////////////
+[[nodiscard]] std::vector<LoopCandidate> findLoopPoints(const std::filesystem::path& filename, std::size_t maxCount = 5, unsigned int threadCount = 0);
+
+// Same, on interleaved samples already decoded.
+[[nodiscard]] std::vector<LoopCandidate> findLoopPoints(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount, unsigned int sampleRate,
+	std::size_t maxCount = 5, unsigned int threadCount = 0);
+
+////////////////////////////////////////////////////////////
+/// \brief How well the end of a loop runs into its start
+///
+////////////////////////////////////////////////////////////
+struct SeamReport {
+	Span<std::uint64_t> samplePoints;           //!< Loop checked, in samples
+	float               jump = 0.f;             //!< Largest step of a channel across the seam, full scale being 1
+	float               typicalStep = 0.f;      //!< Mean step of the samples on either side of the seam
+	float               spectralDistance = 0.f; //!< 0 when the spectra compared have the same shape, up to 2
+	bool                repeated = false;       //!< Whether the music goes on past the loop end, so that what follows both ends was compared
+
+	// Whether the seam likely clicks or changes abruptly.
+	[[nodiscard]] bool isSuspicious() const;
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Check the seam of the loop of a music
+///
+/// The loop points are read from the tags, then only a few
+/// thousand samples are decoded after seeking to each end of
+/// the loop.
+///
+/// \param filename Music to check
+/// \param report   Receives the measures of the seam
+///
+/// \return `true` if the music has loop points and could be read
+///
+////////////////////////////////////////////////////////////
+[[nodiscard]] bool checkLoopSeam(const std::filesystem::path& filename, SeamReport& report);
+
+// Same, for each file, on `threadCount` workers (0 for one per core); failed files are left empty.
+std::vector<std::optional<SeamReport>> checkLoopSeams(const std::vector<std::filesystem::path>& files, unsigned int threadCount = 0);
+
+}
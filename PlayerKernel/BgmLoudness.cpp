@@ -0,0 +1,312 @@
+﻿#include "BgmLoudness.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <numbers>
+#include <string>
+#include <thread>
+
+namespace bgm {
+
+namespace {
+constexpr char LoudnessMagic[8] = { 'O', 'H', 'M', 'S', 'L', 'U', 'D', '2' };
+
+constexpr double AbsoluteGate = -70.; // LUFS.
+constexpr double RelativeGate = -10.; // LU below the loudness of the blocks over the absolute gate.
+
+double toLoudness(double energy) {
+	return -0.691 + 10. * std::log10(energy);
+}
+
+// 4 phases of a 48-tap windowed-sinc interpolator, as in BS.1770 annex 2; each phase sums to 1.
+const std::array<std::array<float, 12>, 4>& getInterpolator() {
+	static const std::array<std::array<float, 12>, 4> phases = []() {
+		std::array<std::array<float, 12>, 4> res{};
+		constexpr int Length = 48;
+		for (int p = 0; p < 4; ++p) {
+			double sum = 0.;
+			std::array<double, 12> taps{};
+			for (int k = 0; k < 12; ++k) {
+				const int i = p + 4 * k;
+				const double t = (i - (Length - 1) / 2.) / 4.;
+				const double sinc = t == 0. ? 1. : std::sin(std::numbers::pi * t) / (std::numbers::pi * t);
+				const double window = 0.42 - 0.5 * std::cos(2. * std::numbers::pi * i / (Length - 1)) + 0.08 * std::cos(4. * std::numbers::pi * i / (Length - 1));
+				taps[k] = sinc * window;
+				sum += taps[k];
+			}
+			for (int k = 0; k < 12; ++k) {
+				res[p][k] = static_cast<float>(taps[k] / sum);
+			}
+		}
+		return res;
+	}();
+	return phases;
+}
+}
+
+float Loudness::getGain(double target, double ceiling) const {
+	if (integrated <= AbsoluteGate) {
+		return 1.f; // Silent, nothing to match.
+	}
+	const double gain = std::min(target - integrated, ceiling - truePeak);
+	return static_cast<float>(std::pow(10., gain / 20.));
+}
+
+LoudnessMeter::LoudnessMeter(unsigned int channelCount, unsigned int sampleRate) :
+	m_channelCount(std::max(channelCount, 1u)),
+	m_sampleRate(std::max(sampleRate, 1u)),
+	m_weights(m_channelCount, 1.),
+	m_state(m_channelCount * 4, 0.),
+	m_sums(m_channelCount, 0.),
+	m_history(m_channelCount * (Taps - 1), 0.f),
+	m_block(Taps - 1 + BlockFrames + Lanes - 1),
+	m_subblockFrames(std::max<std::size_t>(m_sampleRate / 10, 1)) {
+	// K-weighting at any sample rate, from the analog prototype of the 48 kHz coefficients of BS.1770
+	const double rate = m_sampleRate;
+	{
+		const double f0 = 1681.974450955533;
+		const double g = 3.999843853973347;
+		const double q = 0.7071752369554196;
+		const double k = std::tan(std::numbers::pi * f0 / rate);
+		const double vh = std::pow(10., g / 20.);
+		const double vb = std::pow(vh, 0.4996667741545416);
+		const double a0 = 1. + k / q + k * k;
+		m_shelf[0] = (vh + vb * k / q + k * k) / a0;
+		m_shelf[1] = 2. * (k * k - vh) / a0;
+		m_shelf[2] = (vh - vb * k / q + k * k) / a0;
+		m_shelf[3] = 2. * (k * k - 1.) / a0;
+		m_shelf[4] = (1. - k / q + k * k) / a0;
+	}
+	{
+		const double f0 = 38.13547087602444;
+		const double q = 0.5003270373238773;
+		const double k = std::tan(std::numbers::pi * f0 / rate);
+		const double a0 = 1. + k / q + k * k;
+		m_highPass[0] = 1.;
+		m_highPass[1] = -2.;
+		m_highPass[2] = 1.;
+		m_highPass[3] = 2. * (k * k - 1.) / a0;
+		m_highPass[4] = (1. - k / q + k * k) / a0;
+	}
+
+	// 5.1: the LFE is left out and the surrounds weigh more
+	if (m_channelCount == 6) {
+		m_weights = { 1., 1., 1., 0., 1.41, 1.41 };
+	}
+}
+
+void LoudnessMeter::add(const std::int16_t* samples, std::size_t frameCount) {
+	m_frameCount += frameCount;
+	while (frameCount != 0) {
+		// A block never spans two 100 ms sub-blocks
+		const std::size_t count = std::min({ frameCount, m_subblockFrames - m_subblockFilled, BlockFrames });
+		for (unsigned int c = 0; c < m_channelCount; ++c) {
+			addChannel(samples + c, count, c);
+		}
+		samples += count * m_channelCount;
+		frameCount -= count;
+
+		if ((m_subblockFilled += count) == m_subblockFrames) {
+			double energy = 0.;
+			for (unsigned int c = 0; c < m_channelCount; ++c) {
+				energy += m_weights[c] * m_sums[c] / static_cast<double>(m_subblockFrames);
+				m_sums[c] = 0.;
+			}
+			m_subblocks[m_subblockCount++ % 4] = energy;
+			if (m_subblockCount >= 4) {
+				m_blocks.push_back((m_subblocks[0] + m_subblocks[1] + m_subblocks[2] + m_subblocks[3]) / 4.);
+			}
+			m_subblockFilled = 0;
+		}
+	}
+}
+
+void LoudnessMeter::addChannel(const std::int16_t* samples, std::size_t frameCount, unsigned int channel) {
+	const unsigned int channelCount = m_channelCount;
+	float* history = m_history.data() + channel * (Taps - 1);
+	float* x = m_block.data() + (Taps - 1);
+	std::copy_n(history, Taps - 1, m_block.data());
+
+	// K-weighting, two biquads in a row
+	double* state = m_state.data() + channel * 4;
+	double s0 = state[0], s1 = state[1], s2 = state[2], s3 = state[3];
+	double sum = 0.;
+	float peak = m_peak;
+	for (std::size_t i = 0; i < frameCount; ++i) {
+		const std::int16_t sample = samples[i * channelCount];
+		x[i] = sample / 32768.f;
+		peak = std::max(peak, std::abs(x[i]));
+		const double in = sample / 32768.;
+		const double y1 = m_shelf[0] * in + s0;
+		s0 = m_shelf[1] * in - m_shelf[3] * y1 + s1;
+		s1 = m_shelf[2] * in - m_shelf[4] * y1;
+		const double y2 = m_highPass[0] * y1 + s2;
+		s2 = m_highPass[1] * y1 - m_highPass[3] * y2 + s3;
+		s3 = m_highPass[2] * y1 - m_highPass[4] * y2;
+		sum += y2 * y2;
+	}
+	state[0] = s0;
+	state[1] = s1;
+	state[2] = s2;
+	state[3] = s3;
+	m_sums[channel] += sum;
+
+	// True peak: every phase of the interpolator at every sample, each lane keeping its own maximum so that
+	// consecutive outputs are computed side by side
+	std::array<float, Lanes> peaks{};
+	for (const auto& phase : getInterpolator()) {
+		for (std::size_t i = 0; i < frameCount; i += Lanes) {
+			const std::size_t lanes = std::min(Lanes, frameCount - i);
+			std::array<float, Lanes> acc{};
+			for (std::size_t k = 0; k < Taps; ++k) {
+				for (std::size_t j = 0; j < Lanes; ++j) {
+					acc[j] += phase[k] * x[i + j - k];
+				}
+			}
+			for (std::size_t j = 0; j < lanes; ++j) {
+				peaks[j] = std::max(peaks[j], std::abs(acc[j]));
+			}
+		}
+	}
+	for (const float p : peaks) {
+		peak = std::max(peak, p);
+	}
+	m_peak = peak;
+	std::copy_n(x + frameCount - (Taps - 1), Taps - 1, history);
+}
+
+Loudness LoudnessMeter::getResult() const {
+	Loudness res;
+	res.frameCount = m_frameCount;
+	res.sampleRate = m_sampleRate;
+	if (m_peak > 0.f) {
+		res.truePeak = 20. * std::log10(static_cast<double>(m_peak));
+	}
+
+	// Gated twice: absolute, then relative to what passed the first gate
+	double sum = 0.;
+	std::size_t count = 0;
+	for (const double block : m_blocks) {
+		if (block > 0. && toLoudness(block) > AbsoluteGate) {
+			sum += block;
+			++count;
+		}
+	}
+	if (count == 0) {
+		return res;
+	}
+	const double relative = toLoudness(sum / static_cast<double>(count)) + RelativeGate;
+	sum = 0.;
+	count = 0;
+	for (const double block : m_blocks) {
+		if (block > 0. && toLoudness(block) > AbsoluteGate && toLoudness(block) > relative) {
+			sum += block;
+			++count;
+		}
+	}
+	if (count != 0) {
+		res.integrated = toLoudness(sum / static_cast<double>(count));
+	}
+	return res;
+}
+
+bool analyzeLoudness(const std::filesystem::path& filename, Loudness& loudness) {
+	InputSoundFile file;
+	if (!file.openFromFile(filename) || file.getChannelCount() == 0) {
+		err() << "Failed to open file to measure its loudness: " << filename << std::endl;
+		return false;
+	}
+
+	LoudnessMeter meter(file.getChannelCount(), file.getSampleRate());
+	std::vector<std::int16_t> samples(65536 * file.getChannelCount());
+	while (true) {
+		const std::uint64_t count = file.read(samples.data(), samples.size());
+		if (count == 0) {
+			break;
+		}
+		meter.add(samples.data(), static_cast<std::size_t>(count / file.getChannelCount()));
+	}
+	loudness = meter.getResult();
+	return true;
+}
+
+std::vector<std::optional<Loudness>> analyzeLoudness(const std::vector<std::filesystem::path>& files, unsigned int threadCount) {
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	std::vector<std::optional<Loudness>> res(files.size());
+	std::atomic<std::size_t> next{ 0 };
+	const auto work = [&]() {
+		for (std::size_t i = next++; i < files.size(); i = next++) {
+			Loudness loudness;
+			if (analyzeLoudness(files[i], loudness)) {
+				res[i] = loudness;
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (std::size_t i = 1; i < std::min<std::size_t>(threadCount, files.size()); ++i) {
+		workers.emplace_back(work);
+	}
+	work();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	return res;
+}
+
+std::filesystem::path getLoudnessSidecar(const std::filesystem::path& filename) {
+	return std::filesystem::path(filename).concat(".ohmsloud");
+}
+
+bool loadLoudness(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, Loudness& loudness) {
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+
+	char magic[8]{};
+	std::uint64_t size = 0;
+	std::int64_t time = 0;
+	Loudness res;
+	file.read(magic, 8);
+	file.read(reinterpret_cast<char*>(&size), 8);
+	file.read(reinterpret_cast<char*>(&time), 8);
+	file.read(reinterpret_cast<char*>(&res.integrated), 8);
+	file.read(reinterpret_cast<char*>(&res.truePeak), 8);
+	file.read(reinterpret_cast<char*>(&res.frameCount), 8);
+	file.read(reinterpret_cast<char*>(&res.sampleRate), 4);
+	if (!file || std::string(magic, 8) != std::string(LoudnessMagic, 8) || size != sourceSize || time != sourceTime) {
+		return false;
+	}
+	loudness = res;
+	return true;
+}
+
+bool saveLoudness(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, const Loudness& loudness) {
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		err() << "Failed to create loudness file: " << filename << std::endl;
+		return false;
+	}
+
+	file.write(LoudnessMagic, 8);
+	file.write(reinterpret_cast<const char*>(&sourceSize), 8);
+	file.write(reinterpret_cast<const char*>(&sourceTime), 8);
+	file.write(reinterpret_cast<const char*>(&loudness.integrated), 8);
+	file.write(reinterpret_cast<const char*>(&loudness.truePeak), 8);
+	file.write(reinterpret_cast<const char*>(&loudness.frameCount), 8);
+	file.write(reinterpret_cast<const char*>(&loudness.sampleRate), 4);
+	if (!file) {
+		err() << "Failed to write loudness file: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,82 @@
+﻿#pragma once
+
+#include "BgmHeader.h"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace bgm {
+
+////////////////////////////////////////////////////////////
+/// \brief Loudness of a music, per EBU R128 / ITU-R BS.1770
+///
+////////////////////////////////////////////////////////////
+struct Loudness {
+	double        integrated = -70.;  //!< Integrated loudness in LUFS, gated
+	double        truePeak = -144.;   //!< True peak in dBTP, 4x oversampled
+	std::uint64_t frameCount = 0;     //!< Sample frames measured
+	unsigned int  sampleRate = 0;
+
+	// Gain factor bringing the music to `target` LUFS, lowered to keep the true peak under `ceiling` dBTP.
+	[[nodiscard]] float getGain(double target, double ceiling = -1.) const;
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Measures the loudness of samples fed in order
+///
+/// Samples are measured in blocks, one channel at a time. The
+/// K-weighting filters are recursive, so each channel runs them
+/// sample after sample with their state in registers. The true
+/// peak interpolator reads the block converted to floats after
+/// the last samples of the previous block, and its outputs are
+/// independent, so the compiler vectorizes them.
+///
+////////////////////////////////////////////////////////////
+class LoudnessMeter final {
+public:
+	LoudnessMeter(unsigned int channelCount, unsigned int sampleRate);
+
+	void add(const std::int16_t* samples, std::size_t frameCount);
+
+	[[nodiscard]] Loudness getResult() const;
+
+private:
+	static constexpr std::size_t Taps = 12;          // Per phase of the true peak interpolator.
+	static constexpr std::size_t BlockFrames = 1024; // Frames measured per channel at once.
+	static constexpr std::size_t Lanes = 8;          // True peak outputs computed side by side.
+
+	void addChannel(const std::int16_t* samples, std::size_t frameCount, unsigned int channel);
+
+	unsigned int        m_channelCount;
+	unsigned int        m_sampleRate;
+	double              m_shelf[5]{};    // b0, b1, b2, a1, a2 of the high shelf.
+	double              m_highPass[5]{}; // Same for the high pass.
+	std::vector<double> m_weights;       // Per channel.
+	std::vector<double> m_state;         // 4 per channel, the two stages of the filter.
+	std::vector<double> m_sums;          // Per channel, filtered energy of the current 100 ms.
+	std::vector<float>  m_history;       // Last `Taps - 1` samples per channel, oldest first.
+	std::vector<float>  m_block;         // History of a channel, the samples of the block, room for the last lanes.
+	float               m_peak = 0.f;
+	std::size_t         m_subblockFrames;
+	std::size_t         m_subblockFilled = 0;
+	double              m_subblocks[4]{}; // Last four 100 ms energies, for the 400 ms blocks overlapping by 75%.
+	std::size_t         m_subblockCount = 0;
+	std::vector<double> m_blocks;         // Energy of every 400 ms block.
+	std::uint64_t       m_frameCount = 0;
+};
+
+// Decodes the whole file once.
+[[nodiscard]] bool analyzeLoudness(const std::filesystem::path& filename, Loudness& loudness);
+
+// Same, for each file, on `threadCount` workers (0 for one per core); failed files are left empty.
+std::vector<std::optional<Loudness>> analyzeLoudness(const std::vector<std::filesystem::path>& files, unsigned int threadCount = 0);
+
+// Sidecar file keeping the loudness next to the music, checked against the size and modification time of the music
+// (see `PcmCache::makeKey`).
+[[nodiscard]] std::filesystem::path getLoudnessSidecar(const std::filesystem::path& filename);
+bool loadLoudness(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, Loudness& loudness);
+bool saveLoudness(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime, const Loudness& loudness);
+
+}
@@ -0,0 +1,257 @@
+﻿#include "BgmPack.h"
+#include "BgmStream.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <SFML/System/FileInputStream.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace bgm {
+
+namespace {
+int compareName(const Pack::Entry& entry, std::string_view name) {
+	return entry.getName().compare(name);
+}
+}
+
+std::string_view Pack::Entry::getName() const {
+	return { name, strnlen(name, sizeof(name)) };
+}
+
+bool Pack::open(const std::filesystem::path& filename) {
+	m_path.clear();
+	m_file.reset();
+	m_entries.clear();
+	m_points.clear();
+
+	std::shared_ptr<const SharedFile> file = SharedFile::open(filename);
+	if (file == nullptr) {
+		err() << "Failed to open bgm pack: " << filename << std::endl;
+		return false;
+	}
+	const auto readAt = [&file](std::uint64_t position, void* data, std::size_t size) {
+		return file->read(position, data, size) == size;
+	};
+	Header header{};
+	if (!readAt(0, &header, sizeof(header)) || std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) {
+		err() << "Not a bgm pack: " << filename << std::endl;
+		return false;
+	}
+
+	// The sizes come from the file: both tables must fit in it before anything is allocated for them.
+	const std::uint64_t fileSize = file->getSize();
+	const std::uint64_t entriesEnd = sizeof(Header) + std::uint64_t{ header.entryCount } * sizeof(Entry);
+	if (entriesEnd > fileSize || header.pointsOffset < entriesEnd || header.pointsOffset > fileSize ||
+		header.pointCount > (fileSize - header.pointsOffset) / sizeof(SeekIndex::Point)) {
+		err() << "Bad tables in bgm pack: " << filename << std::endl;
+		return false;
+	}
+
+	// Both tables in one read each, no per entry work.
+	m_entries.resize(header.entryCount);
+	m_points.resize(static_cast<std::size_t>(header.pointCount));
+	if (!readAt(sizeof(Header), m_entries.data(), m_entries.size() * sizeof(Entry)) ||
+		!readAt(header.pointsOffset, m_points.data(), m_points.size() * sizeof(SeekIndex::Point))) {
+		err() << "Failed to read the tables of bgm pack: " << filename << std::endl;
+		m_entries.clear();
+		m_points.clear();
+		return false;
+	}
+
+	// `find` searches the names, and `openEntry` and `getSeekIndex` trust the ranges.
+	for (std::size_t i = 0; i < m_entries.size(); ++i) {
+		const Entry& entry = m_entries[i];
+		if (entry.offset > fileSize || entry.size > fileSize - entry.offset ||
+			entry.firstPoint > m_points.size() || entry.pointCount > m_points.size() - entry.firstPoint ||
+			(i != 0 && !(m_entries[i - 1].getName() < entry.getName()))) {
+			err() << "Bad entry in bgm pack: " << filename << ", " << entry.getName() << std::endl;
+			m_entries.clear();
+			m_points.clear();
+			return false;
+		}
+	}
+	m_file = std::move(file);
+	m_path = filename;
+	return true;
+}
+
+const Pack::Entry* Pack::find(std::string_view name) const {
+	auto it = std::lower_bound(m_entries.cbegin(), m_entries.cend(), name, [](const Entry& entry, std::string_view n) {
+		return compareName(entry, n) < 0;
+	});
+	return (it != m_entries.cend() && compareName(*it, name) == 0) ? &*it : nullptr;
+}
+
+const std::vector<Pack::Entry>& Pack::getEntries() const {
+	return m_entries;
+}
+
+const std::filesystem::path& Pack::getPath() const {
+	return m_path;
+}
+
+const std::shared_ptr<const SharedFile>& Pack::getFile() const {
+	return m_file;
+}
+
+std::any Pack::getLoopPoints(const Entry& entry) {
+	switch (entry.loopUnit) {
+	case LoopUnit::Samples:
+		return Span<std::uint64_t>{ entry.loopOffset, entry.loopLength };
+	case LoopUnit::Microseconds:
+		return Span<Time>{ microseconds(static_cast<std::int64_t>(entry.loopOffset)), microseconds(static_cast<std::int64_t>(entry.loopLength)) };
+	default:
+		return {};
+	}
+}
+
+void Pack::getSeekIndex(const Entry& entry, SeekIndex& index) const {
+	index.format = static_cast<SeekIndex::Format>(entry.indexFormat);
+	index.channelCount = entry.channelCount;
+	index.sampleRate = entry.sampleRate;
+	index.frameCount = entry.frameCount;
+	index.points.clear();
+	if (entry.firstPoint + entry.pointCount <= m_points.size()) {
+		const auto first = m_points.cbegin() + static_cast<std::ptrdiff_t>(entry.firstPoint);
+		index.points.assign(first, first + static_cast<std::ptrdiff_t>(entry.pointCount));
+	}
+}
+
+std::shared_ptr<InputStream> Pack::openEntry(std::shared_ptr<const SharedFile> file, const Entry& entry) {
+	if (file == nullptr || entry.offset + entry.size > file->getSize()) {
+		return nullptr;
+	}
+	return std::make_shared<SliceInputStream>(std::move(file), entry.offset, entry.size);
+}
+
+bool Pack::build(const std::filesystem::path& filename,
+				 const std::vector<std::pair<std::string, std::filesystem::path>>& files,
+				 std::uint32_t alignment) {
+	alignment = std::max<std::uint32_t>(alignment, 1);
+
+	// Only what the tables need; the payloads are copied from their files as the pack is written.
+	struct Item {
+		Entry                 entry{};
+		SeekIndex             index;
+		std::filesystem::path path;
+	};
+	std::vector<Item> items(files.size());
+
+	for (std::size_t i = 0; i < files.size(); ++i) {
+		const auto& [name, path] = files[i];
+		Item& item = items[i];
+		if (name.empty() || name.size() >= sizeof(item.entry.name)) {
+			err() << "Bad name for bgm pack entry: " << name << std::endl;
+			return false;
+		}
+		std::memcpy(item.entry.name, name.data(), name.size());
+
+		item.path = path;
+		sf::FileInputStream stream;
+		if (!stream.open(path) || stream.getSize().value_or(0) == 0) {
+			err() << "Failed to read file to pack: " << path << std::endl;
+			return false;
+		}
+		std::any points = readLoopPoints(stream, &item.index, true);
+		if (!points.has_value()) {
+			err() << "Failed to read comment of file to pack: " << path << std::endl;
+			return false;
+		}
+		if (points.type() == typeid(Span<std::uint64_t>)) {
+			const auto span = std::any_cast<Span<std::uint64_t>>(points);
+			item.entry.loopUnit = LoopUnit::Samples;
+			item.entry.loopOffset = span.offset;
+			item.entry.loopLength = span.length;
+		}
+		else if (points.type() == typeid(Span<Time>)) {
+			const auto span = std::any_cast<Span<Time>>(points);
+			item.entry.loopUnit = LoopUnit::Microseconds;
+			item.entry.loopOffset = static_cast<std::uint64_t>(span.offset.asMicroseconds());
+			item.entry.loopLength = static_cast<std::uint64_t>(span.length.asMicroseconds());
+		}
+
+		// Ogg files carry no stream info in their tags, ask the decoder.
+		if (item.index.sampleRate == 0 || item.index.channelCount == 0 || item.index.frameCount == 0) {
+			sf::InputSoundFile file;
+			(void)stream.seek(0);
+			if (!file.openFromStream(stream)) {
+				err() << "Failed to open file to pack: " << path << std::endl;
+				return false;
+			}
+			item.index.sampleRate = file.getSampleRate();
+			item.index.channelCount = file.getChannelCount();
+			item.index.frameCount = file.getSampleCount() / std::max(file.getChannelCount(), 1u);
+		}
+		item.entry.size = *stream.getSize();
+		item.entry.sampleRate = item.index.sampleRate;
+		item.entry.channelCount = item.index.channelCount;
+		item.entry.frameCount = item.index.frameCount;
+		item.entry.indexFormat = static_cast<std::uint32_t>(item.index.format);
+	}
+
+	std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+		return a.entry.getName() < b.entry.getName();
+	});
+	for (std::size_t i = 1; i < items.size(); ++i) {
+		if (items[i - 1].entry.getName() == items[i].entry.getName()) {
+			err() << "Duplicate name in bgm pack: " << items[i].entry.getName() << std::endl;
+			return false;
+		}
+	}
+
+	// Lay out the tables, then the payloads.
+	const auto align = [alignment](std::uint64_t position) {
+		return (position + alignment - 1) / alignment * alignment;
+	};
+	Header header{};
+	std::memcpy(header.magic, Magic, sizeof(Magic));
+	header.entryCount = static_cast<std::uint32_t>(items.size());
+	header.alignment = alignment;
+	header.pointsOffset = sizeof(Header) + items.size() * sizeof(Entry);
+	std::vector<SeekIndex::Point> points;
+	for (Item& item : items) {
+		item.entry.firstPoint = points.size();
+		item.entry.pointCount = item.index.points.size();
+		points.insert(points.end(), item.index.points.cbegin(), item.index.points.cend());
+	}
+	header.pointCount = points.size();
+
+	std::uint64_t position = align(header.pointsOffset + points.size() * sizeof(SeekIndex::Point));
+	for (Item& item : items) {
+		item.entry.offset = position;
+		position = align(position + item.entry.size);
+	}
+
+	std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	for (const Item& item : items) {
+		out.write(reinterpret_cast<const char*>(&item.entry), sizeof(Entry));
+	}
+	out.write(reinterpret_cast<const char*>(points.data()), static_cast<std::streamsize>(points.size() * sizeof(SeekIndex::Point)));
+	std::vector<char> buffer(1 << 20);
+	for (const Item& item : items) {
+		const std::streamoff padding = static_cast<std::streamoff>(item.entry.offset) - out.tellp();
+		for (std::streamoff i = 0; i < padding; ++i) {
+			out.put('\0');
+		}
+		// Exactly the size laid out, in case the file changed since it was scanned
+		std::ifstream in(item.path, std::ios::binary);
+		for (std::uint64_t left = item.entry.size; left != 0;) {
+			const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(left, buffer.size()));
+			if (!in.read(buffer.data(), static_cast<std::streamsize>(count))) {
+				err() << "Failed to read file to pack: " << item.path << std::endl;
+				return false;
+			}
+			out.write(buffer.data(), static_cast<std::streamsize>(count));
+			left -= count;
+		}
+	}
+	if (!out.flush()) {
+		err() << "Failed to write bgm pack: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+}
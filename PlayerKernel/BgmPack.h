@@ -0,0 +1,102 @@
+﻿#pragma once
+
+#include "BgmHeader.h"
+#include <any>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace bgm {
+
+class SharedFile;
+
+////////////////////////////////////////////////////////////
+/// \brief Many musics stored in one file, opened by name
+///
+/// The pack starts with a header and a table of fixed-size
+/// entries sorted by name, followed by the seek points of all
+/// entries, then the Ogg/FLAC files themselves, unchanged and
+/// aligned. Everything found by reading the tags of a music
+/// (loop points, stream info, seek points) is parsed when the
+/// pack is built, so opening an entry reads none of it.
+///
+/// The tables are little-endian and laid out like the structs
+/// below, so they can be read or mapped as they are.
+///
+////////////////////////////////////////////////////////////
+class Pack final {
+public:
+	static constexpr char Magic[8] = { 'O', 'H', 'M', 'S', 'P', 'A', 'K', '1' };
+
+	struct Header {
+		char          magic[8];
+		std::uint32_t entryCount;
+		std::uint32_t alignment;    // Of the payloads, in bytes.
+		std::uint64_t pointsOffset; // Position of the seek point table.
+		std::uint64_t pointCount;
+		std::uint64_t reserved[4];
+	};
+
+	enum class LoopUnit : std::uint32_t {
+		None,
+		Samples,      // As in Span<std::uint64_t>.
+		Microseconds, // As in Span<Time>.
+	};
+
+	struct Entry {
+		char          name[88];     // UTF-8, zero padded, at most 87 bytes.
+		std::uint64_t offset;       // Position of the music in the pack.
+		std::uint64_t size;
+		std::uint64_t loopOffset;
+		std::uint64_t loopLength;
+		LoopUnit      loopUnit;
+		std::uint32_t sampleRate;
+		std::uint32_t channelCount;
+		std::uint32_t indexFormat;  // SeekIndex::Format.
+		std::uint64_t frameCount;
+		std::uint64_t firstPoint;   // Seek points of the music in the point table, offsets relative to the music.
+		std::uint64_t pointCount;
+
+		[[nodiscard]] std::string_view getName() const;
+	};
+
+	static_assert(sizeof(Header) == 64);
+	static_assert(sizeof(Entry) == 160);
+	static_assert(sizeof(SeekIndex::Point) == 16);
+
+	[[nodiscard]] bool open(const std::filesystem::path& filename);
+
+	// Binary search in the sorted table, nullptr if there is no such entry.
+	[[nodiscard]] const Entry* find(std::string_view name) const;
+
+	[[nodiscard]] const std::vector<Entry>& getEntries() const;
+	[[nodiscard]] const std::filesystem::path& getPath() const;
+
+	// Loop points of the entry, in the same form as `readLoopPoints` gives.
+	[[nodiscard]] static std::any getLoopPoints(const Entry& entry);
+	void getSeekIndex(const Entry& entry, SeekIndex& index) const;
+
+	// Handle on the pack file, opened once by `open` and shared by the streams of all entries.
+	[[nodiscard]] const std::shared_ptr<const SharedFile>& getFile() const;
+
+	// Stream reading only the music of the entry out of the shared handle, nullptr if there is none.
+	[[nodiscard]] static std::shared_ptr<InputStream> openEntry(std::shared_ptr<const SharedFile> file, const Entry& entry);
+
+	// Pack the files under the given names, which must be unique.
+	[[nodiscard]] static bool build(const std::filesystem::path& filename,
+									const std::vector<std::pair<std::string, std::filesystem::path>>& files,
+									std::uint32_t alignment = 4096);
+
+private:
+	std::filesystem::path             m_path;
+	std::shared_ptr<const SharedFile> m_file;
+	std::vector<Entry>                m_entries;
+	std::vector<SeekIndex::Point>     m_points;
+};
+
+}
@@ -0,0 +1,114 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace bgm {
+
+////////////////////////////////////////////////////////////
+/// \brief Bounded queue between one producer and one consumer thread
+///
+/// Neither side locks nor allocates: the items live in a ring of
+/// `Capacity` slots, and a full queue refuses the item.
+///
+////////////////////////////////////////////////////////////
+template <typename T, std::size_t Capacity>
+class SpscQueue {
+	static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	// Producer side, `false` if the queue is full.
+	bool push(const T& item) {
+		const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+		m_items[tail % Capacity] = item;
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Producer side, the item is only moved from if it is taken.
+	bool push(T&& item) {
+		const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+		m_items[tail % Capacity] = std::move(item);
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, empty if there is nothing to take.
+	std::optional<T> pop() {
+		const std::size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire)) {
+			return std::nullopt;
+		}
+		T item = std::move(m_items[head % Capacity]);
+		m_head.store(head + 1, std::memory_order_release);
+		return item;
+	}
+
+private:
+	std::array<T, Capacity>               m_items{};
+	alignas(64) std::atomic<std::size_t> m_head{ 0 }; // Next slot to pop, written by the consumer.
+	alignas(64) std::atomic<std::size_t> m_tail{ 0 }; // Next slot to push, written by the producer.
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Value written by one thread and read by any other
+///
+/// The writer never waits; a reader copies the value again if it
+/// was being written meanwhile. The value is kept in relaxed
+/// atomic words, so a torn copy is only ever thrown away.
+///
+////////////////////////////////////////////////////////////
+template <typename T>
+class Seqlock {
+	static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+
+public:
+	// Writer side.
+	void store(const T& value) {
+		std::uint64_t words[WordCount]{};
+		std::memcpy(words, &value, sizeof(T));
+		const std::uint32_t sequence = m_sequence.load(std::memory_order_relaxed);
+		m_sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (std::size_t i = 0; i < WordCount; ++i) {
+			m_words[i].store(words[i], std::memory_order_relaxed);
+		}
+		m_sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	// Reader side, from any thread.
+	T load() const {
+		std::uint64_t words[WordCount]{};
+		std::uint32_t sequence = 0;
+		do {
+			sequence = m_sequence.load(std::memory_order_acquire);
+			for (std::size_t i = 0; i < WordCount; ++i) {
+				words[i] = m_words[i].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while ((sequence & 1) != 0 || m_sequence.load(std::memory_order_relaxed) != sequence);
+		T value;
+		std::memcpy(&value, words, sizeof(T));
+		return value;
+	}
+
+private:
+	static constexpr std::size_t WordCount = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+	std::atomic<std::uint32_t>                        m_sequence{ 0 }; // Odd while being written.
+	std::array<std::atomic<std::uint64_t>, WordCount> m_words{};
+};
+
+}
@@ -0,0 +1,616 @@
+﻿#include "BgmStream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace bgm {
+
+RegionInputStream::RegionInputStream(std::shared_ptr<InputStream> source) :
+	m_source(std::move(source)) {
+	m_sourcePosition = m_source->tell();
+	m_position = m_sourcePosition.value_or(0);
+}
+
+void RegionInputStream::setRegion(Region region) {
+	m_region = std::move(region);
+}
+
+const RegionInputStream::Region& RegionInputStream::getRegion() const {
+	return m_region;
+}
+
+std::uint64_t RegionInputStream::getSourceReads() const {
+	return m_sourceReads;
+}
+
+std::optional<std::size_t> RegionInputStream::read(void* data, std::size_t size) {
+	std::size_t done = 0;
+	const std::uint64_t regionBegin = m_region.offset;
+	const std::uint64_t regionEnd = m_region.bytes != nullptr ? m_region.offset + m_region.bytes->size() : m_region.offset;
+
+	while (done < size) {
+		if (m_position >= regionBegin && m_position < regionEnd) {
+			// Inside the region, copy from memory
+			const std::size_t count = std::min<std::size_t>(size - done, static_cast<std::size_t>(regionEnd - m_position));
+			std::memcpy(static_cast<std::byte*>(data) + done, m_region.bytes->data() + (m_position - regionBegin), count);
+			done += count;
+			m_position += count;
+			continue;
+		}
+
+		// Outside of the region, read from the source up to the region
+		std::size_t count = size - done;
+		if (m_position < regionBegin) {
+			count = std::min<std::size_t>(count, static_cast<std::size_t>(regionBegin - m_position));
+		}
+		if (m_sourcePosition != m_position) {
+			if (auto r = m_source->seek(m_position); !r || *r != m_position) {
+				m_sourcePosition.reset();
+				return done != 0 ? std::optional<std::size_t>(done) : std::nullopt;
+			}
+		}
+		++m_sourceReads;
+		const std::optional<std::size_t> r = m_source->read(static_cast<std::byte*>(data) + done, count);
+		if (!r) {
+			m_sourcePosition.reset();
+			return done != 0 ? std::optional<std::size_t>(done) : std::nullopt;
+		}
+		done += *r;
+		m_position += *r;
+		m_sourcePosition = m_position;
+		if (*r < count) {
+			break; // End of file
+		}
+	}
+	return done;
+}
+
+std::optional<std::size_t> RegionInputStream::seek(std::size_t position) {
+	if (const std::optional<std::size_t> size = getSize(); size && position > *size) {
+		return std::nullopt;
+	}
+	m_position = position;
+	return m_position;
+}
+
+std::optional<std::size_t> RegionInputStream::tell() {
+	return m_position;
+}
+
+std::optional<std::size_t> RegionInputStream::getSize() {
+	return m_source->getSize();
+}
+
+SharedFile::~SharedFile() {
+	if (m_handle == -1) {
+		return;
+	}
+#ifdef _WIN32
+	CloseHandle(reinterpret_cast<HANDLE>(m_handle));
+#else
+	::close(static_cast<int>(m_handle));
+#endif
+}
+
+std::shared_ptr<const SharedFile> SharedFile::open(const std::filesystem::path& filename) {
+	std::shared_ptr<SharedFile> res(new SharedFile());
+#ifdef _WIN32
+	HANDLE file = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	res->m_handle = reinterpret_cast<std::intptr_t>(file);
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size)) {
+		return nullptr;
+	}
+	res->m_size = static_cast<std::uint64_t>(size.QuadPart);
+#else
+	const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+	res->m_handle = fd;
+	struct stat st{};
+	if (fstat(fd, &st) != 0) {
+		return nullptr;
+	}
+	res->m_size = static_cast<std::uint64_t>(st.st_size);
+#endif
+	return res;
+}
+
+std::optional<std::size_t> SharedFile::read(std::uint64_t position, void* data, std::size_t size) const {
+	// Positioned reads leave the file pointer out of it, so that the threads don't race on it
+	std::size_t done = 0;
+	while (done < size && position + done < m_size) {
+		const std::size_t count = std::min<std::size_t>(size - done, 1u << 30);
+#ifdef _WIN32
+		OVERLAPPED at{};
+		at.Offset = static_cast<DWORD>(position + done);
+		at.OffsetHigh = static_cast<DWORD>((position + done) >> 32);
+		DWORD r = 0;
+		if (!ReadFile(reinterpret_cast<HANDLE>(m_handle), static_cast<std::byte*>(data) + done, static_cast<DWORD>(count), &r, &at) &&
+			GetLastError() != ERROR_HANDLE_EOF) {
+			return done != 0 ? std::optional<std::size_t>(done) : std::nullopt;
+		}
+#else
+		const ssize_t r = ::pread(static_cast<int>(m_handle), static_cast<std::byte*>(data) + done, count, static_cast<off_t>(position + done));
+		if (r < 0) {
+			return done != 0 ? std::optional<std::size_t>(done) : std::nullopt;
+		}
+#endif
+		if (r == 0) {
+			break;
+		}
+		done += static_cast<std::size_t>(r);
+	}
+	return done;
+}
+
+std::uint64_t SharedFile::getSize() const {
+	return m_size;
+}
+
+SliceInputStream::SliceInputStream(std::shared_ptr<const SharedFile> file, std::uint64_t offset, std::uint64_t size) :
+	m_file(std::move(file)),
+	m_offset(offset),
+	m_size(size) {}
+
+std::optional<std::size_t> SliceInputStream::read(void* data, std::size_t size) {
+	const std::size_t count = std::min<std::size_t>(size, static_cast<std::size_t>(m_size - m_position));
+	if (count == 0) {
+		return 0;
+	}
+	const std::optional<std::size_t> r = m_file->read(m_offset + m_position, data, count);
+	if (!r) {
+		return std::nullopt;
+	}
+	m_position += *r;
+	return r;
+}
+
+std::optional<std::size_t> SliceInputStream::seek(std::size_t position) {
+	if (position > m_size) {
+		return std::nullopt;
+	}
+	m_position = position;
+	return m_position;
+}
+
+std::optional<std::size_t> SliceInputStream::tell() {
+	return m_position;
+}
+
+std::optional<std::size_t> SliceInputStream::getSize() {
+	return static_cast<std::size_t>(m_size);
+}
+
+ForwardInputStream::ForwardInputStream(std::shared_ptr<InputStream> source) :
+	m_source(std::move(source)) {}
+
+void ForwardInputStream::setProbing(bool probing) {
+	m_probing = probing;
+}
+
+void ForwardInputStream::release() {
+	m_keeping = false;
+	if (m_position >= m_kept.size()) {
+		std::vector<std::byte>().swap(m_kept);
+	}
+}
+
+std::size_t ForwardInputStream::getKeptSize() const {
+	return m_kept.size();
+}
+
+std::vector<std::byte> ForwardInputStream::takeKept() {
+	if (m_keeping || m_position < m_kept.size()) {
+		return {};
+	}
+	return std::move(m_kept);
+}
+
+std::optional<std::size_t> ForwardInputStream::readSource(void* data, std::size_t size) {
+	const std::optional<std::size_t> r = m_source->read(data, size);
+	if (r && m_keeping) {
+		m_kept.insert(m_kept.end(), static_cast<const std::byte*>(data), static_cast<const std::byte*>(data) + *r);
+	}
+	if (r) {
+		m_sourcePosition += *r;
+	}
+	return r;
+}
+
+std::optional<std::size_t> ForwardInputStream::read(void* data, std::size_t size) {
+	// Replay the kept bytes first, the source is right after them
+	std::size_t done = 0;
+	if (m_position < m_kept.size()) {
+		done = std::min(size, m_kept.size() - m_position);
+		std::memcpy(data, m_kept.data() + m_position, done);
+		m_position += done;
+	}
+	if (done < size) {
+		const std::optional<std::size_t> r = readSource(static_cast<std::byte*>(data) + done, size - done);
+		if (!r) {
+			return done != 0 ? std::optional<std::size_t>(done) : std::nullopt;
+		}
+		done += *r;
+		m_position += *r;
+	}
+	return done;
+}
+
+std::optional<std::size_t> ForwardInputStream::seek(std::size_t position) {
+	if (position == m_position) {
+		return m_probing ? std::nullopt : std::optional<std::size_t>(m_position);
+	}
+	if (position < m_sourcePosition) {
+		// Only the kept bytes can be read again
+		if (position > m_kept.size() || m_kept.size() != m_sourcePosition) {
+			return std::nullopt;
+		}
+		m_position = position;
+		return m_position;
+	}
+
+	m_position = m_sourcePosition;
+	std::byte skipped[4096];
+	while (m_position < position) {
+		const std::optional<std::size_t> r = readSource(skipped, std::min(sizeof(skipped), position - m_position));
+		if (!r || *r == 0) {
+			return std::nullopt;
+		}
+		m_position += *r;
+	}
+	return m_position;
+}
+
+std::optional<std::size_t> ForwardInputStream::tell() {
+	return m_position;
+}
+
+std::optional<std::size_t> ForwardInputStream::getSize() {
+	return m_source->getSize();
+}
+
+SharedMemoryInputStream::SharedMemoryInputStream(std::shared_ptr<const std::byte[]> data, std::size_t size) :
+	m_data(std::move(data)),
+	m_size(m_data != nullptr ? size : 0) {}
+
+std::optional<std::size_t> SharedMemoryInputStream::read(void* data, std::size_t size) {
+	const std::size_t count = std::min(size, m_size - m_position);
+	if (count != 0) {
+		std::memcpy(data, m_data.get() + m_position, count);
+	}
+	m_position += count;
+	return count;
+}
+
+std::optional<std::size_t> SharedMemoryInputStream::seek(std::size_t position) {
+	if (position > m_size) {
+		return std::nullopt;
+	}
+	m_position = position;
+	return m_position;
+}
+
+std::optional<std::size_t> SharedMemoryInputStream::tell() {
+	return m_position;
+}
+
+std::optional<std::size_t> SharedMemoryInputStream::getSize() {
+	return m_size;
+}
+
+struct ReadAheadInputStream::Block {
+	enum class State {
+		Free,      // Not read, or dropped before a worker took it.
+		Requested, // Waiting for a worker; the stream may still take it back.
+		Reading,   // A worker has it.
+		Ready,
+		Failed,
+	};
+
+	// Written by the stream before `Requested` is published, by the worker before `Ready` or `Failed` is.
+	// The workers compare the offsets of the blocks requested, which the stream may be taking back meanwhile.
+	std::atomic<std::uint64_t> offset{ 0 };
+	std::vector<std::byte>     data;
+	std::size_t                size = 0; // Bytes read, less than the block at the end of the file.
+	std::atomic<State>         state{ State::Free };
+	bool                       listed = false; // In the window, at `offset`; owned by the stream.
+
+	// Whether the stream can give it another offset: no worker has it or will take it.
+	bool isFree() const {
+		const State s = state.load(std::memory_order_acquire);
+		return s == State::Free || s == State::Ready || s == State::Failed;
+	}
+};
+
+struct ReadAheadInputStream::Shared {
+	std::shared_ptr<const SharedFile> file;   // Read at the offset of each block, by any number of workers at once.
+	std::vector<Block*>               blocks; // Set when opened.
+
+	// Owned by the reader pool, under its lock
+	std::size_t reading = 0; // Blocks the workers are reading.
+};
+
+namespace {
+// A few workers for the whole process, taking the streams with blocks requested in turn, one block at a time.
+// The streams request blocks without locking, like `RestartParker::request`: the state of the block, then a wake-up.
+class ReaderPool final {
+public:
+	static ReaderPool& getInstance() {
+		static ReaderPool instance;
+		return instance;
+	}
+
+	void add(ReadAheadInputStream::Shared& stream) {
+		const std::lock_guard lock(m_mutex);
+		m_streams.push_back(&stream);
+	}
+
+	// From the thread reading the stream, once a block is `Requested`
+	void wake() {
+		m_requests.fetch_add(1, std::memory_order_release);
+		m_requests.notify_one();
+	}
+
+	// Leaves the blocks still requested and waits for those being read, the blocks can go away afterwards.
+	void remove(ReadAheadInputStream::Shared& stream) {
+		std::unique_lock lock(m_mutex);
+		std::erase(m_streams, &stream);
+		m_idle.wait(lock, [&stream]() {
+			return stream.reading == 0;
+		});
+	}
+
+private:
+	ReaderPool() {
+		const unsigned int count = std::clamp(std::thread::hardware_concurrency(), 2u, 4u);
+		for (unsigned int i = 0; i < count; ++i) {
+			m_workers.emplace_back([this]() {
+				run();
+			});
+		}
+	}
+
+	~ReaderPool() {
+		m_stop = true;
+		m_requests.fetch_add(1, std::memory_order_release);
+		m_requests.notify_all();
+		for (std::thread& worker : m_workers) {
+			worker.join();
+		}
+	}
+
+	// Takes the requested block nearest the start of the next stream in turn, under the lock
+	bool claim(ReadAheadInputStream::Shared*& stream, ReadAheadInputStream::Block*& block) {
+		for (std::size_t n = 0; n < m_streams.size(); ++n) {
+			const std::size_t i = (m_turn + n) % m_streams.size();
+			ReadAheadInputStream::Block* first = nullptr;
+			for (ReadAheadInputStream::Block* b : m_streams[i]->blocks) {
+				if (b->state.load(std::memory_order_relaxed) == ReadAheadInputStream::Block::State::Requested &&
+					(first == nullptr || b->offset.load(std::memory_order_relaxed) < first->offset.load(std::memory_order_relaxed))) {
+					first = b;
+				}
+			}
+			auto expected = ReadAheadInputStream::Block::State::Requested;
+			if (first != nullptr && first->state.compare_exchange_strong(expected, ReadAheadInputStream::Block::State::Reading, std::memory_order_acquire)) {
+				stream = m_streams[i];
+				block = first;
+				m_turn = i + 1;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void run() {
+		while (!m_stop) {
+			const std::uint32_t seen = m_requests.load(std::memory_order_acquire);
+			std::unique_lock lock(m_mutex);
+			ReadAheadInputStream::Shared* stream = nullptr;
+			ReadAheadInputStream::Block*  block = nullptr;
+			while (!m_stop && claim(stream, block)) {
+				++stream->reading;
+				lock.unlock();
+
+				const std::optional<std::size_t> size = stream->file->read(block->offset.load(std::memory_order_relaxed), block->data.data(), block->data.size());
+				block->size = size.value_or(0);
+				block->state.store(size ? ReadAheadInputStream::Block::State::Ready : ReadAheadInputStream::Block::State::Failed, std::memory_order_release);
+
+				lock.lock();
+				--stream->reading;
+				m_idle.notify_all();
+			}
+			lock.unlock();
+			m_requests.wait(seen, std::memory_order_acquire);
+		}
+	}
+
+	std::mutex                                 m_mutex;
+	std::condition_variable                    m_idle;
+	std::vector<ReadAheadInputStream::Shared*> m_streams;
+	std::size_t                                m_turn = 0;
+	std::atomic<std::uint32_t>                 m_requests{ 0 };
+	std::atomic<bool>                          m_stop{ false };
+	std::vector<std::thread>                   m_workers;
+};
+}
+
+ReadAheadInputStream::ReadAheadInputStream(std::size_t window, std::size_t blockSize) :
+	m_window(std::max<std::size_t>(window, 1)),
+	m_blockSize(std::max<std::size_t>(blockSize, 4096)) {}
+
+ReadAheadInputStream::~ReadAheadInputStream() {
+	close();
+}
+
+void ReadAheadInputStream::close() {
+	// The workers are done with the blocks before they go away
+	if (m_shared != nullptr) {
+		ReaderPool::getInstance().remove(*m_shared);
+		m_shared.reset();
+	}
+}
+
+bool ReadAheadInputStream::open(const std::filesystem::path& filename) {
+	close();
+	m_position = 0;
+	m_stats = {};
+
+	// The window and the block behind, twice, so that a seek finds free blocks while the dropped ones are still read.
+	m_blocks.resize((m_window + 2) * 2);
+	for (std::unique_ptr<Block>& block : m_blocks) {
+		block = std::make_unique<Block>();
+		block->data.resize(m_blockSize);
+	}
+
+	std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+	shared->file = SharedFile::open(filename);
+	if (shared->file == nullptr) {
+		err() << "Failed to open file for reading ahead: " << filename << std::endl;
+		return false;
+	}
+	m_size = static_cast<std::size_t>(shared->file->getSize());
+	for (const std::unique_ptr<Block>& block : m_blocks) {
+		shared->blocks.push_back(block.get());
+	}
+	ReaderPool::getInstance().add(*shared);
+	m_shared = std::move(shared);
+	return true;
+}
+
+ReadAheadInputStream::Stats ReadAheadInputStream::getStats() const {
+	return m_stats;
+}
+
+ReadAheadInputStream::Block* ReadAheadInputStream::request(std::uint64_t index) {
+	const std::uint64_t offset = index * m_blockSize;
+	for (const std::unique_ptr<Block>& block : m_blocks) {
+		if (block->listed && block->offset.load(std::memory_order_relaxed) == offset) {
+			return block.get();
+		}
+	}
+
+	// Recycle a block out of the window whose read is over, none if they are all still read
+	for (const std::unique_ptr<Block>& block : m_blocks) {
+		if (!block->listed && block->isFree()) {
+			block->offset.store(offset, std::memory_order_relaxed);
+			block->size = 0;
+			block->listed = true;
+			block->state.store(Block::State::Requested, std::memory_order_release);
+			++m_stats.blocksRead;
+			ReaderPool::getInstance().wake();
+			return block.get();
+		}
+	}
+	return nullptr;
+}
+
+std::optional<std::size_t> ReadAheadInputStream::read(void* data, std::size_t size) {
+	if (m_shared == nullptr) {
+		return std::nullopt;
+	}
+	++m_stats.reads;
+
+	std::size_t done = 0;
+	while (done < size && m_position < m_size) {
+		const std::uint64_t index = m_position / m_blockSize;
+		release(index);
+		Block* block = request(index);
+		const Block::State state = block != nullptr ? block->state.load(std::memory_order_acquire) : Block::State::Free;
+
+		if (state == Block::State::Failed) {
+			block->listed = false; // Retried by the next read.
+			return done != 0 ? std::optional<std::size_t>(done) : std::nullopt;
+		}
+		const std::size_t skip = m_position - static_cast<std::size_t>(index * m_blockSize);
+		std::size_t count = 0;
+		if (state == Block::State::Ready) {
+			if (block->size <= skip) {
+				break; // The file is shorter than it was when opened.
+			}
+			count = std::min(size - done, block->size - skip);
+			std::memcpy(static_cast<std::byte*>(data) + done, block->data.data() + skip, count);
+		}
+		else {
+			// Not read yet: read the rest of the block from the file right away, the worker carries on with it for later reads
+			const auto start = std::chrono::steady_clock::now();
+			const std::optional<std::size_t> n = m_shared->file->read(m_position, static_cast<std::byte*>(data) + done, std::min(size - done, m_blockSize - skip));
+			const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+			++m_stats.stalls;
+			m_stats.maxStall = std::max(m_stats.maxStall, microseconds(elapsed.count()));
+			if (!n) {
+				return done != 0 ? std::optional<std::size_t>(done) : std::nullopt;
+			}
+			if (*n == 0) {
+				break;
+			}
+			count = *n;
+		}
+		done += count;
+		m_position += count;
+	}
+
+	// Keep the window ahead of the position in flight, and the block behind for short steps back.
+	const std::uint64_t current = m_position / m_blockSize;
+	const std::uint64_t last = (m_size + m_blockSize - 1) / m_blockSize;
+	release(current);
+	for (std::uint64_t i = current; i < std::min<std::uint64_t>(current + m_window + 1, last); ++i) {
+		(void)request(i);
+	}
+	return done;
+}
+
+void ReadAheadInputStream::release(std::uint64_t current) {
+	for (const std::unique_ptr<Block>& block : m_blocks) {
+		const std::uint64_t index = block->offset.load(std::memory_order_relaxed) / m_blockSize;
+		if (block->listed && (index + 1 < current || index > current + m_window)) {
+			block->listed = false;
+			// Taken back unless a worker has it already
+			Block::State expected = Block::State::Requested;
+			(void)block->state.compare_exchange_strong(expected, Block::State::Free, std::memory_order_relaxed);
+		}
+	}
+}
+
+std::optional<std::size_t> ReadAheadInputStream::seek(std::size_t position) {
+	if (m_shared == nullptr || position > m_size) {
+		return std::nullopt;
+	}
+	m_position = position;
+	return m_position;
+}
+
+std::optional<std::size_t> ReadAheadInputStream::tell() {
+	if (m_shared == nullptr) {
+		return std::nullopt;
+	}
+	return m_position;
+}
+
+std::optional<std::size_t> ReadAheadInputStream::getSize() {
+	if (m_shared == nullptr) {
+		return std::nullopt;
+	}
+	return m_size;
+}
+
+}
@@ -0,0 +1,235 @@
+﻿#pragma once
+
+#include "BgmHeader.h"
+#include <SFML/System/InputStream.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace bgm {
+
+////////////////////////////////////////////////////////////
+/// \brief Stream serving a pinned byte range from memory
+///
+/// Reads inside the region are copied from memory, everything
+/// else is read from the source stream. Several streams on the
+/// same data can share one region.
+///
+/// Not thread-safe: setting the region must be serialized with
+/// the reads, like any other use of the stream.
+///
+////////////////////////////////////////////////////////////
+class RegionInputStream final : public InputStream {
+public:
+	struct Region {
+		std::uint64_t offset = 0;                           //!< Position of the first pinned byte
+		std::shared_ptr<const std::vector<std::byte>> bytes; //!< Pinned bytes, none if empty
+	};
+
+	explicit RegionInputStream(std::shared_ptr<InputStream> source);
+
+	void setRegion(Region region);
+	[[nodiscard]] const Region& getRegion() const;
+
+	/// \brief Number of reads that went to the source stream so far
+	[[nodiscard]] std::uint64_t getSourceReads() const;
+
+	[[nodiscard]] std::optional<std::size_t> read(void* data, std::size_t size) override;
+	[[nodiscard]] std::optional<std::size_t> seek(std::size_t position) override;
+	[[nodiscard]] std::optional<std::size_t> tell() override;
+	std::optional<std::size_t> getSize() override;
+
+private:
+	std::shared_ptr<InputStream> m_source;
+	Region                       m_region;
+	std::size_t                  m_position = 0;
+	std::optional<std::size_t>   m_sourcePosition; //!< Position of the source, if known
+	std::uint64_t                m_sourceReads = 0;
+};
+
+////////////////////////////////////////////////////////////
+/// \brief File read at given positions, by any number of threads at once
+///
+/// Each read names its position, so one handle serves all the
+/// streams on the file without a lock between them.
+///
+////////////////////////////////////////////////////////////
+class SharedFile final {
+public:
+	~SharedFile();
+
+	SharedFile(const SharedFile&) = delete;
+	SharedFile& operator=(const SharedFile&) = delete;
+
+	[[nodiscard]] static std::shared_ptr<const SharedFile> open(const std::filesystem::path& filename);
+
+	/// \brief Read up to `size` bytes from `position`, fewer at the end of the file
+	[[nodiscard]] std::optional<std::size_t> read(std::uint64_t position, void* data, std::size_t size) const;
+
+	[[nodiscard]] std::uint64_t getSize() const;
+
+private:
+	SharedFile() = default;
+
+	std::intptr_t m_handle = -1; //!< File descriptor, or HANDLE on Windows
+	std::uint64_t m_size = 0;
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Stream showing a byte range of a shared file as a whole
+///
+/// Used to read one music out of a pack file: all the musics of
+/// the pack, and their restart decoders, read the same handle.
+///
+////////////////////////////////////////////////////////////
+class SliceInputStream final : public InputStream {
+public:
+	SliceInputStream(std::shared_ptr<const SharedFile> file, std::uint64_t offset, std::uint64_t size);
+
+	[[nodiscard]] std::optional<std::size_t> read(void* data, std::size_t size) override;
+	[[nodiscard]] std::optional<std::size_t> seek(std::size_t position) override;
+	[[nodiscard]] std::optional<std::size_t> tell() override;
+	std::optional<std::size_t> getSize() override;
+
+private:
+	std::shared_ptr<const SharedFile> m_file;
+	std::uint64_t                     m_offset;
+	std::uint64_t                     m_size;
+	std::size_t                       m_position = 0;
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Stream over a source that can only be read forward
+///
+/// Made for pipes and sockets. The bytes read are kept until
+/// `release`, so that the tag scan and the decoder can go back
+/// to the start and read them again; the source itself is read
+/// once, in order. Seeking forward reads and skips the bytes in
+/// between, seeking back is only possible to the kept bytes.
+///
+/// Reading never frees the kept bytes: once read past, they are
+/// given away by `takeKept`, to be freed on another thread.
+///
+/// While probing, seeking where the stream already is fails,
+/// which is how vorbisfile tests whether it can seek: it then
+/// decodes forward only, instead of looking for the end.
+///
+////////////////////////////////////////////////////////////
+class ForwardInputStream final : public InputStream {
+public:
+	explicit ForwardInputStream(std::shared_ptr<InputStream> source);
+
+	void setProbing(bool probing);
+
+	/// \brief Stop keeping the bytes read, those kept are dropped now if already read past
+	void release();
+
+	/// \brief Number of bytes kept to be read again
+	[[nodiscard]] std::size_t getKeptSize() const;
+
+	/// \brief Give the kept bytes away once released and read past, nothing before
+	[[nodiscard]] std::vector<std::byte> takeKept();
+
+	[[nodiscard]] std::optional<std::size_t> read(void* data, std::size_t size) override;
+	[[nodiscard]] std::optional<std::size_t> seek(std::size_t position) override;
+	[[nodiscard]] std::optional<std::size_t> tell() override;
+	std::optional<std::size_t> getSize() override;
+
+private:
+	std::optional<std::size_t> readSource(void* data, std::size_t size);
+
+	std::shared_ptr<InputStream> m_source;
+	std::vector<std::byte>       m_kept;           //!< First bytes of the source
+	bool                         m_keeping = true; //!< Whether the bytes read are added to `m_kept`
+	bool                         m_probing = false;
+	std::size_t                  m_position = 0;
+	std::size_t                  m_sourcePosition = 0; //!< Bytes read from the source
+};
+
+////////////////////////////////////////////////////////////
+/// \brief Stream over bytes in memory, keeping them alive
+///
+/// The bytes are shared, not copied: every stream on them, in
+/// any number of musics, holds a reference.
+///
+////////////////////////////////////////////////////////////
+class SharedMemoryInputStream final : public InputStream {
+public:
+	SharedMemoryInputStream(std::shared_ptr<const std::byte[]> data, std::size_t size);
+
+	[[nodiscard]] std::optional<std::size_t> read(void* data, std::size_t size) override;
+	[[nodiscard]] std::optional<std::size_t> seek(std::size_t position) override;
+	[[nodiscard]] std::optional<std::size_t> tell() override;
+	std::optional<std::size_t> getSize() override;
+
+private:
+	std::shared_ptr<const std::byte[]> m_data;
+	std::size_t                        m_size;
+	std::size_t                        m_position = 0;
+};
+
+////////////////////////////////////////////////////////////
+/// \brief File stream keeping a window of reads ahead in flight
+///
+/// The file is read in blocks. Each read of the stream requests
+/// the blocks following its position in the background, so that
+/// the decoder, reading on the audio thread, finds them resident
+/// instead of waiting on the disk.
+///
+/// Reads are done by a few worker threads shared by all the
+/// streams of the process. Each stream queues its own blocks,
+/// the workers take the streams with blocks queued in turn, and
+/// read them at their offset from a `SharedFile`, several
+/// workers at once on the same stream if need be.
+///
+/// The blocks are allocated by `open`, and recycled from then on,
+/// so reading the stream doesn't allocate. Nor does it lock or
+/// wait for the workers: a block they haven't read yet is read
+/// from the file right away instead, and counted as a stall.
+///
+////////////////////////////////////////////////////////////
+class ReadAheadInputStream final : public InputStream {
+public:
+	struct Stats {
+		std::uint64_t reads{};       //!< Reads of the stream
+		std::uint64_t stalls{};      //!< Blocks read by the stream itself, not read ahead yet
+		Time          maxStall{};    //!< Longest of those reads so far
+		std::uint64_t blocksRead{};  //!< Blocks read from the file
+	};
+
+	explicit ReadAheadInputStream(std::size_t window = 8, std::size_t blockSize = 65536);
+	~ReadAheadInputStream() override;
+
+	ReadAheadInputStream(const ReadAheadInputStream&) = delete;
+	ReadAheadInputStream& operator=(const ReadAheadInputStream&) = delete;
+
+	[[nodiscard]] bool open(const std::filesystem::path& filename);
+
+	[[nodiscard]] Stats getStats() const;
+
+	[[nodiscard]] std::optional<std::size_t> read(void* data, std::size_t size) override;
+	[[nodiscard]] std::optional<std::size_t> seek(std::size_t position) override;
+	[[nodiscard]] std::optional<std::size_t> tell() override;
+	std::optional<std::size_t> getSize() override;
+
+	struct Block;
+	struct Shared;
+
+private:
+	Block* request(std::uint64_t index);
+	void release(std::uint64_t current);
+	void close();
+
+	const std::size_t                          m_window;
+	const std::size_t                          m_blockSize;
+	std::shared_ptr<Shared>                    m_shared; //!< Null until opened
+	std::vector<std::unique_ptr<Block>>        m_blocks; //!< Blocks of the window, and free ones
+	std::size_t                                m_position = 0;
+	std::size_t                                m_size = 0;
+	Stats                                      m_stats;
+};
+
+}
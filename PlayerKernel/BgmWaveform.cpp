@@ -0,0 +1,222 @@
+﻿#include "BgmWaveform.h"
+#include "BgmCache.h"
+
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <string>
+
+namespace bgm {
+
+namespace {
+constexpr char WaveformMagic[8] = { 'O', 'H', 'M', 'S', 'W', 'A', 'V', '2' };
+
+// Plain loops over the interleaved samples, which the compiler turns into packed min/max.
+Waveform::Peak getPeak(const std::int16_t* samples, std::size_t count) {
+	std::int16_t low = 0;
+	std::int16_t high = 0;
+	for (std::size_t i = 0; i < count; ++i) {
+		low = std::min(low, samples[i]);
+		high = std::max(high, samples[i]);
+	}
+	return { low, high };
+}
+
+Waveform::Peak merge(Waveform::Peak a, Waveform::Peak b) {
+	return { std::min(a.min, b.min), std::max(a.max, b.max) };
+}
+}
+
+bool Waveform::build(const std::filesystem::path& filename, const std::atomic<bool>* cancel) {
+	InputSoundFile file;
+	if (!file.openFromFile(filename) || file.getChannelCount() == 0) {
+		err() << "Failed to open file to draw its waveform: " << filename << std::endl;
+		return false;
+	}
+
+	const std::size_t channelCount = file.getChannelCount();
+	const std::size_t bucketSamples = BucketFrames[0] * channelCount;
+	std::vector<Peak>& peaks = m_levels[0];
+	peaks.clear();
+	peaks.reserve(static_cast<std::size_t>(file.getSampleCount() / bucketSamples + 1));
+
+	// Whole buckets per read, so that a bucket never spans two reads
+	std::vector<std::int16_t> samples(bucketSamples * 256);
+	std::uint64_t frameCount = 0;
+	while (true) {
+		if (cancel != nullptr && *cancel) {
+			return false;
+		}
+		const std::size_t count = static_cast<std::size_t>(file.read(samples.data(), samples.size()));
+		for (std::size_t i = 0; i < count; i += bucketSamples) {
+			peaks.push_back(getPeak(samples.data() + i, std::min(bucketSamples, count - i)));
+		}
+		frameCount += count / channelCount;
+		if (count < samples.size()) {
+			break;
+		}
+	}
+
+	m_frameCount = frameCount;
+	m_sampleRate = file.getSampleRate();
+	buildLevels();
+	return true;
+}
+
+bool Waveform::loadFromFile(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime) {
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+
+	char magic[8]{};
+	std::uint64_t size = 0;
+	std::int64_t time = 0;
+	std::uint64_t frameCount = 0;
+	std::uint32_t sampleRate = 0;
+	std::uint64_t count = 0;
+	file.read(magic, 8);
+	file.read(reinterpret_cast<char*>(&size), 8);
+	file.read(reinterpret_cast<char*>(&time), 8);
+	file.read(reinterpret_cast<char*>(&frameCount), 8);
+	file.read(reinterpret_cast<char*>(&sampleRate), 4);
+	file.read(reinterpret_cast<char*>(&count), 8);
+	if (!file || std::string(magic, 8) != std::string(WaveformMagic, 8) || size != sourceSize || time != sourceTime ||
+		count != (frameCount + BucketFrames[0] - 1) / BucketFrames[0]) {
+		return false;
+	}
+
+	std::vector<Peak> peaks(static_cast<std::size_t>(count));
+	file.read(reinterpret_cast<char*>(peaks.data()), static_cast<std::streamsize>(count * sizeof(Peak)));
+	if (!file) {
+		return false;
+	}
+
+	m_frameCount = frameCount;
+	m_sampleRate = sampleRate;
+	m_levels[0] = std::move(peaks);
+	buildLevels();
+	return true;
+}
+
+bool Waveform::saveToFile(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime) const {
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		err() << "Failed to create waveform file: " << filename << std::endl;
+		return false;
+	}
+
+	const std::uint32_t sampleRate = m_sampleRate;
+	const std::uint64_t count = m_levels[0].size();
+	file.write(WaveformMagic, 8);
+	file.write(reinterpret_cast<const char*>(&sourceSize), 8);
+	file.write(reinterpret_cast<const char*>(&sourceTime), 8);
+	file.write(reinterpret_cast<const char*>(&m_frameCount), 8);
+	file.write(reinterpret_cast<const char*>(&sampleRate), 4);
+	file.write(reinterpret_cast<const char*>(&count), 8);
+	file.write(reinterpret_cast<const char*>(m_levels[0].data()), static_cast<std::streamsize>(count * sizeof(Peak)));
+	if (!file) {
+		err() << "Failed to write waveform file: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void Waveform::query(std::uint64_t beginFrame, std::uint64_t endFrame, Peak* out, std::size_t pixels) const {
+	if (pixels == 0) {
+		return;
+	}
+	endFrame = std::max(endFrame, beginFrame + 1);
+	const std::uint64_t framesPerPixel = std::max<std::uint64_t>((endFrame - beginFrame) / pixels, 1);
+	std::size_t level = 0;
+	while (level + 1 < LevelCount && BucketFrames[level + 1] <= framesPerPixel) {
+		++level;
+	}
+
+	const std::vector<Peak>& peaks = m_levels[level];
+	const std::uint64_t bucketFrames = BucketFrames[level];
+	for (std::size_t i = 0; i < pixels; ++i) {
+		const std::uint64_t from = beginFrame + (endFrame - beginFrame) * i / pixels;
+		const std::uint64_t to = std::max(beginFrame + (endFrame - beginFrame) * (i + 1) / pixels, from + 1);
+		if (from >= m_frameCount) {
+			out[i] = Peak{};
+			continue;
+		}
+		const std::uint64_t first = std::min<std::uint64_t>(from / bucketFrames, peaks.size());
+		const std::uint64_t last = std::min<std::uint64_t>((to + bucketFrames - 1) / bucketFrames, peaks.size());
+		Peak peak;
+		for (std::uint64_t b = first; b < last; ++b) {
+			peak = merge(peak, peaks[static_cast<std::size_t>(b)]);
+		}
+		out[i] = peak;
+	}
+}
+
+std::uint64_t Waveform::getFrameCount() const {
+	return m_frameCount;
+}
+
+unsigned int Waveform::getSampleRate() const {
+	return m_sampleRate;
+}
+
+void Waveform::buildLevels() {
+	for (std::size_t level = 1; level < LevelCount; ++level) {
+		const std::vector<Peak>& finer = m_levels[level - 1];
+		const std::size_t ratio = BucketFrames[level] / BucketFrames[level - 1];
+		std::vector<Peak>& peaks = m_levels[level];
+		peaks.assign((finer.size() + ratio - 1) / ratio, Peak{});
+		for (std::size_t i = 0; i < finer.size(); ++i) {
+			peaks[i / ratio] = merge(peaks[i / ratio], finer[i]);
+		}
+	}
+}
+
+std::filesystem::path getWaveformSidecar(const std::filesystem::path& filename) {
+	return std::filesystem::path(filename).concat(".ohmswave");
+}
+
+struct WaveformLoader::Impl {
+	std::shared_future<std::shared_ptr<const Waveform>> result;
+	std::atomic<bool>                                   cancel{ false };
+};
+
+WaveformLoader::WaveformLoader(const std::filesystem::path& filename) :
+	m_impl(std::make_unique<Impl>()) {
+	m_impl->result = std::async(std::launch::async, [filename, cancel = &m_impl->cancel]() -> std::shared_ptr<const Waveform> {
+		PcmCache::Key key;
+		if (!PcmCache::makeKey(filename, key)) {
+			err() << "Failed to open file to draw its waveform: " << filename << std::endl;
+			return nullptr;
+		}
+
+		std::shared_ptr<Waveform> waveform = std::make_shared<Waveform>();
+		const std::filesystem::path sidecar = getWaveformSidecar(filename);
+		if (waveform->loadFromFile(sidecar, key.sourceSize, key.sourceTime)) {
+			return waveform;
+		}
+		if (!waveform->build(filename, cancel)) {
+			return nullptr;
+		}
+		(void)waveform->saveToFile(sidecar, key.sourceSize, key.sourceTime);
+		return waveform;
+	}).share();
+}
+
+WaveformLoader::~WaveformLoader() {
+	// Only the read in progress is waited for
+	m_impl->cancel = true;
+	m_impl->result.wait();
+}
+
+bool WaveformLoader::isReady() const {
+	return m_impl->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+std::shared_ptr<const Waveform> WaveformLoader::get() const {
+	return isReady() ? m_impl->result.get() : nullptr;
+}
+
+}
@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include "BgmHeader.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+namespace bgm {
+
+////////////////////////////////////////////////////////////
+/// \brief Min/max peaks of a music at a few resolutions, to draw its waveform
+///
+/// Channels are merged, each bucket keeps the extremes of all of
+/// them. The finest level is computed from the samples, each
+/// coarser one from the level under it.
+///
+////////////////////////////////////////////////////////////
+class Waveform final {
+public:
+	struct Peak {
+		std::int16_t min = 0;
+		std::int16_t max = 0;
+	};
+
+	static constexpr std::size_t LevelCount = 3;
+	static constexpr std::array<std::uint32_t, LevelCount> BucketFrames = { 256, 4096, 65536 };
+
+	// Decodes the whole file once, gives up when `cancel` is set.
+	[[nodiscard]] bool build(const std::filesystem::path& filename, const std::atomic<bool>* cancel = nullptr);
+
+	// Sidecar keeping the finest level, checked against the size and modification time of the music (see `PcmCache::makeKey`).
+	[[nodiscard]] bool loadFromFile(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime);
+	bool saveToFile(const std::filesystem::path& filename, std::uint64_t sourceSize, std::int64_t sourceTime) const;
+
+	////////////////////////////////////////////////////////////
+	/// \brief Get one peak per pixel for a range of the music
+	///
+	/// Reads the coarsest level whose buckets are not wider than
+	/// a pixel, so each pixel merges fewer than 16 buckets
+	/// whatever the zoom.
+	///
+	/// \param beginFrame First sample frame of the range
+	/// \param endFrame   Sample frame after the range
+	/// \param out        Receives `pixels` peaks, silent past the end of the music
+	/// \param pixels     Width of the drawing
+	///
+	////////////////////////////////////////////////////////////
+	void query(std::uint64_t beginFrame, std::uint64_t endFrame, Peak* out, std::size_t pixels) const;
+
+	[[nodiscard]] std::uint64_t getFrameCount() const;
+	[[nodiscard]] unsigned int getSampleRate() const;
+
+private:
+	void buildLevels();
+
+	std::uint64_t                             m_frameCount = 0;
+	unsigned int                              m_sampleRate = 0;
+	std::array<std::vector<Peak>, LevelCount> m_levels;
+};
+
+[[nodiscard]] std::filesystem::path getWaveformSidecar(const std::filesystem::path& filename);
+
+////////////////////////////////////////////////////////////
+/// \brief Gets the waveform of a file in the background
+///
+/// Loads the sidecar of the file, or builds the waveform and
+/// saves it, on a thread of its own. The destructor cancels the
+/// build and waits for the thread, which stops after the read
+/// in progress (65536 frames), instead of the whole decode.
+///
+////////////////////////////////////////////////////////////
+class WaveformLoader final {
+public:
+	explicit WaveformLoader(const std::filesystem::path& filename);
+	~WaveformLoader();
+
+	[[nodiscard]] bool isReady() const;
+
+	// Null until ready, or if the file can't be decoded.
+	[[nodiscard]] std::shared_ptr<const Waveform> get() const;
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> m_impl;
+};
+
+}
@@ -2,12 +2,15 @@
 
 PlayerKernel::BgmWrapper::BgmWrapper() {
 	m_bgm = new bgm::Music;
+	m_waveform = nullptr;
 	m_ok = false;
 }
 
 PlayerKernel::BgmWrapper::~BgmWrapper() {
 	delete m_bgm;
 	m_bgm = nullptr;
+	delete m_waveform;
+	m_waveform = nullptr;
 }
 
 void PlayerKernel::BgmWrapper::open(String^ filename) {
@@ -24,6 +27,30 @@ void PlayerKernel::BgmWrapper::open(String^ filename) {
 		throw gcnew System::Exception(L"Failed to open");
 	}
 
+	delete m_waveform;
+	m_waveform = new bgm::WaveformLoader(str);
+	m_ok = true;
+}
+
+void PlayerKernel::BgmWrapper::openMemory(array<Byte>^ data) {
+	if (data == nullptr) {
+		throw gcnew System::ArgumentNullException(L"data");
+	}
+
+	// The array stays pinned, and is read in place, until the last music using it lets it go
+	Runtime::InteropServices::GCHandle handle = Runtime::InteropServices::GCHandle::Alloc(data, Runtime::InteropServices::GCHandleType::Pinned);
+	const std::byte* bytes = static_cast<const std::byte*>(handle.AddrOfPinnedObject().ToPointer());
+	void* cookie = Runtime::InteropServices::GCHandle::ToIntPtr(handle).ToPointer();
+	std::shared_ptr<const std::byte[]> shared(bytes, [cookie](const std::byte*) {
+		Runtime::InteropServices::GCHandle::FromIntPtr(IntPtr(cookie)).Free();
+	});
+
+	if (!m_bgm->openFromMemory(std::move(shared), static_cast<std::size_t>(data->Length))) {
+		throw gcnew System::Exception(L"Failed to open");
+	}
+
+	delete m_waveform;
+	m_waveform = nullptr;
 	m_ok = true;
 }
 
@@ -49,7 +76,7 @@ float PlayerKernel::BgmWrapper::getDuration() {
 }
 
 float PlayerKernel::BgmWrapper::getOffset() {
-	return m_bgm->getPlayingOffset().asSeconds();
+	return m_bgm->snapshot().position.asSeconds();
 }
 
 void PlayerKernel::BgmWrapper::setOffset(float seconds) {
@@ -64,3 +91,26 @@ UInt64 PlayerKernel::BgmWrapper::getLoopPointB() {
 	auto l = m_bgm->getLoopPoints();
 	return (l.offset + l.length).asMicroseconds();
 }
+
+bool PlayerKernel::BgmWrapper::isWaveformReady() {
+	return m_waveform != nullptr && m_waveform->isReady();
+}
+
+array<Int16>^ PlayerKernel::BgmWrapper::getWaveform(float beginSeconds, float endSeconds, int pixels) {
+	// Min and max of each pixel, or null while the waveform is being built
+	std::shared_ptr<const bgm::Waveform> waveform = m_waveform != nullptr ? m_waveform->get() : nullptr;
+	if (waveform == nullptr || pixels <= 0) {
+		return nullptr;
+	}
+
+	std::vector<bgm::Waveform::Peak> peaks(static_cast<std::size_t>(pixels));
+	const double rate = waveform->getSampleRate();
+	waveform->query(static_cast<std::uint64_t>(std::max(beginSeconds, 0.f) * rate), static_cast<std::uint64_t>(std::max(endSeconds, 0.f) * rate), peaks.data(), peaks.size());
+
+	array<Int16>^ res = gcnew array<Int16>(pixels * 2);
+	for (int i = 0; i < pixels; ++i) {
+		res[i * 2] = peaks[i].min;
+		res[i * 2 + 1] = peaks[i].max;
+	}
+	return res;
+}
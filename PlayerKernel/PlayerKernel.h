@@ -3,12 +3,14 @@
 using namespace System;
 
 #include "Bgm.h"
+#include "BgmWaveform.h"
 
 namespace PlayerKernel {
 
 public ref class BgmWrapper {
 private:
 	bgm::Music* m_bgm;
+	bgm::WaveformLoader* m_waveform;
 	bool m_ok;
 
 public:
@@ -17,6 +19,7 @@ public:
 	~BgmWrapper();
 
 	void open(String^ filename);
+	void openMemory(array<Byte>^ data);
 
 	bool isOpened();
 
@@ -31,6 +34,9 @@ public:
 	UInt64 getLoopPointA();
 	UInt64 getLoopPointB();
 
+	bool isWaveformReady();
+	array<Int16>^ getWaveform(float beginSeconds, float endSeconds, int pixels);
+
 };
 
 }
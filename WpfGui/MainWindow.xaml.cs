@@ -24,6 +24,7 @@ namespace WpfGui {
 		private bool isDragging = false;
 		private readonly BgmWrapper bgm = new();
 		private float m_duration = 0;
+		private bool waveformDrawn = false;
 
 		public MainWindow() {
 			InitializeComponent();
@@ -43,6 +44,9 @@ namespace WpfGui {
 				int m = (int)float.Round(off * 10) % 10;
 				timeCurrent.Text = string.Format("{0:d2}:{1:d2}.{2}", sec / 60, sec % 60, m);
 			}
+			if (!waveformDrawn && bgm.isWaveformReady()) {
+				DrawWaveform();
+			}
 		}
 
 		private void ProgressSlider_DragStarted(object sender, DragStartedEventArgs e) {
@@ -68,6 +72,39 @@ namespace WpfGui {
 			bgm.setOffset((float)newValue);
 		}
 
+		private void WaveformCanvas_SizeChanged(object sender, SizeChangedEventArgs e) {
+			DrawWaveform();
+		}
+
+		// 波形由内核在后台生成，生成完之前不画
+		private void DrawWaveform() {
+			int pixels = (int)waveformCanvas.ActualWidth;
+			short[]? peaks = bgm.isOpened() && pixels > 0 ? bgm.getWaveform(0, m_duration, pixels) : null;
+			if (peaks == null) {
+				return;
+			}
+			waveformDrawn = true;
+
+			double half = waveformCanvas.ActualHeight / 2;
+			StreamGeometry geometry = new();
+			using (StreamGeometryContext context = geometry.Open()) {
+				for (int i = 0; i < pixels; ++i) {
+					context.BeginFigure(new Point(i + 0.5, half - peaks[i * 2 + 1] * half / 32768), false, false);
+					context.LineTo(new Point(i + 0.5, half - peaks[i * 2] * half / 32768 + 1), true, false);
+				}
+			}
+			geometry.Freeze();
+			waveformPath.Data = geometry;
+
+			// 循环区间
+			double a = bgm.getLoopPointA() / 1e6 / m_duration * pixels;
+			double b = bgm.getLoopPointB() / 1e6 / m_duration * pixels;
+			Canvas.SetLeft(loopRegion, a);
+			loopRegion.Width = Math.Max(b - a, 0);
+			loopRegion.Height = waveformCanvas.ActualHeight;
+			loopRegion.Visibility = Visibility.Visible;
+		}
+
 		// 在播放开始时启动定时器
 		private void PlayMedia() {
 			//MediaPlayer.Play();
@@ -149,6 +186,11 @@ namespace WpfGui {
 
 			timeCurrent.Text = "00:00.0";
 			progressSlider.Value = 0;
+
+			waveformDrawn = false;
+			waveformPath.Data = null;
+			loopRegion.Visibility = Visibility.Collapsed;
+			DrawWaveform();
 		}
 	}
 }